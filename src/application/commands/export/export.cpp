@@ -43,11 +43,13 @@ void saveVolumeAsImages(Volume& volume, const Metadata& metadata, const std::str
 
 		//Image image(width, height);
 		std::vector<uint8> imageData;
+		std::vector<MaterialId> slice(int64(upper_x - lower_x + 1) * (upper_y - lower_y + 1));
+		volume.extractRegion(Box3i({ lower_x, lower_y, z }, { upper_x, upper_y, z }), slice.data());
 		for (int y = lower_y; y <= upper_y; y++)
 		{
 			for (int x = lower_x; x <= upper_x; x++)
 			{
-				MaterialId matId = volume.voxel(x, y, z);
+				MaterialId matId = slice[int64(y - lower_y) * (upper_x - lower_x + 1) + (x - lower_x)];
 
 				Col base_color = metadata.materials.at(matId).base_color;
 
@@ -117,7 +119,7 @@ Examples:
 	std::filesystem::path inputPath(args.positional().at(2));
 	if (!checkInputFileIsValid(inputPath)) return false;
 
-	Volume volume(inputPath.string());
+	Volume volume(inputPath.string(), true); // Mapped rather than read, as we never modify it
 	Metadata metadata = loadMetadataForVolume(inputPath);
 
 	if(format == "vox") {
@@ -61,6 +61,12 @@ uint8_t volume_vox_writer::voxel(const vec3i& position)
 	return m_vol.voxel(position.x, position.y, position.z);
 }
 
+void volume_vox_writer::voxels(const box& bounds, uint8_t* out)
+{
+	Box3i region({ bounds.lower.x, bounds.lower.y, bounds.lower.z }, { bounds.upper.x, bounds.upper.y, bounds.upper.z });
+	m_vol.extractRegion(region, out);
+}
+
 void volume_vox_writer::on_progress(int done, int total)
 {
 	if(done == 0) {
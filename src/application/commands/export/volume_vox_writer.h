@@ -15,6 +15,7 @@ public:
 protected:
 	box  bounds() override;
 	uint8_t voxel(const vec3i& position) override;
+	void    voxels(const box& bounds, uint8_t* out) override;
 
 	void    on_progress(int done, int total) override;
 
@@ -101,6 +101,18 @@ void vox_writer::set_palette(int index, const color& col)
 	m_palette[index - 1] = col;
 }
 
+void vox_writer::voxels(const box& bounds, uint8_t* out)
+{
+	// Can optionally be implemented more efficiently by subclasses.
+	for (int z = bounds.lower.z; z <= bounds.upper.z; z++) {
+		for (int y = bounds.lower.y; y <= bounds.upper.y; y++) {
+			for (int x = bounds.lower.x; x <= bounds.upper.x; x++) {
+				*out++ = voxel({ x, y, z });
+			}
+		}
+	}
+}
+
 void vox_writer::on_progress(int /*done*/, int /*total*/)
 {
 	// Empty - can optionally be implemented by subclasses.
@@ -298,11 +310,15 @@ void vox_writer::write_main()
 		std::vector<int32_t> voxels;
 		const auto& lower = mdl.clipped_bounds.lower;
 		const auto& upper = mdl.clipped_bounds.upper;
+		std::vector<uint8_t> dense((upper.x - lower.x + 1) *
+			(upper.y - lower.y + 1) * (upper.z - lower.z + 1));
+		this->voxels(mdl.clipped_bounds, dense.data());
+		const uint8_t* next = dense.data();
 		for (int z = lower.z; z <= upper.z; z++) {
 			for (int y = lower.y; y <= upper.y; y++) {
 				for (int x = lower.x; x <= upper.x; x++) {
 
-					int i = voxel({ x, y, z });
+					int i = *next++;
 					if (i > 0) {
 						voxels.push_back((x - mdl.bounds.lower.x) |
 							((y - mdl.bounds.lower.y) << 8 ) |
@@ -112,6 +112,13 @@ protected:
 	// from multiple threads in multithreaded mode.
 	virtual uint8_t voxel(const vec3i& position) = 0;
 
+	// Optionally override this function to get all the voxels within a box at
+	// once (if your data structure can do this faster than one at a time). The
+	// voxels are written with x varying fastest, then y, then z. By default it
+	// calls voxel() for each position, and like voxel() it may be called
+	// concurrently from multiple threads in multithreaded mode.
+	virtual void    voxels(const box& bounds, uint8_t* out);
+
 	// Optionally override this function to monitor progress. Note that it may
 	// be called concurrently from multiple threads in multithreaded mode.
 	virtual void    on_progress(int done, int total);
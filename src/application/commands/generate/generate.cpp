@@ -19,6 +19,7 @@
 #include "storage.h"
 
 #include <filesystem>
+#include <optional>
 
 using namespace Cubiquity;
 using namespace Internals;
@@ -51,6 +52,35 @@ bool mengerSponge(int x, int y, int z)
 	return occupied;
 }
 
+// Reports that a box is empty if it lies entirely within one of the sponge's holes. The solid parts are full of
+// small holes, so there is little to gain by trying to classify them too. Matches mengerSponge() (so also 8 levels).
+std::optional<MaterialId> classifyMengerSponge(const Box3i& bounds)
+{
+	int levels = 8;
+	int cellSize = 1;
+
+	for (int i = 0; i < levels; i++)
+	{
+		// Count the axes along which the whole box is in the middle third of a cell at this level.
+		int count = 0;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int lower = bounds.lower()[axis] / cellSize;
+			int upper = bounds.upper()[axis] / cellSize;
+			if (lower == upper && lower % 3 == 1) count++;
+		}
+
+		if (count >= 2)
+		{
+			return 0;
+		}
+
+		cellSize *= 3;
+	}
+
+	return std::nullopt;
+}
+
 bool generateVolume(const flags::args& args)
 {
 	//const auto type{ args.positional().at(1) };
@@ -69,18 +99,15 @@ bool generateVolume(const flags::args& args)
 		size *= 3;
 	}
 
-	for (int z = 0; z < size; z++)
+	struct
 	{
-		log_info("{} of {}", z+1, size);
-		for (int y = 0; y < size; y++)
-		{
-			for (int x = 0; x < size; x++)
-			{
-				bool occupied = mengerSponge(x, y, z);
-				volume.setVoxel(x, y, z, occupied ? matId : 0);
-			}
-		}
-	}	
+		MaterialId operator()(int x, int y, int z) const { return mengerSponge(x, y, z) ? matId : 0; }
+		std::optional<MaterialId> classify(const Box3i& bounds) const { return classifyMengerSponge(bounds); }
+		MaterialId matId;
+	} sponge = { matId };
+
+	log_info("Generating {}^3 Menger sponge", size);
+	generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(size - 1)), sponge);
 
 	// Save the result
 	log_info("Saving volume as '{}'", outputPath);
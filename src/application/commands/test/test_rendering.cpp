@@ -247,5 +247,28 @@ bool testRaytracingPerformance()
 	log_info("Hit count = {} out of {}", hitCount, rayCount);
 	check(hitCount, 124084);
 
+	// Trace the same rays against the sparse node layout.
+	SparseVolume sparseVolume(volume);
+	SubDAGArray sparseSubDAGs = findSubDAGs(sparseVolume.nodes(), sparseVolume.rootNodeIndex());
+	sampler = Box3fSampler(bounds);
+	uint sparseHitCount = 0;
+	timer.start();
+	for (uint i = 0; i < rayCount; i++)
+	{
+		Vector3f origin = sampler.next();
+		Vector3f target = sampler.next();
+		Vector3f dir = target - origin;
+		dir = normalize(dir);
+		Ray3f ray(origin, dir);
+
+		RayVolumeIntersection intersection = intersectVolume(sparseVolume, sparseSubDAGs, ray, false);
+		if (intersection.hit) { sparseHitCount++; }
+	}
+
+	log_info("Traced {} rays in {} seconds (sparse)", rayCount, timer.elapsedTimeInSeconds());
+	log_info("Dense nodes use {} KiB, sparse nodes use {} KiB",
+		volume.countNodes() * sizeof(Node) / 1024, sparseVolume.nodes().byteCount() / 1024);
+	check(sparseHitCount, hitCount);
+
 	return true;
 }
@@ -10,6 +10,7 @@
 
 #include <functional>
 #include <random>
+#include <vector>
 
 using namespace Cubiquity;
 using namespace std;
@@ -18,17 +19,23 @@ template <typename Function>
 void fillVolume(Volume* volume, const Box3i& bounds, Function function)
 {
 
+	std::vector<Vector3i> positions;
+	std::vector<MaterialId> materials;
 	for (int32 z = bounds.lower().z(); z <= bounds.upper().z(); z++)
 	{
 		log_info("Generating slice {}", z);
 
+		positions.clear();
+		materials.clear();
 		for (int32 y = bounds.lower().y(); y <= bounds.upper().y(); y++)
 		{
 			for (int32 x = bounds.lower().x(); x <= bounds.upper().x(); x++)
 			{
-				volume->setVoxel(x, y, z, function(x, y, z));
+				positions.push_back({ x, y, z });
+				materials.push_back(function(x, y, z));
 			}
 		}
+		volume->setVoxels(positions, materials);
 	}
 }
 
@@ -126,11 +133,23 @@ bool testVisibilityUnidirectional()
 
 	saveVisibilityMaskAsImage(*(visCalc.mVisMask), "PerspectiveMask.png");
 
+	SparseVolume sparseVolume(*mVolume);
 	delete mVolume;
 
 	uint32_t hash = visCalc.mVisMask->hash();
 	log_info("\tHash = {}", hash);
 
+	// The sparse node layout should find exactly the same nodes.
+	timer.start();
+	uint32_t sparseGlyphCount = 0;
+	for (int ct = 0; ct < iterations; ct++)
+	{
+		sparseGlyphCount = visCalc.findVisibleOctreeNodes(&sparseVolume, &cameraData, NormalEstimation::None, false, glyphs, maxGlyphCount);
+	}
+	log_info("\tTime elapsed = {} ms (sparse)", timer.elapsedTimeInMilliSeconds());
+	check(sparseGlyphCount, glyphCount);
+	check(visCalc.mVisMask->hash(), hash);
+
 	const size_t expectedGlyphCount = 62117;
 	// Tile size affects memory layout and hence hash.
 	uint32_t expectedHash = 0;
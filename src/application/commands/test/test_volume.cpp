@@ -5,20 +5,27 @@
 #include "base/logging.h"
 
 #include "cubiquity.h"
+#include "raytracing.h"
 #include "utility.h"
 #include "storage.h"
 
 #include "fractal_noise.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <memory>
 #include <numeric>
+#include <random>
 #include <thread>
 #include <mutex>
 #include <set>
+#include <unordered_set>
 
 using namespace Cubiquity;
 using namespace Cubiquity::Internals;
@@ -205,6 +212,42 @@ std::pair<uint32_t, uint32_t> validateFunction(Volume* volume, const Box3i& boun
 	return std::make_pair(matches, mismatches);
 }
 
+// Position enumerators are slow for small domains (see position_enumerator.h), so these just iterate directly. The
+// function gives the material for each voxel, and is only evaluated once however many volumes are being filled.
+template <typename Function>
+void fillVolumes(std::initializer_list<Volume*> volumes, const Box3i& bounds, Function function)
+{
+	for (int32 z = bounds.lower().z(); z <= bounds.upper().z(); z++)
+	{
+		for (int32 y = bounds.lower().y(); y <= bounds.upper().y(); y++)
+		{
+			for (int32 x = bounds.lower().x(); x <= bounds.upper().x(); x++)
+			{
+				const MaterialId matId = function(x, y, z);
+				for (Volume* volume : volumes) { volume->setVoxel(x, y, z, matId); }
+			}
+		}
+	}
+}
+
+// Counts the voxels in the bounds which differ from the expected material, which is often that of another volume.
+template <typename Function>
+uint32_t countMismatches(const Volume& volume, const Box3i& bounds, Function expected)
+{
+	uint32_t mismatches = 0;
+	for (int32 z = bounds.lower().z(); z <= bounds.upper().z(); z++)
+	{
+		for (int32 y = bounds.lower().y(); y <= bounds.upper().y(); y++)
+		{
+			for (int32 x = bounds.lower().x(); x <= bounds.upper().x(); x++)
+			{
+				if (volume.voxel(x, y, z) != expected(x, y, z)) { mismatches++; }
+			}
+		}
+	}
+	return mismatches;
+}
+
 uint8_t randomMaterial(uint32_t /*x*/, uint32_t /*y*/, uint32_t /*z*/)
 {
 	return (rand() % 2 == 1) ? 2 : 7;
@@ -389,6 +432,171 @@ bool testSerialization()
 		log_error("Integrity check failed!!!");
 	}
 
+	// Write out the same data in the original (version 1) format, which should still be loadable.
+	{
+		const NodeDAG& dag = getNodes(*volume);
+		uint32 root = volume->rootNodeIndex();
+		uint32 nodeCount = dag.bakedNodesEnd() - dag.bakedNodesBegin();
+		std::ofstream file("testSerializationV1.dag", std::ios::out | std::ios::binary);
+		file.write(reinterpret_cast<const char*>(&root), sizeof(root));
+		file.write(reinterpret_cast<const char*>(&nodeCount), sizeof(nodeCount));
+		file.write(reinterpret_cast<const char*>(&dag[dag.bakedNodesBegin()]), nodeCount * sizeof(Node));
+	}
+
+	delete volume;
+
+	// Map the file rather than reading it, and make sure we can still edit the mapped volume.
+	Timer timer;
+	volume = new Volume("testSerialization.dag", true);
+	log_info("Mapped volume in {} ms", timer.elapsedTimeInMilliSeconds());
+
+	validationResult = validateFunction<RandomPositionEnumerator>(volume, bounds, fractalNoise);
+	log_info("Mapped serialization test gave {} matches and {} mismatches", validationResult.first, validationResult.second);
+
+	volume->setVoxel(0, 0, 0, 42);
+	volume->bake();
+	volume->save("testSerialization.dag"); // Safe even though we are mapped from this file.
+	if (volume->voxel(0, 0, 0) != 42)
+	{
+		log_error("Mapped volume was not saved correctly!!!");
+	}
+
+	// A truncated file is rejected, and leaves the volume as it was.
+	std::filesystem::copy_file("testSerialization.dag", "testSerializationTruncated.dag", std::filesystem::copy_options::overwrite_existing);
+	std::filesystem::resize_file("testSerializationTruncated.dag", std::filesystem::file_size("testSerialization.dag") / 2);
+	if (volume->load("testSerializationTruncated.dag") || volume->voxel(0, 0, 0) != 42 || volume->voxel(1, 2, 3) != fractalNoise(1, 2, 3))
+	{
+		log_error("Truncated volume file was loaded!!!");
+	}
+	delete volume;
+
+	volume = new Volume("testSerializationV1.dag");
+	validationResult = validateFunction<RandomPositionEnumerator>(volume, bounds, fractalNoise);
+	log_info("Version 1 serialization test gave {} matches and {} mismatches", validationResult.first, validationResult.second);
+
+	// Save in the compact format and check it reads back the same (and is smaller).
+	volume->save("testSerializationCompact.dag", true);
+	delete volume;
+
+	timer.start();
+	volume = new Volume("testSerialization.dag");
+	const float loadTime = timer.elapsedTimeInMilliSeconds();
+	delete volume;
+
+	timer.start();
+	volume = new Volume("testSerializationCompact.dag");
+	const float compactLoadTime = timer.elapsedTimeInMilliSeconds();
+
+	validationResult = validateFunction<RandomPositionEnumerator>(volume, bounds, fractalNoise);
+	log_info("Compact serialization test gave {} matches and {} mismatches", validationResult.first, validationResult.second);
+	log_info("File size is {} KiB (compact) and {} KiB (mappable)",
+		std::filesystem::file_size("testSerializationCompact.dag") / 1024, std::filesystem::file_size("testSerialization.dag") / 1024);
+	log_info("Loaded in {} ms (compact) and {} ms (mappable)", compactLoadTime, loadTime);
+	if (std::filesystem::file_size("testSerializationCompact.dag") >= std::filesystem::file_size("testSerialization.dag"))
+	{
+		log_error("Compact volume file was not smaller!!!");
+	}
+
+	if (!checkIntegrity(*volume))
+	{
+		log_error("Integrity check failed!!!");
+	}
+
+	// Corrupt compact files must be rejected, leaving the volume they are loaded into as it was. Each has one section of
+	// three nodes, with only the first child set (to the given zigzag-encoded offset from the next new node). The header
+	// (24 bytes, with the root node index and then the node count at the end) is taken from the valid file.
+	auto loadCorruptFile = [&](const std::array<uint8, 3>& encodedOffsets)
+	{
+		std::array<char, 24> header;
+		std::ifstream("testSerializationCompact.dag", std::ios::binary).read(header.data(), header.size());
+		const uint32 nodeCount = 3;
+		std::memcpy(&header[20], &nodeCount, sizeof(nodeCount));
+
+		std::ofstream file("testSerializationCorrupt.dag", std::ios::out | std::ios::binary);
+		file.write(header.data(), header.size());
+		const std::array<uint32, 3> section = { 1, nodeCount, nodeCount * 3 }; // Section count, node count and size.
+		file.write(reinterpret_cast<const char*>(section.data()), sizeof(section));
+		for (uint8 encodedOffset : encodedOffsets)
+		{
+			const std::array<uint8, 3> node = { 0x01, 0xFE, encodedOffset }; // Node mask, empty mask and offset.
+			file.write(reinterpret_cast<const char*>(node.data()), sizeof(node));
+		}
+		file.close();
+
+		return volume->load("testSerializationCorrupt.dag");
+	};
+	bool corruptFileLoaded = loadCorruptFile({ 2, 0, 0 }) || loadCorruptFile({ 0, 0, 3 }); // A forward reference, and a cycle.
+
+	// The valid file, but with the root moved off the first node.
+	std::filesystem::copy_file("testSerializationCompact.dag", "testSerializationCorrupt.dag", std::filesystem::copy_options::overwrite_existing);
+	{
+		const uint32 rootNodeIndex = getNodes(*volume).bakedNodesBegin() + 1;
+		std::fstream file("testSerializationCorrupt.dag", std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(16);
+		file.write(reinterpret_cast<const char*>(&rootNodeIndex), sizeof(rootNodeIndex));
+	}
+	corruptFileLoaded = corruptFileLoaded || volume->load("testSerializationCorrupt.dag");
+
+	if (corruptFileLoaded || validateFunction<RandomPositionEnumerator>(volume, bounds, fractalNoise).second != 0)
+	{
+		log_error("Corrupt volume file was loaded!!!");
+	}
+
+	// Saving leaves the volume untouched, even with unbaked edits, an undo history and a snapshot held.
+	volume->setTrackEdits(true);
+	volume->setSnapshotsEnabled(true);
+	volume->fillBrush(SphereBrush(Vector3f::filled(64.0f), 20.0f), 7);
+	volume->setVoxel(1, 2, 3, 9);
+	{
+		const VolumeSnapshot snapshot = volume->snapshot();
+		const uint32 rootNodeIndex = volume->rootNodeIndex();
+		const uint32 storedNodeCount = volume->statistics().storedNodeCount;
+		timer.start();
+		volume->save("testSerializationEdited.dag");
+		log_info("Saved an edited volume in {} ms", timer.elapsedTimeInMilliSeconds());
+		if (volume->rootNodeIndex() != rootNodeIndex || volume->statistics().storedNodeCount != storedNodeCount || snapshot.voxel(1, 2, 3) != 9)
+		{
+			log_error("Saving modified the volume!!!");
+		}
+	}
+
+	Volume* editedVolume = new Volume("testSerializationEdited.dag");
+	const uint32 mismatches = countMismatches(*editedVolume, Box3i(Vector3i::filled(-1), Vector3i::filled(sideLength)),
+		[&](int32 x, int32 y, int32 z) { return volume->voxel(x, y, z); });
+	log_info("Edited serialization test gave {} mismatches", mismatches);
+
+	if (!checkIntegrity(*editedVolume))
+	{
+		log_error("Integrity check failed!!!");
+	}
+	delete editedVolume;
+
+	const bool undone = volume->undo();
+	if (!undone || volume->voxel(1, 2, 3) == 9 || volume->voxel(64, 64, 64) != 7)
+	{
+		log_error("Undo history was lost when saving!!!");
+	}
+
+	// The saved copy is deduplicated, so it is the same size as one saved after a bake.
+	volume->redo();
+	volume->bake();
+	volume->save("testSerializationBaked.dag");
+	if (std::filesystem::file_size("testSerializationBaked.dag") != std::filesystem::file_size("testSerializationEdited.dag"))
+	{
+		log_error("Saved volume was not deduplicated!!!");
+	}
+	volume->setSnapshotsEnabled(false);
+
+	// A volume with no nodes has no sections.
+	volume->fill(5);
+	volume->save("testSerializationCompact.dag", true);
+	delete volume;
+	volume = new Volume("testSerializationCompact.dag");
+	if (volume->rootNodeIndex() != 5 || volume->voxel(12, -34, 56) != 5)
+	{
+		log_error("Uniform compact volume was not loaded correctly!!!");
+	}
+
 	delete volume;
 
 	return true;
@@ -496,58 +704,1632 @@ bool testMerging()
 	return true;
 }
 
-bool testSphere()
+// Many volumes should be able to coexist, with small ones committing only a little
+// memory, and baking should return the memory used by the edit nodes to the OS.
+bool testNodeStore()
 {
-	return true;
+	log_info("");
+	log_info("Node store tests:");
+	log_info("-----------------");
+
+	const int volumeCount = 64;
+	const int sideLength = 16;
+	std::vector<std::unique_ptr<Volume>> volumes;
+
+	uint64 totalCommittedBytes = 0;
+	const Box3i bounds(Vector3i::filled(0), Vector3i::filled(sideLength - 1));
+	for (int i = 0; i < volumeCount; i++)
+	{
+		volumes.emplace_back(new Volume);
+		fillVolumes({ volumes.back().get() }, bounds, checkerboard);
+		totalCommittedBytes += getNodes(*volumes.back()).nodes().committedBytes();
+	}
+	log_info("{} volumes committed {} KiB in total", volumeCount, totalCommittedBytes / 1024);
+
+	Volume& volume = *volumes.front();
+	const uint64 committedBeforeBake = getNodes(volume).nodes().committedBytes();
+	volume.bake();
+	const uint64 committedAfterBake = getNodes(volume).nodes().committedBytes();
+	log_info("Committed {} KiB before bake and {} KiB after bake", committedBeforeBake / 1024, committedAfterBake / 1024);
+
+	uint32_t mismatches = countMismatches(volume, bounds, checkerboard);
+	if (committedAfterBake >= committedBeforeBake) { mismatches++; }
+	log_info("Node store test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
 }
 
-bool testCSG()
+// Builds a volume in which each level of the tree holds up to 'width' distinct nodes which share the level below,
+// so the number of root-to-leaf paths is astronomical (8^32) but the number of unique nodes is at most 32 * width.
+// Baking should take time proportional to the latter, and should not change the contents of the volume.
+bool testBakeScaling()
 {
-	Volume building;
-	building.load("../data/voxelized.dag");
-	Volume shapes;
-	shapes.load("../data/shapes.dag");
+	log_info("");
+	log_info("Bake scaling tests:");
+	log_info("-------------------");
 
-	building.addVolume(shapes);
+	bool result = true;
+	for (uint32 width : { 1, 16, 256, 4096, 65536 })
+	{
+		Volume volume;
+		NodeDAG& dag = getNodes(volume);
 
-	building.save("../data/csg.dag");
+		// Level one nodes point at materials (with each node's pattern being unique), and each
+		// higher level points at a unique combination of the nodes from the level below.
+		std::vector<uint32> level(width);
+		for (int height = 1; height <= 32; height++)
+		{
+			std::vector<uint32> nextLevel(width);
+			for (uint32 i = 0; i < width; i++)
+			{
+				Node node;
+				for (uint32 childId = 0; childId < 8; childId++)
+				{
+					node[childId] = height == 1 ? (i >> (childId * 2)) & 0x3 : level[childId == 0 ? i : (i * 8 + childId) % width];
+				}
+				nextLevel[i] = dag.insert(node);
+			}
+			level = nextLevel;
+		}
+		volume.setRootNodeIndex(level[0]);
+		const uint32 nodeCount = volume.countNodes();
 
-	uint8 outside_material;
-	int32 lower_x, lower_y, lower_z, upper_x, upper_y, upper_z;
-	cubiquity_estimate_bounds(&building, &outside_material, &lower_x, &lower_y, &lower_z, &upper_x, &upper_y, &upper_z);
-	log_info("({},{},{}) ({},{},{})", lower_x, lower_y, lower_z, upper_x, upper_y, upper_z);
+		// Sample some voxels near the origin and at the corners of the volume for comparison after the bake.
+		std::vector<Vector3i> positions;
+		for (int32 z = -4; z < 4; z++)
+		{
+			for (int32 y = -4; y < 4; y++)
+			{
+				for (int32 x = -4; x < 4; x++)
+				{
+					positions.push_back({ x, y, z });
+					positions.push_back({ x ^ INT32_MIN, y ^ INT32_MIN, z ^ INT32_MIN });
+				}
+			}
+		}
+		std::vector<MaterialId> expected;
+		for (const Vector3i& position : positions) { expected.push_back(volume.voxel(position)); }
 
-	int64_t histogram[256];
-	cubiquity_compute_histogram(&building, histogram);
-	for (int i = 0; i < 256; i++)
+		Timer timer;
+		volume.bake();
+		const float bakeTime = timer.elapsedTimeInMilliSeconds();
+
+		uint32_t mismatches = 0;
+		for (uint32 i = 0; i < positions.size(); i++)
+		{
+			if (volume.voxel(positions[i]) != expected[i]) { mismatches++; }
+		}
+
+		// All nodes were already unique, so the bake should not have found any to merge.
+		if (volume.countNodes() != nodeCount) { mismatches++; }
+
+		log_info("Baked {} unique nodes (8^32 paths) in {} ms with {} mismatches",
+			volume.countNodes(), bakeTime, mismatches);
+		assert(mismatches == 0);
+		result = result && mismatches == 0;
+	}
+
+	return result;
+}
+
+// The parallel bake must give exactly the same nodes (in the same order) as the serial one.
+bool testParallelBake()
+{
+	log_info("");
+	log_info("Parallel bake tests:");
+	log_info("--------------------");
+
+	const int sideLength = 128;
+	Volume serialVolume;
+	Volume parallelVolume;
+
+	// The second pass edits an already-baked volume, so that baked and edit nodes are both involved.
+	bool identical = true;
+	for (int pass = 0; pass < 2; pass++)
 	{
-		if (histogram[i] != 0) // Note that -1 can occur to indicate overflow
+		FractalNoise fractalNoise(7, pass * 1000, pass * 1000, pass * 1000);
+		fillVolumes({ &serialVolume, &parallelVolume }, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), fractalNoise);
+
+		Timer timer;
+		serialVolume.bake(false);
+		const float serialTime = timer.elapsedTimeInMilliSeconds();
+		timer.start();
+		parallelVolume.bake(true);
+		const float parallelTime = timer.elapsedTimeInMilliSeconds();
+
+		const NodeDAG& serialDAG = getNodes(serialVolume);
+		const NodeDAG& parallelDAG = getNodes(parallelVolume);
+		identical = identical && serialVolume.rootNodeIndex() == parallelVolume.rootNodeIndex();
+		identical = identical && serialDAG.bakedNodesEnd() == parallelDAG.bakedNodesEnd();
+		for (uint32 i = serialDAG.bakedNodesBegin(); identical && i < serialDAG.bakedNodesEnd(); i++)
 		{
-			log_info("Material {}: {} voxels", static_cast<uint16_t>(i), histogram[i]);
+			identical = serialDAG[i] == parallelDAG[i];
 		}
+
+		log_info("Baked {} nodes in {} ms (serial) and {} ms (parallel)",
+			serialDAG.bakedNodesEnd() - serialDAG.bakedNodesBegin(), serialTime, parallelTime);
 	}
 
-	return true;
+	log_info("Serial and parallel bakes {}", identical ? "were identical" : "DIFFERED!");
+	assert(identical);
+
+	return identical;
 }
 
-bool testVolume()
+// The node map used for baking should give the same results as a std::unordered_map (with the MurmurHash3
+// hash which was used before), and be faster.
+bool testNodeMap()
 {
-	srand(12345);
+	log_info("");
+	log_info("Node map tests:");
+	log_info("---------------");
 
-	// Slow test, so not usually run.
-	/*if(!PositionEnumerator::test())
+	// Unbaked fractal noise has many duplicate nodes, as well as many unique ones.
+	const int sideLength = 128;
+	FractalNoise fractalNoise(7);
+	Volume volume;
+	fillVolumes({ &volume }, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), fractalNoise);
+
+	const NodeDAG& nodes = getNodes(volume);
+	std::vector<Node> keys;
+	for (uint32 index = nodes.editNodesBegin(); index < nodes.editNodesEnd(); index++) { keys.push_back(nodes[index]); }
+
+	uint32_t mismatches = 0;
+	std::vector<uint32> mapValues(keys.size());
+	std::vector<uint32> referenceValues(keys.size());
+
+	Timer timer;
+	std::unordered_map<Node, uint32, MurmurHash3<Node>> referenceMap;
+	for (uint32 i = 0; i < keys.size(); i++) { referenceValues[i] = referenceMap.insert({ keys[i], i }).first->second; }
+	const float referenceTime = timer.elapsedTimeInMilliSeconds();
+
+	timer.start();
+	NodeMap map;
+	for (uint32 i = 0; i < keys.size(); i++) { mapValues[i] = map.insert(keys[i], i).first; }
+	const float mapTime = timer.elapsedTimeInMilliSeconds();
+
+	timer.start();
+	NodeMap reservedMap(static_cast<uint32>(keys.size()));
+	for (uint32 i = 0; i < keys.size(); i++) { reservedMap.insert(keys[i], i); }
+	const float reservedMapTime = timer.elapsedTimeInMilliSeconds();
+
+	log_info("Inserted {} nodes ({} unique) in {} ms (std::unordered_map), {} ms (NodeMap) and {} ms (reserved NodeMap)",
+		keys.size(), referenceMap.size(), referenceTime, mapTime, reservedMapTime);
+
+	if (map.size() != referenceMap.size() || reservedMap.size() != referenceMap.size()) { mismatches++; }
+	for (uint32 i = 0; i < keys.size(); i++)
 	{
-		log_error("PositionEnumerator::test() failed!");(
-	}*/
+		if (mapValues[i] != referenceValues[i]) { mismatches++; }
+		const uint32* value = reservedMap.find(keys[i]);
+		if (value == nullptr || *value != referenceValues[i]) { mismatches++; }
+	}
 
-	testBounds();
-	testBasics();
-	//testCSG();
-	testCheckerboard();
-	testRandomAccess();
-	testFractalNoise();
-	testMerging();
-	testSerialization();
+	// A node which was never inserted is not found.
+	Node missingNode = keys[0];
+	missingNode[0] = UINT32_MAX;
+	if (map.find(missingNode) != nullptr) { mismatches++; }
 
-	return true;
+	log_info("Node map test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Simulates an editor which rebakes after every brush stroke. An incremental bake should give the
+// same volume (with the same number of reachable nodes) as a full bake, and keep the undo history.
+bool testIncrementalBake()
+{
+	log_info("");
+	log_info("Incremental bake tests:");
+	log_info("-----------------------");
+
+	const int sideLength = 128;
+	const Box3i bounds(Vector3i::filled(0), Vector3i::filled(sideLength - 1));
+	Volume incrementalVolume;
+	Volume fullVolume;
+
+	FractalNoise fractalNoise(7);
+	fillVolumes({ &incrementalVolume, &fullVolume }, bounds, fractalNoise);
+	incrementalVolume.bake();
+	fullVolume.bake();
+
+	incrementalVolume.setTrackEdits(true);
+
+	const int strokeCount = 100;
+	float incrementalTime = 0.0f;
+	float fullTime = 0.0f;
+	for (int i = 0; i < strokeCount; i++)
+	{
+		SphereBrush brush(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), 5.0f);
+		const MaterialId matId = rand() % 4;
+		incrementalVolume.fillBrush(brush, matId);
+		fullVolume.fillBrush(brush, matId);
+
+		Timer timer;
+		incrementalVolume.bakeEdits();
+		incrementalTime += timer.elapsedTimeInMilliSeconds();
+		timer.start();
+		fullVolume.bake();
+		fullTime += timer.elapsedTimeInMilliSeconds();
+	}
+
+	uint32_t mismatches = countMismatches(incrementalVolume, bounds, [&](int32 x, int32 y, int32 z) { return fullVolume.voxel(x, y, z); });
+	if (incrementalVolume.countNodes() != fullVolume.countNodes()) { mismatches++; }
+
+	log_info("Average bake time after a brush stroke was {} ms (incremental) and {} ms (full)",
+		incrementalTime / strokeCount, fullTime / strokeCount);
+	log_info("Incremental bake gave {} mismatches, node count = {} (incremental) and {} (full)",
+		mismatches, incrementalVolume.countNodes(), fullVolume.countNodes());
+
+	// Undoing every stroke should get us back to the original noise.
+	while (incrementalVolume.undo()) {}
+	const uint32_t undoMismatches = countMismatches(incrementalVolume, bounds, fractalNoise);
+	log_info("Undoing all strokes gave {} mismatches", undoMismatches);
+	mismatches += undoMismatches;
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// With hash-consing enabled a volume should already be fully deduplicated as it is written, so baking
+// it should not find anything more to merge, and it should never run out of space for edits.
+bool testHashConsing()
+{
+	log_info("");
+	log_info("Hash-consing tests:");
+	log_info("-------------------");
+
+	const int sideLength = 64;
+	const Box3i bounds(Vector3i::filled(0), Vector3i::filled(sideLength - 1));
+	FractalNoise fractalNoise(7);
+	using Generator = std::function<MaterialId(int, int, int)>;
+	const std::pair<const char*, Generator> generators[] =
+	{
+		{ "Checkerboard", [](int x, int y, int z) { return checkerboard(x, y, z); } },
+		{ "Fractal noise", [&](int x, int y, int z) { return fractalNoise(x, y, z); } }
+	};
+
+	bool result = true;
+	for (const auto& [name, generator] : generators)
+	{
+		Volume plainVolume;
+		Volume hashConsedVolume;
+		hashConsedVolume.setHashConsing(true);
+
+		// The times include evaluating the generator, which is the same for both.
+		Timer timer;
+		fillVolumes({ &plainVolume }, bounds, generator);
+		const float plainTime = timer.elapsedTimeInMilliSeconds();
+		timer.start();
+		fillVolumes({ &hashConsedVolume }, bounds, generator);
+		const float hashConsedTime = timer.elapsedTimeInMilliSeconds();
+
+		const NodeDAG& plainDAG = getNodes(plainVolume);
+		const NodeDAG& hashConsedDAG = getNodes(hashConsedVolume);
+		log_info("{}: Wrote {} edit nodes in {} ms (plain) and {} edit nodes in {} ms (hash-consed)", name,
+			plainDAG.editNodesEnd() - plainDAG.editNodesBegin(), plainTime,
+			hashConsedDAG.editNodesEnd() - hashConsedDAG.editNodesBegin(), hashConsedTime);
+
+		const uint32 nodeCountBeforeBake = hashConsedVolume.countNodes();
+		plainVolume.bake();
+		hashConsedVolume.bake();
+
+		uint32_t mismatches = countMismatches(hashConsedVolume, bounds, generator);
+		if (nodeCountBeforeBake != hashConsedVolume.countNodes()) { mismatches++; }
+		if (plainVolume.countNodes() != hashConsedVolume.countNodes()) { mismatches++; }
+		log_info("{}: {} mismatches, node count = {} (before bake) and {} (after bake)",
+			name, mismatches, nodeCountBeforeBake, hashConsedVolume.countNodes());
+
+		// Shared nodes must never be modified in-place, which matters most when keeping an undo history.
+		hashConsedVolume.setTrackEdits(true);
+		for (int i = 0; i < 20; i++)
+		{
+			SphereBrush brush(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), 4.0f);
+			const MaterialId matId = rand() % 4;
+			hashConsedVolume.fillBrush(brush, matId);
+			hashConsedVolume.setVoxel(rand() % sideLength, rand() % sideLength, rand() % sideLength, matId);
+		}
+		while (hashConsedVolume.undo()) {}
+		mismatches += countMismatches(hashConsedVolume, bounds, generator);
+		log_info("{}: {} mismatches after editing and then undoing", name, mismatches);
+		assert(mismatches == 0);
+
+		result = result && mismatches == 0;
+	}
+
+	return result;
+}
+
+// An editing session with undo should have bounded memory use when garbage collection is enabled, and collecting
+// garbage must not change the contents of the volume or the undo history. Another volume (with no garbage collection)
+// receives the same edits for comparison.
+bool testGarbageCollection()
+{
+	log_info("");
+	log_info("Garbage collection tests:");
+	log_info("-------------------------");
+
+	const int sideLength = 64;
+	const Box3i bounds(Vector3i::filled(0), Vector3i::filled(sideLength - 1));
+	Volume collectedVolume;
+	Volume referenceVolume;
+
+	FractalNoise fractalNoise(7);
+	fillVolumes({ &collectedVolume, &referenceVolume }, bounds, fractalNoise);
+
+	for (Volume* volume : { &collectedVolume, &referenceVolume })
+	{
+		volume->bake();
+		volume->setTrackEdits(true);
+	}
+
+	const uint32 maxNodeCount = 50000;
+	collectedVolume.setGarbageCollectionTrigger(maxNodeCount);
+
+	// Mostly brush strokes, but sometimes undo a few of them to leave some redo history which then gets truncated.
+	uint32 peakNodeCount = 0;
+	for (int i = 0; i < 500; i++)
+	{
+		if (i % 10 == 9)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				collectedVolume.undo();
+				referenceVolume.undo();
+			}
+			continue;
+		}
+
+		SphereBrush brush(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), 4.0f);
+		const MaterialId matId = rand() % 4;
+		collectedVolume.fillBrush(brush, matId);
+		referenceVolume.fillBrush(brush, matId);
+		peakNodeCount = std::max(peakNodeCount, getNodes(collectedVolume).storedNodeCount());
+	}
+
+	// A new edit after an undo must truncate the redo history.
+	for (Volume* volume : { &collectedVolume, &referenceVolume })
+	{
+		volume->undo();
+		volume->setVoxel(0, 0, 0, volume->voxel(0, 0, 0) + 1);
+	}
+	uint32_t mismatches = 0;
+	if (collectedVolume.redo()) { mismatches++; } // The redo history should have been truncated.
+
+	log_info("Stored {} nodes (peak {}) with garbage collection and {} nodes without",
+		getNodes(collectedVolume).storedNodeCount(), peakNodeCount, getNodes(referenceVolume).storedNodeCount());
+	Timer timer;
+	const uint32 removedNodeCount = referenceVolume.collectGarbage();
+	log_info("Explicit collection removed {} nodes in {} ms", removedNodeCount, timer.elapsedTimeInMilliSeconds());
+
+	// Step back through the whole undo history, checking that the volumes match at each step.
+	do
+	{
+		mismatches += countMismatches(collectedVolume, bounds, [&](int32 x, int32 y, int32 z) { return referenceVolume.voxel(x, y, z); });
+	} while (collectedVolume.undo() && referenceVolume.undo());
+	log_info("Garbage collection test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Writing a batch of voxels with setVoxels() should give the same result as writing them one at a time with
+// setVoxel(), including when the batch is out of order, contains repeated writes, or is given as runs.
+bool testSetVoxels()
+{
+	log_info("");
+	log_info("Batched write tests:");
+	log_info("--------------------");
+
+	// Straddle the origin so that the batch spans the top-level octants.
+	const int lower = -48;
+	const int upper = 47;
+	FractalNoise fractalNoise(7);
+
+	std::vector<Vector3i> positions;
+	std::vector<MaterialId> materials;
+	for (int z = lower; z <= upper; z++)
+	{
+		for (int y = lower; y <= upper; y++)
+		{
+			for (int x = lower; x <= upper; x++)
+			{
+				positions.push_back({ x, y, z });
+				materials.push_back(fractalNoise(x, y, z));
+			}
+		}
+	}
+
+	Volume referenceVolume;
+	Timer timer;
+	for (size_t i = 0; i < positions.size(); i++)
+	{
+		referenceVolume.setVoxel(positions[i], materials[i]);
+	}
+	const float referenceTime = timer.elapsedTimeInMilliSeconds();
+
+	Volume batchedVolume;
+	timer.start();
+	batchedVolume.setVoxels(positions, materials);
+	const float batchedTime = timer.elapsedTimeInMilliSeconds();
+
+	log_info("Wrote {} voxels in {} ms (individually) and {} ms (batched)", positions.size(), referenceTime, batchedTime);
+
+	// Now overwrite random voxels (with plenty of repeats) in a random order, and check that the last write wins.
+	referenceVolume.setTrackEdits(true);
+	batchedVolume.setTrackEdits(true);
+	positions.clear();
+	materials.clear();
+	for (int i = 0; i < 100000; i++)
+	{
+		positions.push_back({ lower + rand() % 16, lower + rand() % 16, lower + rand() % 16 });
+		materials.push_back(rand() % 4);
+		referenceVolume.setVoxel(positions.back(), materials.back());
+	}
+	batchedVolume.setVoxels(positions, materials);
+
+	// And finally some runs, which also exercise hash-consing.
+	batchedVolume.setHashConsing(true);
+	std::vector<Vector3i> runStarts;
+	std::vector<uint32> runLengths;
+	materials.clear();
+	for (int i = 0; i < 1000; i++)
+	{
+		runStarts.push_back({ lower + rand() % 96, lower + rand() % 96, lower + rand() % 96 });
+		runLengths.push_back(rand() % 32);
+		materials.push_back(rand() % 4);
+		for (uint32 offset = 0; offset < runLengths.back(); offset++)
+		{
+			referenceVolume.setVoxel(runStarts.back().x() + offset, runStarts.back().y(), runStarts.back().z(), materials.back());
+		}
+	}
+	batchedVolume.setVoxels(runStarts, runLengths, materials);
+
+	// The runs can extend past the region which was written, so a wider region is checked.
+	uint32_t mismatches = countMismatches(batchedVolume, Box3i(Vector3i::filled(lower), { upper + 32, upper, upper + 32 }),
+		[&](int32 x, int32 y, int32 z) { return referenceVolume.voxel(x, y, z); });
+	log_info("Batched writes gave {} mismatches", mismatches);
+
+	// Each batch is a single undo step, so two undos take us back to the original noise (and there is no more history).
+	const bool undone = batchedVolume.undo() && batchedVolume.undo();
+	if (!undone || batchedVolume.undo()) { mismatches++; }
+	mismatches += countMismatches(batchedVolume, Box3i(Vector3i::filled(lower), Vector3i::filled(upper)), fractalNoise);
+	log_info("Undoing the batches gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Copying a dense array into a volume with setRegion() should match writing the voxels individually. When the
+// region is node-aligned the result should also be fully deduplicated already, so baking should not shrink it.
+bool testSetRegion()
+{
+	log_info("");
+	log_info("Dense region tests:");
+	log_info("-------------------");
+
+	FractalNoise fractalNoise(7);
+	uint32_t mismatches = 0;
+
+	// An aligned brick, stored with x varying fastest.
+	{
+		const int sideLength = 128;
+		std::vector<MaterialId> data(sideLength * sideLength * sideLength);
+		for (int z = 0; z < sideLength; z++)
+		{
+			for (int y = 0; y < sideLength; y++)
+			{
+				for (int x = 0; x < sideLength; x++)
+				{
+					data[(z * sideLength + y) * sideLength + x] = fractalNoise(x, y, z);
+				}
+			}
+		}
+
+		Volume referenceVolume;
+		const Box3i bounds(Vector3i::filled(0), Vector3i::filled(sideLength - 1));
+		Timer timer;
+		fillVolumes({ &referenceVolume }, bounds, [&](int32 x, int32 y, int32 z) { return data[(z * sideLength + y) * sideLength + x]; });
+		const float referenceTime = timer.elapsedTimeInMilliSeconds();
+
+		Volume regionVolume;
+		timer.start();
+		regionVolume.setRegion(bounds, data.data(), { 1, sideLength, sideLength * sideLength });
+		const float regionTime = timer.elapsedTimeInMilliSeconds();
+
+		const uint32 nodeCount = regionVolume.countNodes();
+		referenceVolume.bake();
+		regionVolume.bake();
+		log_info("Wrote {}^3 voxels in {} ms (individually) and {} ms (as a region)", sideLength, referenceTime, regionTime);
+		log_info("Region node count = {} (before bake) and {} (after bake), reference node count = {}",
+			nodeCount, regionVolume.countNodes(), referenceVolume.countNodes());
+		if (nodeCount != regionVolume.countNodes() || nodeCount != referenceVolume.countNodes()) { mismatches++; }
+
+		mismatches += countMismatches(regionVolume, Box3i(Vector3i::filled(-1), Vector3i::filled(sideLength)),
+			[&](int32 x, int32 y, int32 z) { return referenceVolume.voxel(x, y, z); });
+	}
+
+	// An unaligned region straddling the origin and stored with z varying fastest, written over existing
+	// data while tracking edits. Also in hash-consing mode, where the result must still be deduplicated.
+	for (bool hashConsing : { false, true })
+	{
+		const Box3i region({ -37, -5, -11 }, { 32, 44, 78 });
+		const Vector3i64 strides = { region.depth() * region.height(), region.depth(), 1 };
+		std::vector<MaterialId> data(region.width() * region.height() * region.depth());
+		for (int z = region.lower().z(); z <= region.upper().z(); z++)
+		{
+			for (int y = region.lower().y(); y <= region.upper().y(); y++)
+			{
+				for (int x = region.lower().x(); x <= region.upper().x(); x++)
+				{
+					const int64 offset = (x - region.lower().x()) * strides.x() + (y - region.lower().y()) * strides.y() + (z - region.lower().z()) * strides.z();
+					data[offset] = fractalNoise(x + 1000, y, z) / 2;
+				}
+			}
+		}
+
+		Volume volume;
+		volume.setHashConsing(hashConsing);
+		volume.fillBrush(SphereBrush(Vector3f::filled(0.0f), 60.0f), 3);
+		volume.setTrackEdits(true);
+		volume.setRegion(region, data.data(), strides);
+
+		mismatches += countMismatches(volume, Box3i({ -70, -70, -70 }, { 70, 70, 90 }), [&](int32 x, int32 y, int32 z) -> MaterialId
+		{
+			if (region.contains(Vector3i({ x, y, z })))
+			{
+				return data[(x - region.lower().x()) * strides.x() + (y - region.lower().y()) * strides.y() + (z - region.lower().z()) * strides.z()];
+			}
+			return x * x + y * y + z * z < 3600 ? 3 : 0;
+		});
+
+		if (hashConsing)
+		{
+			const uint32 nodeCount = volume.countNodes();
+			volume.bake();
+			if (volume.countNodes() != nodeCount) { mismatches++; }
+		}
+		else
+		{
+			// The region is a single undo step.
+			const bool undone = volume.undo();
+			if (!undone || volume.undo()) { mismatches++; }
+			if (volume.voxel(0, 0, 0) != 3) { mismatches++; }
+		}
+	}
+
+	log_info("Dense region test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Generating a region should match writing the same voxels individually, both with and without a functor which
+// can classify uniform nodes. The generated nodes are deduplicated as they are built, so baking should not shrink them.
+bool testGenerate()
+{
+	log_info("");
+	log_info("Generator tests:");
+	log_info("----------------");
+
+	const Box3i region({ -70, -20, -40 }, { 80, 51, 40 });
+	FractalNoise fractalNoise(7);
+	auto noise = [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); };
+
+	// A ball whose interior and exterior are classified without visiting the voxels.
+	struct
+	{
+		MaterialId operator()(int32 x, int32 y, int32 z) const { return int64(x) * x + int64(y) * y + int64(z) * z < 4900 ? 2 : 1; }
+		std::optional<MaterialId> classify(const Box3i& bounds) const
+		{
+			int64 nearest = 0;
+			int64 furthest = 0;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const int64 lower = bounds.lower()[axis];
+				const int64 upper = bounds.upper()[axis];
+				const int64 near = lower > 0 ? lower : (upper < 0 ? upper : 0);
+				const int64 far = std::max(std::abs(lower), std::abs(upper));
+				nearest += near * near;
+				furthest += far * far;
+			}
+			if (furthest < 4900) { return 2; }
+			if (nearest >= 4900) { return 1; }
+			return std::nullopt;
+		}
+	} ball;
+
+	uint32_t mismatches = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		Volume referenceVolume;
+		Volume generatedVolume;
+		for (Volume* volume : { &referenceVolume, &generatedVolume })
+		{
+			volume->fillBrush(SphereBrush(Vector3f::filled(0.0f), 120.0f), 3);
+			volume->setTrackEdits(true);
+		}
+
+		Timer timer;
+		fillVolumes({ &referenceVolume }, region, [&](int32 x, int32 y, int32 z) { return pass == 0 ? noise(x, y, z) : ball(x, y, z); });
+		const float referenceTime = timer.elapsedTimeInMilliSeconds();
+
+		timer.start();
+		if (pass == 0) { generate(generatedVolume, region, noise); }
+		else { generate(generatedVolume, region, ball); }
+		const float generatedTime = timer.elapsedTimeInMilliSeconds();
+
+		log_info("{}: Wrote voxels in {} ms (individually) and {} ms (generated)", pass == 0 ? "Fractal noise" : "Ball", referenceTime, generatedTime);
+
+		mismatches += countMismatches(generatedVolume, Box3i(region.lower() - Vector3i::filled(10), region.upper() + Vector3i::filled(10)),
+			[&](int32 x, int32 y, int32 z) { return referenceVolume.voxel(x, y, z); });
+
+		// The region is a single undo step.
+		const bool undone = generatedVolume.undo();
+		if (!undone || generatedVolume.undo()) { mismatches++; }
+		if (generatedVolume.voxel(0, 0, 0) != 3) { mismatches++; }
+	}
+
+	// A node-aligned region with nothing around it should be fully deduplicated.
+	Volume volume;
+	generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(127)), noise);
+	const uint32 nodeCount = volume.countNodes();
+	volume.bake();
+	log_info("Node count = {} (before bake) and {} (after bake)", nodeCount, volume.countNodes());
+	if (nodeCount != volume.countNodes()) { mismatches++; }
+
+	log_info("Generator test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// A sampler should always give the same result as Volume::voxel(), whether it is scanning, moving backwards, or
+// jumping around. Scanlines straddle the origin, where the paths to neighbouring voxels only meet at the root.
+bool testVolumeSampler()
+{
+	log_info("");
+	log_info("Volume sampler tests:");
+	log_info("---------------------");
+
+	const int lower = -64;
+	const int upper = 63;
+	FractalNoise fractalNoise(7);
+	Volume volume;
+	generate(volume, Box3i(Vector3i::filled(lower), Vector3i::filled(upper)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+
+	uint32_t mismatches = 0;
+	uint64 checksum = 0;
+	Timer timer;
+	for (int z = lower; z <= upper; z++)
+	{
+		for (int y = lower; y <= upper; y++)
+		{
+			for (int x = lower; x <= upper; x++)
+			{
+				checksum += volume.voxel(x, y, z);
+			}
+		}
+	}
+	const float voxelTime = timer.elapsedTimeInMilliSeconds();
+
+	uint64 samplerChecksum = 0;
+	VolumeSampler sampler(volume);
+	timer.start();
+	for (int z = lower; z <= upper; z++)
+	{
+		for (int y = lower; y <= upper; y++)
+		{
+			sampler.setPosition(lower, y, z);
+			for (int x = lower; x <= upper; x++, sampler.moveX())
+			{
+				samplerChecksum += sampler.voxel();
+			}
+		}
+	}
+	const float samplerTime = timer.elapsedTimeInMilliSeconds();
+	log_info("Scanned {}^3 voxels in {} ms (voxel()) and {} ms (sampler)", upper - lower + 1, voxelTime, samplerTime);
+	if (samplerChecksum != checksum) { mismatches++; }
+
+	// Walk randomly, mostly in small steps but with occasional jumps.
+	for (int i = 0; i < 1000000; i++)
+	{
+		const int step = (rand() % 3) - 1;
+		switch (rand() % 4)
+		{
+		case 0: sampler.moveX(step); break;
+		case 1: sampler.moveY(step); break;
+		case 2: sampler.moveZ(step); break;
+		default:
+			if (rand() % 100 == 0) { sampler.setPosition(lower + rand() % 128, lower + rand() % 128, lower + rand() % 128); }
+		}
+
+		if (sampler.voxel() != volume.voxel(sampler.x(), sampler.y(), sampler.z())) { mismatches++; }
+	}
+
+	// A sampler sees the volume as it was when it was reset.
+	volume.setVoxel(sampler.x(), sampler.y(), sampler.z(), 255);
+	sampler.reset(volume);
+	if (sampler.voxel() != 255) { mismatches++; }
+
+	log_info("Volume sampler test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Extracting a region should match reading each voxel with voxel(), whatever the layout and alignment, and
+// whether or not the slabs are extracted in parallel.
+bool testExtractRegion()
+{
+	log_info("");
+	log_info("Region extraction tests:");
+	log_info("------------------------");
+
+	FractalNoise fractalNoise(7);
+	Volume volume;
+	generate(volume, Box3i(Vector3i::filled(-64), Vector3i::filled(63)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+	volume.fillBrush(SphereBrush(Vector3f::filled(20.0f), 30.0f), 7); // Leave some edit nodes too
+
+	uint32_t mismatches = 0;
+	const Box3i region({ -81, -37, -70 }, { 70, 50, 19 });
+	const int64 voxelCount = region.width() * region.height() * region.depth();
+	for (bool parallel : { false, true })
+	{
+		// Default layout (x fastest) and the reverse (z fastest).
+		std::vector<MaterialId> data(voxelCount);
+		volume.extractRegion(region, data.data(), parallel);
+		const Vector3i64 strides = { region.depth() * region.height(), region.depth(), 1 };
+		std::vector<MaterialId> reversedData(voxelCount);
+		volume.extractRegion(region, reversedData.data(), strides, parallel);
+
+		auto check = [&](const std::vector<MaterialId>& extracted, const Vector3i64& extractedStrides) {
+			return countMismatches(volume, region, [&](int32 x, int32 y, int32 z) {
+				return extracted[(x - region.lower().x()) * extractedStrides.x() + (y - region.lower().y()) * extractedStrides.y() + (z - region.lower().z()) * extractedStrides.z()];
+			});
+		};
+		mismatches += check(data, { 1, region.width(), region.width() * region.height() });
+		mismatches += check(reversedData, strides);
+	}
+
+	// A mostly empty export, with the volume much smaller than the region.
+	Volume sparseVolume;
+	sparseVolume.fillBrush(SphereBrush(Vector3f::filled(0.0f), 10.0f), 1);
+	const Box3i sparseRegion(Vector3i::filled(-128), Vector3i::filled(127));
+	std::vector<MaterialId> sparseData(sparseRegion.width() * sparseRegion.height() * sparseRegion.depth());
+	Timer timer;
+	sparseVolume.extractRegion(sparseRegion, sparseData.data());
+	const float extractTime = timer.elapsedTimeInMilliSeconds();
+
+	timer.start();
+	mismatches += countMismatches(sparseVolume, sparseRegion, [&](int32 x, int32 y, int32 z) {
+		return sparseData[(int64(z - sparseRegion.lower().z()) * sparseRegion.height() + (y - sparseRegion.lower().y())) * sparseRegion.width() + (x - sparseRegion.lower().x())];
+	});
+	const float voxelTime = timer.elapsedTimeInMilliSeconds();
+	log_info("Read a sparse 256^3 region in {} ms (extracted) and {} ms (voxel())", extractTime, voxelTime);
+
+	log_info("Region extraction test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+bool testSparseVolume()
+{
+	log_info("");
+	log_info("Sparse volume tests:");
+	log_info("--------------------");
+
+	FractalNoise fractalNoise(7);
+	const Box3i bounds(Vector3i::filled(-64), Vector3i::filled(63));
+	Volume noiseVolume;
+	generate(noiseVolume, bounds, [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+	Volume sphereVolume;
+	sphereVolume.fillBrush(SphereBrush(Vector3f::filled(0.5f), 60.0f), 3);
+
+	// Noise which is mirrored in each axis about the centre of the volume, to test merging of mirrored nodes.
+	auto mirror = [](int32 value) { return value < 0 ? -1 - value : value; };
+	Volume mirroredVolume;
+	generate(mirroredVolume, bounds, [&](int32 x, int32 y, int32 z) { return fractalNoise(mirror(x), mirror(y), mirror(z)); });
+
+	uint32_t mismatches = 0;
+	for (Volume* volume : { &noiseVolume, &sphereVolume, &mirroredVolume })
+	{
+		volume->bake();
+		SparseVolume sparseVolume(*volume);
+		SparseVolume mirroredSparseVolume(*volume, true);
+
+		const uint64 denseBytes = uint64(volume->countNodes()) * sizeof(Node);
+		log_info("{} nodes need {} KiB (dense), {} KiB (sparse) and {} KiB (sparse with mirrored nodes merged)", volume->countNodes(),
+			denseBytes / 1024, sparseVolume.nodes().byteCount() / 1024, mirroredSparseVolume.nodes().byteCount() / 1024);
+
+		std::minstd_rand rng;
+		std::uniform_int_distribution<int32> dist(-70, 69);
+		std::vector<Vector3i> positions(1000000);
+		for (Vector3i& position : positions) { position = { dist(rng), dist(rng), dist(rng) }; }
+
+		Timer timer;
+		uint32 denseSum = 0;
+		for (const Vector3i& position : positions) { denseSum += volume->voxel(position); }
+		const float denseTime = timer.elapsedTimeInMilliSeconds();
+
+		timer.start();
+		uint32 sparseSum = 0;
+		for (const Vector3i& position : positions) { sparseSum += sparseVolume.voxel(position.x(), position.y(), position.z()); }
+		const float sparseTime = timer.elapsedTimeInMilliSeconds();
+
+		timer.start();
+		uint32 mirroredSum = 0;
+		for (const Vector3i& position : positions) { mirroredSum += mirroredSparseVolume.voxel(position.x(), position.y(), position.z()); }
+		const float mirroredTime = timer.elapsedTimeInMilliSeconds();
+		log_info("Read {} random voxels in {} ms (dense), {} ms (sparse) and {} ms (sparse with mirrored nodes merged)",
+			positions.size(), denseTime, sparseTime, mirroredTime);
+
+		if (denseSum != sparseSum || denseSum != mirroredSum) { mismatches++; }
+		mismatches += countMismatches(*volume, bounds, [&](int32 x, int32 y, int32 z) { return sparseVolume.voxel(x, y, z); });
+		mismatches += countMismatches(*volume, bounds, [&](int32 x, int32 y, int32 z) { return mirroredSparseVolume.voxel(x, y, z); });
+	}
+
+	// Uniform volumes have no nodes at all.
+	Volume solidVolume;
+	solidVolume.fill(9);
+	SparseVolume sparseSolidVolume(solidVolume);
+	if (sparseSolidVolume.voxel(1234, -5678, 90) != 9) { mismatches++; }
+
+	log_info("Sparse volume test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// A snapshot should keep seeing the volume exactly as it was when taken, both when read on the editing thread and
+// when read concurrently with edits, bakes and garbage collections (which are deferred until it is released).
+bool testSnapshots()
+{
+	log_info("");
+	log_info("Snapshot tests:");
+	log_info("---------------");
+
+	const int sideLength = 64;
+	FractalNoise fractalNoise(7);
+	Volume volume;
+	generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+	volume.bake();
+	volume.setSnapshotsEnabled(true);
+	volume.setGarbageCollectionTrigger(20000);
+
+	// Edits always fill the same sphere, so voxels clearly inside it should have the same material in any snapshot
+	// and voxels clearly outside it should never change. Those close to the surface are not checked.
+	const Vector3f centre = Vector3f::filled(sideLength / 2.0f);
+	const float radius = 16.0f;
+	std::vector<Vector3i> insidePoints;
+	std::vector<Vector3i> outsidePoints;
+	for (int i = 0; i < 2000; i++)
+	{
+		const Vector3i point({ rand() % sideLength, rand() % sideLength, rand() % sideLength });
+		const Vector3f offset = static_cast<Vector3f>(point) - centre;
+		const float distanceSquared = offset.x() * offset.x() + offset.y() * offset.y() + offset.z() * offset.z();
+		if (distanceSquared < (radius - 1.0f) * (radius - 1.0f)) { insidePoints.push_back(point); }
+		else if (distanceSquared > (radius + 1.0f) * (radius + 1.0f)) { outsidePoints.push_back(point); }
+	}
+
+	uint32_t mismatches = 0;
+
+	// On one thread, a snapshot is unaffected by later edits, and a bake waits until it has been released.
+	{
+		VolumeSnapshot snapshot = volume.snapshot();
+		const uint32 bakedNodeCount = getNodes(volume).storedNodeCount();
+		for (int i = 0; i < 10; i++) { volume.fillBrush(SphereBrush(centre, radius), 200 + i); }
+		volume.bake();
+		const uint32 unbakedNodeCount = getNodes(volume).storedNodeCount();
+		if (unbakedNodeCount <= bakedNodeCount) { mismatches++; }
+		for (const Vector3i& point : insidePoints)
+		{
+			if (snapshot.voxel(point.x(), point.y(), point.z()) != fractalNoise(point.x(), point.y(), point.z())) { mismatches++; }
+			if (volume.voxel(point.x(), point.y(), point.z()) != 209) { mismatches++; }
+		}
+
+		// The deferred bake is done at the end of the first edit after the release.
+		snapshot.release();
+		volume.fillBrush(SphereBrush(centre, radius), 210);
+		if (getNodes(volume).storedNodeCount() > unbakedNodeCount / 2) { mismatches++; }
+	}
+
+	// Readers take snapshots (and trace a ray through each one) while the writer edits, bakes and collects.
+	std::atomic<bool> done = false;
+	std::atomic<uint32> readerMismatches = 0;
+	std::atomic<uint32> snapshotCount = 0;
+	auto reader = [&]()
+	{
+		const Vector3f origin({ -100.0f, -50.0f, -120.0f });
+		const Vector3f dir = (centre - origin) / length(centre - origin);
+		const Ray3f ray(origin, dir);
+		while (!done)
+		{
+			VolumeSnapshot snapshot = volume.snapshot();
+			const MaterialId insideMatId = snapshot.voxel(insidePoints[0].x(), insidePoints[0].y(), insidePoints[0].z());
+			for (int pass = 0; pass < 2; pass++)
+			{
+				for (const Vector3i& point : insidePoints)
+				{
+					if (snapshot.voxel(point.x(), point.y(), point.z()) != insideMatId) { readerMismatches++; }
+				}
+				for (const Vector3i& point : outsidePoints)
+				{
+					if (snapshot.voxel(point.x(), point.y(), point.z()) != fractalNoise(point.x(), point.y(), point.z())) { readerMismatches++; }
+				}
+			}
+
+			const SubDAGArray subDAGs = findSubDAGs(snapshot.nodes().nodes(), snapshot.rootNodeIndex());
+			if (!intersectVolume(snapshot, subDAGs, ray, false).hit) { readerMismatches++; }
+			snapshotCount++;
+		}
+	};
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 3; i++) { readers.emplace_back(reader); }
+
+	Timer timer;
+	const int editCount = 500;
+	for (int i = 0; i < editCount; i++)
+	{
+		volume.fillBrush(SphereBrush(centre, radius), 1 + i % 250);
+		if (i % 50 == 49) { volume.bake(); }
+		if (i % 50 == 24) { volume.collectGarbage(); }
+	}
+	const float editTime = timer.elapsedTimeInMilliSeconds();
+
+	done = true;
+	for (std::thread& thread : readers) { thread.join(); }
+	mismatches += readerMismatches;
+
+	log_info("Made {} edits in {} ms while {} snapshots were read on other threads", editCount, editTime, uint32(snapshotCount));
+	log_info("Snapshot test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// The statistics should agree with a simple recursive count, and be internally consistent.
+uint32 countNodesRecursive(const NodeDAG& nodes, uint32 nodeIndex, std::unordered_set<uint32>& visited)
+{
+	if (isMaterialNode(nodeIndex) || !visited.insert(nodeIndex).second) { return 0; }
+
+	uint32 count = 1;
+	for (uint32 childIndex : nodes[nodeIndex]) { count += countNodesRecursive(nodes, childIndex, visited); }
+	return count;
+}
+
+bool testStatistics()
+{
+	log_info("");
+	log_info("Statistics tests:");
+	log_info("-----------------");
+
+	const int sideLength = 128;
+	FractalNoise fractalNoise(7);
+	Volume volume;
+	generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+	volume.bake();
+	volume.setTrackEdits(true);
+	for (int i = 0; i < 20; i++)
+	{
+		SphereBrush brush(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), 8.0f);
+		volume.fillBrush(brush, rand() % 4);
+	}
+
+	uint32_t mismatches = 0;
+
+	Timer timer;
+	std::unordered_set<uint32> visited;
+	const uint32 referenceCount = countNodesRecursive(getNodes(volume), volume.rootNodeIndex(), visited);
+	const float referenceTime = timer.elapsedTimeInMilliSeconds();
+
+	timer.start();
+	const DAGStatistics statistics = volume.statistics();
+	const float statisticsTime = timer.elapsedTimeInMilliSeconds();
+	log_info("Counted {} nodes in {} ms (recursive) and {} ms (statistics)", referenceCount, referenceTime, statisticsTime);
+	log_info("{} baked and {} edit nodes, sharing ratio = {}, {} KiB reachable and {} KiB committed",
+		statistics.bakedNodeCount, statistics.editNodeCount, statistics.sharingRatio(),
+		statistics.reachableBytes / 1024, statistics.committedBytes / 1024);
+
+	if (statistics.uniqueNodeCount != referenceCount) { mismatches++; }
+	if (statistics.bakedNodeCount + statistics.editNodeCount != referenceCount) { mismatches++; }
+	if (statistics.bakedNodeCount == 0 || statistics.editNodeCount == 0) { mismatches++; }
+	if (std::accumulate(statistics.nodesPerLevel.begin(), statistics.nodesPerLevel.end(), uint32(0)) != referenceCount) { mismatches++; }
+	if (statistics.nodesPerLevel[32] != 1 || statistics.nodesPerLevel[0] != 0) { mismatches++; }
+
+	// Every child is either a material or a reference to a node, and the root is also a reference.
+	const uint64 materialLeafCount = std::accumulate(statistics.materialLeafCounts.begin(), statistics.materialLeafCounts.end(), uint64(0));
+	if (materialLeafCount + statistics.nodeReferenceCount - 1 != uint64(referenceCount) * 8) { mismatches++; }
+
+	// A material root is a single leaf.
+	volume.fill(3);
+	const DAGStatistics filledStatistics = volume.statistics();
+	if (filledStatistics.uniqueNodeCount != 0 || filledStatistics.materialLeafCounts[3] != 1) { mismatches++; }
+
+	log_info("Statistics test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Filling a brush should give the brush's material wherever it contains the voxel position, and leave the rest of the
+// volume as it was. This includes a brush which is not convex.
+bool testBrushes()
+{
+	log_info("");
+	log_info("Brush tests:");
+	log_info("------------");
+
+	const int sideLength = 128;
+	FractalNoise fractalNoise(7);
+	Volume original;
+	generate(original, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+	original.bake();
+
+	// A torus, which is not convex.
+	const Vector3f torusCentre({ 64.0f, 64.0f, 64.0f });
+	auto torus = [=](const Vector3f& point)
+	{
+		const Vector3f p = point - torusCentre;
+		const float ring = std::sqrt(p.x() * p.x() + p.z() * p.z()) - 40.0f;
+		return std::sqrt(ring * ring + p.y() * p.y()) - 12.5f;
+	};
+
+	const SphereBrush sphere(Vector3f({ 50.0f, 60.0f, 70.0f }), 30.5f);
+	const BoxBrush box(Box3f(Vector3f({ 10.0f, 20.5f, 30.0f }), Vector3f({ 100.0f, 90.0f, 80.2f })));
+	const CapsuleBrush capsule(Vector3f({ 5.0f, 10.0f, 20.0f }), Vector3f({ 120.0f, 100.0f, 60.0f }), 17.3f);
+	const SdfBrush sdf(torus, Box3f(Vector3f({ 11.5f, 51.5f, 11.5f }), Vector3f({ 116.5f, 76.5f, 116.5f })));
+
+	uint32_t mismatches = 0;
+	for (const Brush* brush : std::initializer_list<const Brush*>{ &sphere, &box, &capsule, &sdf })
+	{
+		Volume volume;
+		generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+		volume.bake();
+		volume.fillBrush(*brush, 9);
+
+		mismatches += countMismatches(volume, Box3i(Vector3i::filled(-4), Vector3i::filled(sideLength + 3)), [&](int32 x, int32 y, int32 z) {
+			return brush->contains(Vector3f({ float(x), float(y), float(z) })) ? 9 : original.voxel(x, y, z);
+		});
+	}
+
+	// A large edit only needs to descend along the surface of the brush.
+	Volume largeVolume;
+	Timer timer;
+	largeVolume.fillBrush(CapsuleBrush(Vector3f::filled(-300.0f), Vector3f::filled(300.0f), 100.0f), 1);
+	log_info("Filled a large capsule in {} ms", timer.elapsedTimeInMilliSeconds());
+	timer.start();
+	largeVolume.fillBrush(SdfBrush(torus, Box3f(Vector3f::filled(-100.0f), Vector3f::filled(200.0f))), 2);
+	log_info("Filled a torus in {} ms", timer.elapsedTimeInMilliSeconds());
+
+	log_info("Brush test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+bool testFillBrushes()
+{
+	log_info("");
+	log_info("Batched brush tests:");
+	log_info("--------------------");
+
+	const int sideLength = 128;
+	FractalNoise fractalNoise(7);
+	auto makeVolume = [&](Volume& volume)
+	{
+		generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+		volume.bake();
+	};
+
+	// Many small, overlapping brushes (as from an explosion) plus a few large ones.
+	std::vector<SphereBrush> spheres;
+	std::vector<MaterialId> materials;
+	for (int i = 0; i < 300; i++)
+	{
+		const float radius = i % 50 == 0 ? 30.0f : 2.0f + float(rand() % 6);
+		spheres.emplace_back(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), radius);
+		materials.push_back(static_cast<MaterialId>(rand() % 4));
+	}
+	std::vector<const Brush*> brushes;
+	for (const SphereBrush& sphere : spheres) { brushes.push_back(&sphere); }
+
+	Volume original;
+	makeVolume(original);
+
+	Volume sequentialVolume;
+	makeVolume(sequentialVolume);
+	sequentialVolume.setTrackEdits(true);
+	Timer timer;
+	for (size_t i = 0; i < brushes.size(); i++) { sequentialVolume.fillBrush(*brushes[i], materials[i]); }
+	const float sequentialTime = timer.elapsedTimeInMilliSeconds();
+
+	Volume batchedVolume;
+	makeVolume(batchedVolume);
+	batchedVolume.setTrackEdits(true);
+	timer.start();
+	batchedVolume.fillBrushes(brushes, materials);
+	const float batchedTime = timer.elapsedTimeInMilliSeconds();
+	log_info("Applied {} brushes in {} ms (sequential) and {} ms (batched)", brushes.size(), sequentialTime, batchedTime);
+
+	uint32_t mismatches = 0;
+	auto check = [&](const Volume& volume, const Volume& reference)
+	{
+		mismatches += countMismatches(volume, Box3i(Vector3i::filled(-4), Vector3i::filled(sideLength + 3)),
+			[&](int32 x, int32 y, int32 z) { return reference.voxel(x, y, z); });
+	};
+
+	check(batchedVolume, sequentialVolume);
+
+	// The whole batch is a single undo step.
+	const bool undone = batchedVolume.undo();
+	if (!undone || batchedVolume.undo()) { mismatches++; }
+	check(batchedVolume, original);
+
+	log_info("Batched brush test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+bool testEditTransactions()
+{
+	log_info("");
+	log_info("Edit transaction tests:");
+	log_info("-----------------------");
+
+	const int sideLength = 128;
+	FractalNoise fractalNoise(7);
+	auto makeVolume = [&](Volume& volume)
+	{
+		generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+		volume.bake();
+		volume.setTrackEdits(true);
+	};
+
+	// A stroke of many single voxel writes, plus a brush in the middle of it.
+	std::vector<Vector3i> positions;
+	for (int i = 0; i < 10000; i++)
+	{
+		const float t = i * 0.01f;
+		positions.push_back({ int32(64 + 40 * std::sin(t)), int32(64 + 40 * std::cos(t * 0.7f)), int32(i % sideLength) });
+	}
+	auto stroke = [&](Volume& volume)
+	{
+		for (size_t i = 0; i < positions.size(); i++)
+		{
+			volume.setVoxel(positions[i].x(), positions[i].y(), positions[i].z(), MaterialId(1 + i % 3));
+			if (i == positions.size() / 2) { volume.fillBrush(SphereBrush(Vector3f::filled(64.0f), 10.0f), 4); }
+		}
+	};
+
+	Volume original;
+	makeVolume(original);
+
+	Volume plainVolume;
+	makeVolume(plainVolume);
+	const uint32 nodesBefore = plainVolume.statistics().storedNodeCount;
+	Timer timer;
+	stroke(plainVolume);
+	const float plainTime = timer.elapsedTimeInMilliSeconds();
+	const uint32 plainNodes = plainVolume.statistics().storedNodeCount - nodesBefore;
+
+	Volume transactedVolume;
+	makeVolume(transactedVolume);
+	timer.start();
+	transactedVolume.beginEdit();
+	stroke(transactedVolume);
+	transactedVolume.commitEdit();
+	const float transactedTime = timer.elapsedTimeInMilliSeconds();
+	const uint32 transactedNodes = transactedVolume.statistics().storedNodeCount - nodesBefore;
+	log_info("Stroke created {} nodes in {} ms (separate edits) and {} nodes in {} ms (one transaction)",
+		plainNodes, plainTime, transactedNodes, transactedTime);
+
+	uint32_t mismatches = 0;
+	auto check = [&](const auto& volume, const Volume& reference)
+	{
+		// The volume may be a snapshot, so it gives the expected voxels.
+		mismatches += countMismatches(reference, Box3i(Vector3i::filled(-4), Vector3i::filled(sideLength + 3)),
+			[&](int32 x, int32 y, int32 z) { return volume.voxel(x, y, z); });
+	};
+	check(transactedVolume, plainVolume);
+
+	// The transaction is a single undo step, and redoing it restores the result.
+	const bool undone = transactedVolume.undo();
+	check(transactedVolume, original);
+	if (!undone || transactedVolume.undo()) { mismatches++; }
+	if (!transactedVolume.redo()) { mismatches++; }
+	check(transactedVolume, plainVolume);
+
+	// The same in hash-consing mode, where fresh nodes are only modified in-place if they are unshared.
+	Volume hashConsedVolume;
+	makeVolume(hashConsedVolume);
+	hashConsedVolume.setHashConsing(true);
+	hashConsedVolume.beginEdit();
+	stroke(hashConsedVolume);
+	hashConsedVolume.commitEdit();
+	check(hashConsedVolume, plainVolume);
+	if (!hashConsedVolume.undo()) { mismatches++; }
+	check(hashConsedVolume, original);
+
+	// Nested transactions, with snapshots which only see the committed state.
+	Volume nestedVolume;
+	makeVolume(nestedVolume);
+	nestedVolume.setSnapshotsEnabled(true);
+	nestedVolume.beginEdit();
+	nestedVolume.beginEdit();
+	stroke(nestedVolume);
+	nestedVolume.commitEdit();
+	check(nestedVolume.snapshot(), original);
+	nestedVolume.commitEdit();
+	check(nestedVolume.snapshot(), plainVolume);
+
+	log_info("Edit transaction test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+bool testUndoLimits()
+{
+	log_info("");
+	log_info("Undo limit tests:");
+	log_info("-----------------");
+
+	const int sideLength = 64;
+	FractalNoise fractalNoise(7);
+	auto makeVolume = [&](Volume& volume)
+	{
+		generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+		volume.bake();
+		volume.setTrackEdits(true);
+	};
+
+	std::vector<SphereBrush> brushes;
+	for (int i = 0; i < 40; i++)
+	{
+		brushes.emplace_back(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), 6.0f);
+	}
+
+	uint32_t mismatches = 0;
+	auto check = [&](const Volume& volume, const Volume& reference)
+	{
+		mismatches += countMismatches(volume, Box3i(Vector3i::filled(-2), Vector3i::filled(sideLength + 1)),
+			[&](int32 x, int32 y, int32 z) { return reference.voxel(x, y, z); });
+	};
+
+	// The reference keeps its whole history.
+	Volume reference;
+	makeVolume(reference);
+	for (size_t i = 0; i < brushes.size(); i++) { reference.fillBrush(brushes[i], MaterialId(1 + i % 5)); }
+
+	// A step limit.
+	Volume stepLimited;
+	makeVolume(stepLimited);
+	stepLimited.setUndoLimits(10);
+	for (size_t i = 0; i < brushes.size(); i++) { stepLimited.fillBrush(brushes[i], MaterialId(1 + i % 5)); }
+	uint32 undoCount = 0;
+	while (stepLimited.undo()) { undoCount++; }
+	for (uint32 i = 0; i < undoCount; i++) { reference.undo(); }
+	check(stepLimited, reference);
+	log_info("Undid {} steps with a limit of 10", undoCount);
+	if (undoCount != 10) { mismatches++; }
+	while (reference.redo()) {}
+
+	// A byte limit, with the nodes of evicted steps being reclaimed.
+	Volume byteLimited;
+	makeVolume(byteLimited);
+	const uint64 maxBytes = uint64(reference.statistics().uniqueNodeCount) * 3 / 2 * sizeof(Node);
+	byteLimited.setUndoLimits(0, maxBytes);
+	uint64 peakBytes = 0;
+	for (size_t i = 0; i < brushes.size(); i++)
+	{
+		byteLimited.fillBrush(brushes[i], MaterialId(1 + i % 5));
+		peakBytes = std::max<uint64>(peakBytes, uint64(byteLimited.statistics().storedNodeCount) * sizeof(Node));
+	}
+	undoCount = 0;
+	while (byteLimited.undo()) { undoCount++; }
+	for (uint32 i = 0; i < undoCount; i++) { reference.undo(); }
+	check(byteLimited, reference);
+	log_info("Peak of {} KiB with a limit of {} KiB, and {} steps could be undone", peakBytes / 1024, maxBytes / 1024, undoCount);
+	if (peakBytes > maxBytes || undoCount == 0 || undoCount == brushes.size()) { mismatches++; }
+	while (reference.redo()) {}
+
+	// Spilling evicted steps to disk, so that the whole history can still be undone.
+	Volume spilling;
+	makeVolume(spilling);
+	const std::filesystem::path spillDirectory = std::filesystem::temp_directory_path() / "testUndoLimits";
+	std::filesystem::create_directories(spillDirectory);
+	spilling.setUndoLimits(5, 0, spillDirectory.string());
+	for (size_t i = 0; i < brushes.size(); i++) { spilling.fillBrush(brushes[i], MaterialId(1 + i % 5)); }
+	const uint32 inMemoryNodes = spilling.statistics().storedNodeCount;
+
+	// The steps are in a directory of the volume's own, which is removed once they have all been reloaded.
+	const auto spillDirectoryEntries = [&]() { return std::distance(std::filesystem::directory_iterator(spillDirectory), {}); };
+	if (spillDirectoryEntries() != 1) { mismatches++; }
+	for (size_t i = 0; i < brushes.size(); i++)
+	{
+		if (!spilling.undo()) { mismatches++; }
+		reference.undo();
+		if (i % 8 == 7) { check(spilling, reference); }
+	}
+	if (spilling.undo()) { mismatches++; }
+	check(spilling, reference);
+	if (spillDirectoryEntries() != 0) { mismatches++; }
+	log_info("Undid {} steps with 5 kept in memory ({} nodes stored)", brushes.size(), inMemoryNodes);
+
+	log_info("Undo limit test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+// Combining volumes should give the same result as combining each pair of voxels, for the built-in operations
+// and a general combiner, including when a volume is combined with itself. Volumes with mostly identical content
+// should be fast to combine.
+bool testCombineVolume()
+{
+	log_info("");
+	log_info("Volume combination tests:");
+	log_info("-------------------------");
+
+	const int sideLength = 128;
+	FractalNoise fractalNoise(7);
+	auto makeVolume = [&](Volume& volume)
+	{
+		generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(sideLength - 1)), [&](int32 x, int32 y, int32 z) { return fractalNoise(x, y, z); });
+		volume.bake();
+	};
+
+	// The other volume has the same noise but with some spheres dug out and others filled in.
+	Volume rhsVolume;
+	makeVolume(rhsVolume);
+	for (int i = 0; i < 20; i++)
+	{
+		SphereBrush brush(Vector3f({ float(rand() % sideLength), float(rand() % sideLength), float(rand() % sideLength) }), 10.0f);
+		rhsVolume.fillBrush(brush, i % 2 == 0 ? 0 : 5);
+	}
+	rhsVolume.bake();
+
+	uint32_t mismatches = 0;
+	auto check = [&](const Volume& volume, const Volume& lhsVolume, const Volume& rhsVolume, auto combiner)
+	{
+		mismatches += countMismatches(volume, Box3i(Vector3i::filled(-4), Vector3i::filled(sideLength + 3)),
+			[&](int32 x, int32 y, int32 z) { return combiner(lhsVolume.voxel(x, y, z), rhsVolume.voxel(x, y, z)); });
+	};
+
+	Volume lhsVolume;
+	makeVolume(lhsVolume);
+
+	auto subtract = [](MaterialId lhs, MaterialId rhs) -> MaterialId { return rhs == 0 ? lhs : 0; };
+	auto intersect = [](MaterialId lhs, MaterialId rhs) -> MaterialId { return rhs == 0 ? 0 : lhs; };
+	auto maximum = [](MaterialId lhs, MaterialId rhs) -> MaterialId { return std::max(lhs, rhs); };
+
+	Volume volume;
+	makeVolume(volume);
+	Timer timer;
+	volume.subtractVolume(rhsVolume);
+	const float subtractTime = timer.elapsedTimeInMilliSeconds();
+	check(volume, lhsVolume, rhsVolume, subtract);
+
+	Volume addedVolume;
+	makeVolume(addedVolume);
+	timer.start();
+	addedVolume.addVolume(rhsVolume);
+	const float addTime = timer.elapsedTimeInMilliSeconds();
+	log_info("Subtracted a similar volume in {} ms (addVolume() took {} ms)", subtractTime, addTime);
+
+	// Intersection with undo.
+	Volume intersectedVolume;
+	makeVolume(intersectedVolume);
+	intersectedVolume.setTrackEdits(true);
+	intersectedVolume.intersectVolume(rhsVolume);
+	check(intersectedVolume, lhsVolume, rhsVolume, intersect);
+	if (!intersectedVolume.undo()) { mismatches++; }
+	check(intersectedVolume, lhsVolume, lhsVolume, [](MaterialId lhs, MaterialId) { return lhs; });
+
+	// A general combiner, applied to unbaked edits.
+	Volume combinedVolume;
+	makeVolume(combinedVolume);
+	combinedVolume.fillBrush(SphereBrush(Vector3f::filled(sideLength / 2.0f), 20.0f), 7);
+	lhsVolume.fillBrush(SphereBrush(Vector3f::filled(sideLength / 2.0f), 20.0f), 7);
+	combinedVolume.combineVolume(rhsVolume, maximum);
+	check(combinedVolume, lhsVolume, rhsVolume, maximum);
+
+	// The same in hash-consing mode.
+	Volume hashConsedVolume;
+	makeVolume(hashConsedVolume);
+	hashConsedVolume.setHashConsing(true);
+	hashConsedVolume.fillBrush(SphereBrush(Vector3f::filled(sideLength / 2.0f), 20.0f), 7);
+	hashConsedVolume.combineVolume(rhsVolume, maximum);
+	check(hashConsedVolume, lhsVolume, rhsVolume, maximum);
+
+	// Combining a volume with itself.
+	combinedVolume.intersectVolume(combinedVolume);
+	check(combinedVolume, lhsVolume, rhsVolume, maximum);
+	combinedVolume.subtractVolume(combinedVolume);
+	check(combinedVolume, combinedVolume, combinedVolume, [](MaterialId, MaterialId) { return MaterialId(0); });
+
+	log_info("Volume combination test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+bool testPasteVolume()
+{
+	log_info("");
+	log_info("Volume paste tests:");
+	log_info("-------------------");
+
+	const int sideLength = 128;
+	const int prefabSideLength = 64;
+	FractalNoise fractalNoise(7);
+	auto makeVolume = [&](Volume& volume, int size, int seed)
+	{
+		generate(volume, Box3i(Vector3i::filled(0), Vector3i::filled(size - 1)),
+			[&](int32 x, int32 y, int32 z) { return fractalNoise(x + seed, y, z); });
+		volume.bake();
+	};
+
+	// The prefab has plenty of empty space, which is transparent.
+	Volume prefab;
+	makeVolume(prefab, prefabSideLength, 1000);
+	prefab.fillBrush(SphereBrush(Vector3f::filled(prefabSideLength / 2.0f), 16.0f), 9);
+
+	Volume original;
+	makeVolume(original, sideLength, 0);
+
+	uint32_t mismatches = 0;
+	auto check = [&](const Volume& volume, const Volume& base, const Volume& source, const Vector3i& offset)
+	{
+		mismatches += countMismatches(volume, Box3i(Vector3i::filled(-4), Vector3i::filled(sideLength + 3)), [&](int32 x, int32 y, int32 z) {
+			const MaterialId pasted = source.voxel(x - offset.x(), y - offset.y(), z - offset.z());
+			return pasted != 0 ? pasted : base.voxel(x, y, z);
+		});
+	};
+
+	const Vector3i offsets[] = { { 0, 0, 0 }, { 64, 0, -32 }, { 17, -5, 3 }, { -40, 90, 33 } };
+	for (const Vector3i& offset : offsets)
+	{
+		Volume volume;
+		makeVolume(volume, sideLength, 0);
+		volume.pasteVolume(prefab, offset);
+		check(volume, original, prefab, offset);
+	}
+
+	// Pasting with undo, onto unbaked edits.
+	const SphereBrush sphere(Vector3f::filled(sideLength / 2.0f), 20.0f);
+	Volume editedOriginal;
+	makeVolume(editedOriginal, sideLength, 0);
+	editedOriginal.fillBrush(sphere, 7);
+
+	Volume editedVolume;
+	makeVolume(editedVolume, sideLength, 0);
+	editedVolume.setTrackEdits(true);
+	editedVolume.fillBrush(sphere, 7);
+	editedVolume.pasteVolume(prefab, Vector3i({ 30, 31, 32 }));
+	check(editedVolume, editedOriginal, prefab, Vector3i({ 30, 31, 32 }));
+	if (!editedVolume.undo()) { mismatches++; }
+	check(editedVolume, editedOriginal, prefab, Vector3i::filled(sideLength * 2)); // Nothing pasted in range.
+
+	// Pasting a volume onto itself, so the source is the volume as it was before the paste.
+	Volume selfVolume;
+	makeVolume(selfVolume, sideLength, 0);
+	selfVolume.fillBrush(sphere, 7);
+	selfVolume.pasteVolume(selfVolume, Vector3i({ 13, -7, 64 }));
+	check(selfVolume, editedOriginal, editedOriginal, Vector3i({ 13, -7, 64 }));
+
+	// Stamping many prefabs, with the offsets aligned to the prefab size or not.
+	auto stamp = [&](int alignment)
+	{
+		Volume volume;
+		makeVolume(volume, sideLength, 0);
+		Timer timer;
+		for (int i = 0; i < 64; i++)
+		{
+			const Vector3i offset({ (i % 4) * prefabSideLength, ((i / 4) % 4) * prefabSideLength, (i / 16) * prefabSideLength });
+			volume.pasteVolume(prefab, offset + Vector3i::filled(alignment));
+		}
+		return timer.elapsedTimeInMilliSeconds();
+	};
+	const float alignedTime = stamp(0);
+	const float unalignedTime = stamp(5);
+	log_info("Pasted 64 prefabs in {} ms (aligned) and {} ms (unaligned)", alignedTime, unalignedTime);
+
+	log_info("Volume paste test gave {} mismatches", mismatches);
+	assert(mismatches == 0);
+
+	return mismatches == 0;
+}
+
+bool testSphere()
+{
+	return true;
+}
+
+bool testCSG()
+{
+	Volume building;
+	building.load("../data/voxelized.dag");
+	Volume shapes;
+	shapes.load("../data/shapes.dag");
+
+	building.addVolume(shapes);
+
+	building.save("../data/csg.dag");
+
+	uint8 outside_material;
+	int32 lower_x, lower_y, lower_z, upper_x, upper_y, upper_z;
+	cubiquity_estimate_bounds(&building, &outside_material, &lower_x, &lower_y, &lower_z, &upper_x, &upper_y, &upper_z);
+	log_info("({},{},{}) ({},{},{})", lower_x, lower_y, lower_z, upper_x, upper_y, upper_z);
+
+	int64_t histogram[256];
+	cubiquity_compute_histogram(&building, histogram);
+	for (int i = 0; i < 256; i++)
+	{
+		if (histogram[i] != 0) // Note that -1 can occur to indicate overflow
+		{
+			log_info("Material {}: {} voxels", static_cast<uint16_t>(i), histogram[i]);
+		}
+	}
+
+	return true;
+}
+
+bool testVolume()
+{
+	srand(12345);
+
+	// Slow test, so not usually run.
+	/*if(!PositionEnumerator::test())
+	{
+		log_error("PositionEnumerator::test() failed!");(
+	}*/
+
+	bool result = true;
+	for (bool (*test)() :
+	{
+		testBounds,
+		testBasics,
+		testNodeStore,
+		//testCSG,
+		testCheckerboard,
+		testRandomAccess,
+		testFractalNoise,
+		testMerging,
+		testBakeScaling,
+		testParallelBake,
+		testNodeMap,
+		testIncrementalBake,
+		testHashConsing,
+		testGarbageCollection,
+		testSetVoxels,
+		testBrushes,
+		testFillBrushes,
+		testSetRegion,
+		testGenerate,
+		testVolumeSampler,
+		testExtractRegion,
+		testSparseVolume,
+		testSnapshots,
+		testEditTransactions,
+		testUndoLimits,
+		testStatistics,
+		testCombineVolume,
+		testPasteVolume,
+		testSerialization,
+	})
+	{
+		if (!test())
+		{
+			log_error("TEST FAILED!");
+			result = false;
+		}
+	}
+
+	return result;
 }
@@ -17,7 +17,7 @@ Viewer::Viewer(const std::string& filename, WindowType windowType)
 	: Window(windowType)
 {
 	log_info("Opening volume '{}'", filename);
-	if (!mVolume.load(filename))
+	if (!mVolume.load(filename, true))
 	{
 		log_error("Failed to open volume!");
 		exit(EXIT_FAILURE);
@@ -162,6 +162,7 @@ void Viewer::onMouseButtonDown(const SDL_MouseButtonEvent& event)
 		{
 			SphereBrush brush(static_cast<Vector3f>(intersection.position), 30);
 			mVolume.fillBrush(brush, 0);
+			mVolume.bakeEdits(); // Cheap, and stops the edit nodes accumulating.
 
 			onVolumeModified();
 		}
@@ -27,7 +27,10 @@ namespace Cubiquity
 	//                                                                                            //
 	////////////////////////////////////////////////////////////////////////////////////////////////
 
-	SubDAG findSubDAG(const Internals::NodeStore& nodes, uint rootNodeIndex, uint childId)
+	// The traversal functions below are templatised so they work with either node layout (see SparseNodeStore). They
+	// treat node indices as opaque, which lets a sparse store carry the reflection of a mirrored subtree in the index.
+	template <typename NodeStoreType>
+	SubDAG findSubDAG(const NodeStoreType& nodes, uint rootNodeIndex, uint childId)
 	{
 		// Initialised for root, but updated on first iteration of the loop.
 		int childHeight = 32;
@@ -73,7 +76,8 @@ namespace Cubiquity
 		return subDAG;
 	}
 
-	SubDAGArray findSubDAGs(const Internals::NodeStore& nodes, uint32 rootNodeIndex)
+	template <typename NodeStoreType>
+	SubDAGArray findSubDAGsInStore(const NodeStoreType& nodes, uint32 rootNodeIndex)
 	{
 		SubDAGArray subDAGs;
 		for (uint childId = 0; childId < 8; childId++)
@@ -83,7 +87,18 @@ namespace Cubiquity
 		return subDAGs;
 	}
 
-	SubDAG getSubDAG(const Internals::NodeStore& nodes, uint rootNodeIndex, const SubDAGArray& subDAGs, uint childId)
+	SubDAGArray findSubDAGs(const Internals::NodeStore& nodes, uint32 rootNodeIndex)
+	{
+		return findSubDAGsInStore(nodes, rootNodeIndex);
+	}
+
+	SubDAGArray findSubDAGs(const Internals::SparseNodeStore& nodes, uint32 rootNodeIndex)
+	{
+		return findSubDAGsInStore(nodes, rootNodeIndex);
+	}
+
+	template <typename NodeStoreType>
+	SubDAG getSubDAG(const NodeStoreType& nodes, uint rootNodeIndex, const SubDAGArray& subDAGs, uint childId)
 	{
 		int method = 1;
 		switch (method) {
@@ -118,7 +133,8 @@ namespace Cubiquity
 	// It does not check for intersection and so might be faster than an ESVO-type approach (less logic,
 	// but maybe more memory accesses?), at the expense of some precision (the ray might actually miss
 	// the nearest occupied child). I'm assuming this doesn't matter too much as voxels are tiny on screen.
-	uint findNearestMaterial(const Internals::NodeStore& nodes, uint nodeIndex, uint rayDirSignBits)
+	template <typename NodeStoreType>
+	uint findNearestMaterial(const NodeStoreType& nodes, uint nodeIndex, uint rayDirSignBits)
 	{
 		// We use a clever packing trick for the array of child IDs to iterate over. Each of the 8 child
 		// IDs (0-7) needs only three bits, and a fourth 'valid' bit is used to indicate that a value is
@@ -197,7 +213,8 @@ namespace Cubiquity
 	// used to culling child voxels against the contours (which are potentially stored for eah level
 	// and combined when descending the tree). ESVO paper also tracks child entry point incrementally,
 	// but we don't need to do that here (the exit point is enough).
-	RayVolumeIntersection intersectRayNodeESVO(const Internals::NodeStore& nodes,
+	template <typename NodeStoreType>
+	RayVolumeIntersection intersectRayNodeESVO(const NodeStoreType& nodes,
 		uint nodeIndex, ivec3 nodePos, int nodeHeight,
 		Ray3f ray, vec3 rayDirSign, uint rayDirSignBits,
 		bool computeSurfaceProperties, float maxFootprint)
@@ -381,14 +398,11 @@ namespace Cubiquity
 	// for Octree Traversal'. I think that the standard behaviour of IEEE 754 handling of +/-infinity
 	// and NaNs might be enough but I am not certain. If it proves to be a problem (if we ever see
 	// NaNs?) then it can be solved by nudging tiny direction components away from zero.
-	RayVolumeIntersection intersectVolume(const Volume& volume, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint)
+	template <typename NodeStoreType>
+	RayVolumeIntersection intersectNodes(const NodeStoreType& nodes, uint rootNodeIndex, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint)
 	{
 		RayVolumeIntersection intersection = { false, 0, 0, {0, 0, 0}, {0, 0, 0} }; // Miss
 
-		const Internals::NodeStore& nodes = Internals::getNodes(volume).nodes();
-
-		const uint rootNodeIndex = Internals::getRootNodeIndex(volume);
-
 		// Store the sign of the ray direction
 		ivec3 rayDirSignBitsAsVec = ivec3(lessThan(ray.mDir, vec3({0,0,0}))); // 0 means +ve, 1 means -ve
 		uint rayDirSignBits = rayDirSignBitsAsVec[0] | (rayDirSignBitsAsVec[1] << 1) | (rayDirSignBitsAsVec[2] << 2);
@@ -453,4 +467,20 @@ namespace Cubiquity
 
 		return intersection;
 	}
+
+	RayVolumeIntersection intersectVolume(const Volume& volume, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint)
+	{
+		return intersectNodes(Internals::getNodes(volume).nodes(), Internals::getRootNodeIndex(volume),
+			subDAGs, ray, computeSurfaceProperties, maxFootprint);
+	}
+
+	RayVolumeIntersection intersectVolume(const SparseVolume& volume, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint)
+	{
+		return intersectNodes(volume.nodes(), volume.rootNodeIndex(), subDAGs, ray, computeSurfaceProperties, maxFootprint);
+	}
+
+	RayVolumeIntersection intersectVolume(const VolumeSnapshot& snapshot, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint)
+	{
+		return intersectNodes(snapshot.nodes().nodes(), snapshot.rootNodeIndex(), subDAGs, ray, computeSurfaceProperties, maxFootprint);
+	}
 }
@@ -71,9 +71,15 @@ namespace Cubiquity
 	typedef std::array<SubDAG, 8> SubDAGArray;
 
 	SubDAGArray findSubDAGs(const Internals::NodeStore& nodes, uint32 rootNodeIndex);
+	SubDAGArray findSubDAGs(const Internals::SparseNodeStore& nodes, uint32 rootNodeIndex);
 
 	const float MAX_FOOTPRINT_DISABLED = -1.0f;
 	RayVolumeIntersection intersectVolume(const Volume& volume, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint = MAX_FOOTPRINT_DISABLED);
+	RayVolumeIntersection intersectVolume(const SparseVolume& volume, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint = MAX_FOOTPRINT_DISABLED);
+
+	// Snapshots can be traced from any thread while the volume is edited. The sub-DAGs must come from the same snapshot,
+	// i.e. findSubDAGs(snapshot.nodes().nodes(), snapshot.rootNodeIndex()).
+	RayVolumeIntersection intersectVolume(const VolumeSnapshot& snapshot, const SubDAGArray& subDAGs, Ray3f ray, bool computeSurfaceProperties, float maxFootprint = MAX_FOOTPRINT_DISABLED);
 }
 
 #endif // CUBIQUITY_RAYTRACING_H
@@ -13,9 +13,37 @@
 #include "storage.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+// Work around missing std::execution support (see the same block in voxelization.cpp).
+#ifdef CUBIQUITY_USE_POOLSTL
+	#define POOLSTL_STD_SUPPLEMENT
+	#define POOLSTL_STD_SUPPLEMENT_FORCE
+	#include "../application/external/poolstl.hpp"
+#else
+	#include <execution>
+#endif // CUBIQUITY_USE_POOLSTL
+
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif // _WIN32
 
 namespace Cubiquity
 {
@@ -23,6 +51,63 @@ namespace Cubiquity
 
 	bool Internals::isMaterialNode(uint32 nodeIndex) { return nodeIndex < MaterialCount; }
 
+	////////////////////////////////////////////////////////////////////////////////
+	// Virtual memory management
+	////////////////////////////////////////////////////////////////////////////////
+
+	// Memory is committed and decommitted in blocks of this many nodes (64 KiB), which is a
+	// multiple of the page size on all platforms we care about. The node store capacity is
+	// also rounded to a multiple of this so that both committed ranges stay block-aligned.
+	constexpr uint32 CommitBlockSize = 2048;
+
+	// Reserving the smallest sensible store should never fail, so we stop halving here.
+	constexpr uint32 MinCapacity = 0x100000;
+
+	uint64 roundUpToCommitBlock(uint64 index) { return (index + CommitBlockSize - 1) & ~uint64(CommitBlockSize - 1); }
+	uint64 roundDownToCommitBlock(uint64 index) { return index & ~uint64(CommitBlockSize - 1); }
+
+	// Reserve address space without committing any physical memory (or swap) to back it.
+	void* reserveAddressSpace(uint64 bytes)
+	{
+#if defined(_WIN32)
+		return VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+		void* ptr = mmap(nullptr, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		return ptr == MAP_FAILED ? nullptr : ptr;
+#endif // _WIN32
+	}
+
+	void releaseAddressSpace(void* ptr, uint64 bytes)
+	{
+#if defined(_WIN32)
+		(void)bytes;
+		VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+		munmap(ptr, bytes);
+#endif // _WIN32
+	}
+
+	// Newly committed memory is guaranteed to be zeroed by the OS.
+	bool commitMemory(void* ptr, uint64 bytes)
+	{
+#if defined(_WIN32)
+		return VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+		return mprotect(ptr, bytes, PROT_READ | PROT_WRITE) == 0;
+#endif // _WIN32
+	}
+
+	// Return the physical memory to the OS but keep the address space reserved.
+	void decommitMemory(void* ptr, uint64 bytes)
+	{
+#if defined(_WIN32)
+		VirtualFree(ptr, bytes, MEM_DECOMMIT);
+#else
+		// Mapping fresh pages over the range discards the old ones (a plain mprotect() would not).
+		mmap(ptr, bytes, PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif // _WIN32
+	}
+
 	// See https://stackoverflow.com/a/57796299
 	constexpr Node makeNode(uint32 value)
 	{
@@ -31,6 +116,171 @@ namespace Cubiquity
 		return node;
 	}
 
+	NodeStore::NodeStore(uint32 capacity)
+	{
+		// If we can't get the requested address space (e.g. due to a ulimit, or on a 32-bit
+		// system) then keep halving it, as a smaller store is much better than no store at all.
+		uint64 reservedCapacity = roundUpToCommitBlock(std::max(capacity, MinCapacity));
+		while (true)
+		{
+			mData = static_cast<Node*>(reserveAddressSpace(reservedCapacity * sizeof(Node)));
+			if (mData || reservedCapacity <= MinCapacity) { break; }
+			reservedCapacity /= 2;
+		}
+
+		if (!mData)
+		{
+			log_warning("Failed to reserve address space for node store!");
+			throw std::bad_alloc();
+		}
+
+		if (reservedCapacity < capacity)
+		{
+			std::stringstream ss;
+			ss << "Node store capacity reduced from " << capacity << " to " << reservedCapacity << " nodes";
+			log_warning(ss.str());
+		}
+
+		mCapacity = static_cast<uint32>(std::min(reservedCapacity, uint64(UINT32_MAX)));
+		mLowerCommitEnd = 0;
+		mUpperCommitBegin = mCapacity;
+
+		// The material nodes are never written but are sometimes read (e.g. when a material node is
+		// treated as a parent of itself), and the GPU upload includes them. So they must be backed.
+		commit(MaterialCount - 1);
+	}
+
+	NodeStore::~NodeStore()
+	{
+		releaseAddressSpace(mData, uint64(mCapacity) * sizeof(Node));
+	}
+
+	// Commit memory for the given (currently uncommitted) index by growing whichever of the committed ranges
+	// is nearer to it. Each range grows by at least an eighth of its current size to keep syscalls infrequent.
+	void NodeStore::commit(uint32 index)
+	{
+		assert(index >= mLowerCommitEnd && index < mUpperCommitBegin && "Index is already committed");
+
+		uint64 begin = 0;
+		uint64 end = 0;
+		const bool growLower = index - mLowerCommitEnd < mUpperCommitBegin - index;
+		if (growLower)
+		{
+			begin = mLowerCommitEnd;
+			end = std::max(uint64(index) + 1, begin + begin / 8);
+			end = std::min(roundUpToCommitBlock(end), uint64(mUpperCommitBegin));
+		}
+		else
+		{
+			end = mUpperCommitBegin;
+			const uint64 upperSize = mCapacity - end;
+			begin = std::min(uint64(index), end - std::min(upperSize / 8, end));
+			begin = std::max(roundDownToCommitBlock(begin), uint64(mLowerCommitEnd));
+		}
+
+		if (!commitMemory(mData + begin, (end - begin) * sizeof(Node)))
+		{
+			log_warning("Failed to commit memory for node store!");
+			throw std::bad_alloc();
+		}
+
+		if (growLower) { mLowerCommitEnd = static_cast<uint32>(end); }
+		else { mUpperCommitBegin = static_cast<uint32>(begin); }
+	}
+
+	// Decommit whatever lies between the two given indices, which are typically the end of
+	// the baked nodes and the start of the edit nodes. The contents of this gap are lost.
+	void NodeStore::shrink(uint32 lowerEnd, uint32 upperBegin)
+	{
+		assert(lowerEnd <= upperBegin);
+
+		// Never decommit the material nodes.
+		const uint64 newLowerCommitEnd = roundUpToCommitBlock(std::max(lowerEnd, MaterialCount));
+		if (newLowerCommitEnd < mLowerCommitEnd)
+		{
+			decommitMemory(mData + newLowerCommitEnd, (mLowerCommitEnd - newLowerCommitEnd) * sizeof(Node));
+			mLowerCommitEnd = static_cast<uint32>(newLowerCommitEnd);
+		}
+
+		const uint64 newUpperCommitBegin = std::max(roundDownToCommitBlock(upperBegin), uint64(mLowerCommitEnd));
+		if (newUpperCommitBegin > mUpperCommitBegin)
+		{
+			decommitMemory(mData + mUpperCommitBegin, (newUpperCommitBegin - mUpperCommitBegin) * sizeof(Node));
+			mUpperCommitBegin = static_cast<uint32>(newUpperCommitBegin);
+		}
+	}
+
+	// Commit everything below the given index in one go. Nodes in the committed ranges can then be written
+	// concurrently, which is not true of setNode() in general as committing memory modifies the store.
+	void NodeStore::commitBelow(uint32 index)
+	{
+		const uint64 end = std::min(roundUpToCommitBlock(index), uint64(mUpperCommitBegin));
+		if (end > mLowerCommitEnd)
+		{
+			if (!commitMemory(mData + mLowerCommitEnd, (end - mLowerCommitEnd) * sizeof(Node)))
+			{
+				log_warning("Failed to commit memory for node store!");
+				throw std::bad_alloc();
+			}
+			mLowerCommitEnd = static_cast<uint32>(end);
+		}
+	}
+
+	uint64 NodeStore::committedBytes() const
+	{
+		return (uint64(mLowerCommitEnd) + uint64(mCapacity - mUpperCommitBegin)) * sizeof(Node);
+	}
+
+	// Map the nodes in [beginIndex, endIndex) directly from the file, which must store node 'i' at byte offset
+	// 'i * sizeof(Node)' and be padded to a whole commit block. The mapping is private (copy-on-write) so the
+	// nodes can still be modified without touching the file. Returns false if mapping is not possible here, in
+	// which case the caller should fall back to reading the nodes.
+	bool NodeStore::map(const std::string& filename, uint32 beginIndex, uint32 endIndex)
+	{
+#if defined(_WIN32)
+		// Mapping a file into reserved address space needs the newer placeholder APIs (MapViewOfFile3),
+		// so for now we don't support it and the nodes get read instead.
+		(void)filename; (void)beginIndex; (void)endIndex;
+		return false;
+#else
+		const uint64 pageSize = static_cast<uint64>(sysconf(_SC_PAGESIZE));
+		const uint64 beginByte = uint64(beginIndex) * sizeof(Node);
+		const uint64 mappedEndIndex = roundUpToCommitBlock(endIndex);
+		const uint64 endByte = mappedEndIndex * sizeof(Node);
+
+		// The mapped range must be page-aligned and must not run into the edit nodes.
+		if (beginByte % pageSize != 0 || endByte % pageSize != 0) { return false; }
+		if (mappedEndIndex > mUpperCommitBegin) { return false; }
+
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) { return false; }
+
+		// Mapping beyond the end of the file would give a SIGBUS when accessed.
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || static_cast<uint64>(fileStat.st_size) < endByte)
+		{
+			close(fd);
+			return false;
+		}
+
+		char* address = reinterpret_cast<char*>(mData) + beginByte;
+		void* ptr = mmap(address, endByte - beginByte, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, beginByte);
+		close(fd); // The mapping keeps its own reference to the file.
+
+		if (ptr == MAP_FAILED)
+		{
+			// A failed MAP_FIXED may have removed the previous mapping, so put the range back into a known
+			// (decommitted) state. The caller will then read the nodes, which commits them again.
+			decommitMemory(address, endByte - beginByte);
+			mLowerCommitEnd = std::min(mLowerCommitEnd, beginIndex);
+			return false;
+		}
+
+		mLowerCommitEnd = std::max(mLowerCommitEnd, static_cast<uint32>(mappedEndIndex));
+		return true;
+#endif // _WIN32
+	}
+
 	void NodeStore::setNode(uint32 index, const Node& newNode)
 	{
 		assert(!isMaterialNode(index) && "Error - Cannot modify material nodes");
@@ -40,6 +290,11 @@ namespace Cubiquity
 			assert(childIndex != index && "Error - Child points at parent");
 		}
 
+		if (index >= mLowerCommitEnd && index < mUpperCommitBegin)
+		{
+			commit(index);
+		}
+
 		mData[index] = newNode;
 	}
 
@@ -47,60 +302,410 @@ namespace Cubiquity
 	{
 		assert(!isMaterialNode(nodeIndex));
 		assert(newChildIndex != nodeIndex && "Error - Node points at self");
+		assert((nodeIndex < mLowerCommitEnd || nodeIndex >= mUpperCommitBegin) && "Error - Node was never set");
 
 		mData[nodeIndex][childId] = newChildIndex;
 	}
 
+	void NodeMap::reserve(uint32 count)
+	{
+		// Keep the load factor below two thirds so that probe sequences stay short.
+		uint64 capacity = 16;
+		while (capacity * 2 < uint64(count) * 3) { capacity *= 2; }
+		if (capacity <= mEntries.size()) { return; }
+
+		std::vector<Entry> oldEntries(capacity);
+		oldEntries.swap(mEntries);
+		mMask = capacity - 1;
+
+		// Reinsert the old entries. Their full hashes are not kept so they have to be recomputed.
+		for (const Entry& oldEntry : oldEntries)
+		{
+			if (oldEntry.tag == EmptyTag) { continue; }
+			for (uint64 slot = hashNode(oldEntry.node) & mMask; ; slot = (slot + 1) & mMask)
+			{
+				if (mEntries[slot].tag == EmptyTag)
+				{
+					mEntries[slot] = oldEntry;
+					break;
+				}
+			}
+		}
+	}
+
+	void NodeMap::clear()
+	{
+		mEntries.clear();
+		mMask = 0;
+		mSize = 0;
+	}
+
 	NodeDAG::NodeDAG()
 	{
 		mEditNodesBegin = mNodes.size();
 	}
 
-	uint32 NodeDAG::countNodes(uint32 startNodeIndex) const
+	// Counts the nodes at distinct locations (node indices). A tree which is not fully merged will contain
+	// identical nodes at different locations in memory, and these will be counted separately.
+	DAGStatistics NodeDAG::computeStatistics(uint32 rootNodeIndex) const
 	{
-		std::unordered_set<uint32> usedIndices;
-		countNodes(startNodeIndex, usedIndices);
-		return usedIndices.size();
+		DAGStatistics statistics;
+		statistics.storedNodeCount = storedNodeCount();
+		statistics.committedBytes = mNodes.committedBytes();
+		if (isMaterialNode(rootNodeIndex))
+		{
+			statistics.materialLeafCounts[rootNodeIndex]++;
+			return statistics;
+		}
+
+		const StoredNodeIds id = storedNodeIds();
+
+		struct PendingNode
+		{
+			uint32 index;
+			int height;
+		};
+
+		std::vector<bool> visited(storedNodeCount(), false);
+		std::vector<PendingNode> pending;
+		const int rootHeight = logBase2(VolumeSideLength);
+		visited[id(rootNodeIndex)] = true;
+		pending.push_back({ rootNodeIndex, rootHeight });
+		statistics.nodeReferenceCount = 1;
+		while (!pending.empty())
+		{
+			const PendingNode node = pending.back();
+			pending.pop_back();
+
+			statistics.uniqueNodeCount++;
+			statistics.nodesPerLevel[node.height]++;
+			if (isBakedNode(node.index)) { statistics.bakedNodeCount++; }
+			else { statistics.editNodeCount++; }
+
+			for (uint32 childIndex : mNodes[node.index])
+			{
+				if (isMaterialNode(childIndex))
+				{
+					statistics.materialLeafCounts[childIndex]++;
+					continue;
+				}
+
+				statistics.nodeReferenceCount++;
+				if (!visited[id(childIndex)])
+				{
+					visited[id(childIndex)] = true;
+					pending.push_back({ childIndex, node.height - 1 });
+				}
+			}
+		}
+
+		statistics.reachableBytes = uint64(statistics.uniqueNodeCount) * sizeof(Node);
+		return statistics;
 	}
 
-	// Counts the number of nodes at distinct locations (node indices).
-	// A tree which is not fully merged will contain idetical nodes at different
-	// locations in memory, and these will be counted seperately.
-	void NodeDAG::countNodes(uint32 startNodeIndex, std::unordered_set<uint32>& usedIndices) const
+	uint32 NodeDAG::markReachableNodes(uint32 rootNodeIndex, std::vector<bool>& marked) const
 	{
-		// It may have been more efficient to have done this test before calling
-		// into this function, but the implementation is simpler this way around.
-		if (isMaterialNode(startNodeIndex)) { return; }
+		if (isMaterialNode(rootNodeIndex)) { return 0; }
 
-		usedIndices.insert(startNodeIndex);
-		for (const uint32& childNodeIndex : mNodes[startNodeIndex])
+		const StoredNodeIds id = storedNodeIds();
+
+		uint32 markedCount = 0;
+		std::vector<uint32> pending;
+		if (!marked[id(rootNodeIndex)])
+		{
+			marked[id(rootNodeIndex)] = true;
+			pending.push_back(rootNodeIndex);
+		}
+		while (!pending.empty())
 		{
-			countNodes(childNodeIndex, usedIndices);
+			const uint32 nodeIndex = pending.back();
+			pending.pop_back();
+			markedCount++;
+
+			for (uint32 childIndex : mNodes[nodeIndex])
+			{
+				if (!isMaterialNode(childIndex) && !marked[id(childIndex)])
+				{
+					marked[id(childIndex)] = true;
+					pending.push_back(childIndex);
+				}
+			}
 		}
+
+		return markedCount;
 	}
 
-	void NodeDAG::read(std::ifstream& file)
+	// Reads a node count followed by that many nodes, as found in version 1 files.
+	bool NodeDAG::read(std::ifstream& file)
 	{
 		uint32_t nodeCount;
 		file.read(reinterpret_cast<char*>(&nodeCount), sizeof(nodeCount));
-		for (uint32 ct = 0; ct < nodeCount; ct++)
+		return file && read(file, nodeCount);
+	}
+
+	// Returns false if the file does not hold that many nodes, or if they would not fit below the edit nodes. The
+	// size is checked before anything is read so that a truncated file leaves the existing nodes alone.
+	bool NodeDAG::read(std::ifstream& file, uint32 nodeCount)
+	{
+		if (nodeCount > editNodesBegin() - bakedNodesBegin()) { return false; }
+
+		const std::streampos begin = file.tellg();
+		file.seekg(0, std::ios::end);
+		const std::streamoff availableBytes = file.tellg() - begin;
+		file.seekg(begin);
+		if (!file || availableBytes < static_cast<std::streamoff>(uint64(nodeCount) * sizeof(Node))) { return false; }
+
+		// Reading one node at a time is slow for large volumes, so read in chunks.
+		std::vector<Node> buffer(std::min(nodeCount, UINT32_C(65536)));
+		for (uint32 ct = 0; ct < nodeCount; ct += buffer.size())
 		{
-			Node node;
-			file.read(reinterpret_cast<char*>(&node), sizeof(node));
-			mNodes.setNode(bakedNodesBegin() + ct, node);
+			const uint32 chunkSize = std::min(nodeCount - ct, static_cast<uint32>(buffer.size()));
+			file.read(reinterpret_cast<char*>(buffer.data()), chunkSize * sizeof(Node));
+			if (!file) { return false; }
+			for (uint32 i = 0; i < chunkSize; i++)
+			{
+				mNodes.setNode(bakedNodesBegin() + ct + i, buffer[i]);
+			}
 		}
 		mBakedNodesEnd = bakedNodesBegin() + nodeCount;
+		resetBakedIndex();
+		return true;
 	}
 
 	void NodeDAG::write(std::ofstream& file)
 	{
 		uint32 nodeCount = bakedNodesEnd() - bakedNodesBegin();
-		file.write(reinterpret_cast<const char*>(&nodeCount), sizeof(nodeCount));
-		for (uint32 ct = 0; ct < nodeCount; ct++)
+		file.write(reinterpret_cast<const char*>(&mNodes[bakedNodesBegin()]), uint64(nodeCount) * sizeof(Node));
+	}
+
+	// Compact files store the nodes in breadth-first order from the root, with one section per level of
+	// the breadth-first traversal. Each node is written as a byte with a bit set for each child which is a
+	// node, a byte with a bit set for each child which is empty (material zero), a byte for each of the
+	// remaining (non-empty material) children and then a variable-length index for each child node. Child
+	// indices are stored relative to the next node which has not yet been referenced, as this is always
+	// the index of a child seen for the first time. Such children therefore take a single byte, and only
+	// children which are shared with earlier nodes need more.
+	namespace
+	{
+		void writeVarint(std::vector<uint8>& buffer, uint64 value)
 		{
-			file.write(reinterpret_cast<const char*>(&mNodes[bakedNodesBegin() + ct]), sizeof(Node));
+			while (value >= 0x80)
+			{
+				buffer.push_back(static_cast<uint8>(value) | 0x80);
+				value >>= 7;
+			}
+			buffer.push_back(static_cast<uint8>(value));
 		}
-		
+
+		bool readVarint(const uint8*& data, const uint8* end, uint64& value)
+		{
+			value = 0;
+			for (int shift = 0; shift < 64 && data != end; shift += 7)
+			{
+				const uint8 byte = *data++;
+				value |= uint64(byte & 0x7f) << shift;
+				if ((byte & 0x80) == 0) { return true; }
+			}
+			return false;
+		}
+
+		// Maps signed offsets to unsigned ones so that small offsets of either sign stay small.
+		uint64 zigzagEncode(int64 value) { return (static_cast<uint64>(value) << 1) ^ static_cast<uint64>(value >> 63); }
+		int64 zigzagDecode(uint64 value) { return static_cast<int64>(value >> 1) ^ -static_cast<int64>(value & 1); }
+	}
+
+	// The nodes are decoded into a separate buffer and only copied into the store once they have all been validated,
+	// so that a corrupt file leaves the existing nodes alone.
+	bool NodeDAG::readCompact(std::ifstream& file, uint32 nodeCount)
+	{
+		if (nodeCount > editNodesBegin() - bakedNodesBegin()) { return false; }
+
+		uint32 sectionCount;
+		file.read(reinterpret_cast<char*>(&sectionCount), sizeof(sectionCount));
+
+		std::vector<Node> nodes;
+		std::vector<uint8> buffer;
+		uint32 nextNewNode = 1; // The root is node zero.
+		for (uint32 section = 0; file && section < sectionCount; section++)
+		{
+			uint32 sectionNodeCount, sectionSize;
+			file.read(reinterpret_cast<char*>(&sectionNodeCount), sizeof(sectionNodeCount));
+			file.read(reinterpret_cast<char*>(&sectionSize), sizeof(sectionSize));
+			if (!file || sectionNodeCount > nodeCount - nodes.size()) { return false; }
+
+			buffer.resize(sectionSize);
+			file.read(reinterpret_cast<char*>(buffer.data()), sectionSize);
+
+			const uint8* data = buffer.data();
+			const uint8* end = data + buffer.size();
+			for (uint32 i = 0; i < sectionNodeCount; i++)
+			{
+				if (end - data < 2) { return false; }
+				const uint8 nodeMask = *data++;
+				const uint8 emptyMask = *data++;
+
+				Node node;
+				for (uint32 childId = 0; childId < 8; childId++)
+				{
+					if ((nodeMask | emptyMask) & (1 << childId)) { node[childId] = 0; continue; }
+					if (data == end) { return false; }
+					node[childId] = *data++;
+				}
+
+				for (uint32 childId = 0; childId < 8; childId++)
+				{
+					if ((nodeMask & (1 << childId)) == 0) { continue; }
+					uint64 encodedOffset;
+					if (!readVarint(data, end, encodedOffset)) { return false; }
+					// Each child is either an existing node or the next new one, so anything beyond that is corrupt.
+					const int64 child = nextNewNode + zigzagDecode(encodedOffset);
+					if (child <= 0 || child >= nodeCount || child > nextNewNode) { return false; }
+					if (child == nextNewNode) { nextNewNode++; }
+					node[childId] = bakedNodesBegin() + static_cast<uint32>(child);
+				}
+				nodes.push_back(node);
+			}
+		}
+
+		if (!file || nodes.size() != nodeCount) { return false; }
+
+		// Children can still refer back to their ancestors, which would send later traversals round in circles. So we
+		// check that the tree is no taller than it should be, level by level from the root (a node which is used at
+		// several heights is visited once for each). Any cycle would make it arbitrarily tall.
+		std::vector<uint32> level;
+		std::vector<uint32> nextLevel;
+		std::vector<int> visitedHeights(nodeCount, -1);
+		if (nodeCount > 0) { level.push_back(0); }
+		for (int height = logBase2(VolumeSideLength); !level.empty(); height--)
+		{
+			nextLevel.clear();
+			for (uint32 id : level)
+			{
+				for (uint32 childNodeIndex : nodes[id])
+				{
+					if (isMaterialNode(childNodeIndex)) { continue; }
+					if (height == 1) { return false; }
+
+					const uint32 childId = childNodeIndex - bakedNodesBegin();
+					if (visitedHeights[childId] != height - 1)
+					{
+						visitedHeights[childId] = height - 1;
+						nextLevel.push_back(childId);
+					}
+				}
+			}
+			std::swap(level, nextLevel);
+		}
+
+		for (uint32 i = 0; i < nodeCount; i++)
+		{
+			mNodes.setNode(bakedNodesBegin() + i, nodes[i]);
+		}
+		mBakedNodesEnd = bakedNodesBegin() + nodeCount;
+		resetBakedIndex();
+		return true;
+	}
+
+	uint32 NodeDAG::writeCompact(std::ofstream& file, uint32 rootNodeIndex)
+	{
+		const StoredNodeIds id = storedNodeIds();
+
+		// Number the nodes in the order in which a breadth-first traversal first reaches them. As the
+		// traversal visits nodes in this order the result is also the order in which they are written.
+		std::vector<uint32> order;
+		std::vector<uint32> sectionEnds;
+		std::vector<uint32> newIndices(storedNodeCount(), UINT32_MAX);
+		if (!isMaterialNode(rootNodeIndex))
+		{
+			order.push_back(rootNodeIndex);
+			newIndices[id(rootNodeIndex)] = 0;
+			for (uint32 sectionBegin = 0; sectionBegin < order.size(); sectionBegin = sectionEnds.back())
+			{
+				const uint32 sectionEnd = order.size();
+				for (uint32 i = sectionBegin; i < sectionEnd; i++)
+				{
+					for (uint32 child : mNodes[order[i]])
+					{
+						if (isMaterialNode(child)) { continue; }
+						uint32& newIndex = newIndices[id(child)];
+						if (newIndex == UINT32_MAX)
+						{
+							newIndex = order.size();
+							order.push_back(child);
+						}
+					}
+				}
+				sectionEnds.push_back(sectionEnd);
+			}
+		}
+
+		const uint32 sectionCount = sectionEnds.size();
+		file.write(reinterpret_cast<const char*>(&sectionCount), sizeof(sectionCount));
+
+		std::vector<uint8> buffer;
+		uint32 nextNewNode = 1;
+		uint32 sectionBegin = 0;
+		for (uint32 sectionEnd : sectionEnds)
+		{
+			buffer.clear();
+			for (uint32 i = sectionBegin; i < sectionEnd; i++)
+			{
+				const Node& node = mNodes[order[i]];
+				const size_t masksPos = buffer.size();
+				buffer.resize(masksPos + 2);
+				uint8 nodeMask = 0;
+				uint8 emptyMask = 0;
+				for (uint32 childId = 0; childId < 8; childId++)
+				{
+					if (!isMaterialNode(node[childId]))
+					{
+						nodeMask |= 1 << childId;
+					}
+					else if (node[childId] == 0)
+					{
+						emptyMask |= 1 << childId;
+					}
+					else
+					{
+						buffer.push_back(static_cast<uint8>(node[childId]));
+					}
+				}
+
+				for (uint32 childId = 0; childId < 8; childId++)
+				{
+					if (nodeMask & (1 << childId))
+					{
+						const uint32 child = newIndices[id(node[childId])];
+						writeVarint(buffer, zigzagEncode(int64(child) - int64(nextNewNode)));
+						if (child == nextNewNode) { nextNewNode++; }
+					}
+				}
+
+				buffer[masksPos] = nodeMask;
+				buffer[masksPos + 1] = emptyMask;
+			}
+
+			const uint32 sectionNodeCount = sectionEnd - sectionBegin;
+			const uint32 sectionSize = buffer.size();
+			file.write(reinterpret_cast<const char*>(&sectionNodeCount), sizeof(sectionNodeCount));
+			file.write(reinterpret_cast<const char*>(&sectionSize), sizeof(sectionSize));
+			file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+			sectionBegin = sectionEnd;
+		}
+
+		return order.size();
+	}
+
+	bool NodeDAG::map(const std::string& filename, uint32 nodeCount)
+	{
+		if (!mNodes.map(filename, bakedNodesBegin(), bakedNodesBegin() + nodeCount))
+		{
+			return false;
+		}
+
+		mBakedNodesEnd = bakedNodesBegin() + nodeCount;
+		resetBakedIndex();
+		return true;
 	}
 
 	bool NodeDAG::isPrunable(const Node& node) const
@@ -117,7 +722,9 @@ namespace Cubiquity
 
 	void NodeDAG::merge(uint32 index)
 	{
-		std::unordered_map<Node, uint32> map;
+		// The map is not reserved up-front, as an unbaked store often has many times more nodes than are unique
+		// and the extra space would cost more in cache misses than growing the map does.
+		NodeMap map;
 		uint32 mergedEnd = mEditNodesBegin;
 		uint32 nextSpace = mergedEnd - 1;
 
@@ -149,49 +756,476 @@ namespace Cubiquity
 				mNodes.setNode(nodeIndex, node);
 			}
 		}
+
+		resetBakedIndex();
+
+		// Everything reachable from the given root now lives in the baked range, so the edit nodes (and the
+		// scratch space which the merge used beneath them) are no longer needed and can be given back to the OS.
+		mEditNodesBegin = mNodes.size();
+		resetEditIndex();
+		mNodes.shrink(bakedNodesEnd(), editNodesBegin());
 	}
 
-	uint32 NodeDAG::mergeNode(uint32 nodeIndex, std::unordered_map<Node, uint32>& map, uint32& nextSpace)
+	// Merges the subtree at the given node by writing each unique node once (in depth-first post-order) below the
+	// edit nodes. Shared subtrees can be reached via a huge number of paths, so we remember what each node was
+	// merged into and only process it the first time it is seen. This makes the cost proportional to the number
+	// of distinct node indices rather than the number of paths. An explicit stack is used instead of recursion.
+	uint32 NodeDAG::mergeNode(uint32 nodeIndex, NodeMap& map, uint32& nextSpace)
 	{
 		assert(!isMaterialNode(nodeIndex));
-		const Node& oldNode = mNodes[nodeIndex];
-		Node newNode;
-		for (int i = 0; i < 8; i++)
+
+		// Zero means 'not yet merged', which is unambiguous as nodes are never merged into materials.
+		std::vector<uint32> bakedRemap(bakedNodesEnd() - bakedNodesBegin(), 0);
+		std::vector<uint32> editRemap(editNodesEnd() - editNodesBegin(), 0);
+		auto remapped = [&](uint32 index) -> uint32&
+		{
+			assert(isBakedNode(index) || isEditNode(index));
+			return isBakedNode(index) ? bakedRemap[index - bakedNodesBegin()] : editRemap[index - editNodesBegin()];
+		};
+
+		struct StackEntry
+		{
+			uint32 oldIndex;
+			uint32 childId;
+			Node newNode;
+		};
+
+		// The tree has at most 32 levels above the leaves, and leaves are never pushed.
+		std::array<StackEntry, 33> stack;
+		int top = 0;
+		stack[top] = { nodeIndex, 0, {} };
+
+		while (true)
 		{
-			uint32 oldChildIndex = oldNode[i];
-			if (!isMaterialNode(oldChildIndex))
+			StackEntry& entry = stack[top];
+			if (entry.childId < 8)
 			{
-				newNode[i] = mergeNode(oldChildIndex, map, nextSpace);
+				const uint32 oldChildIndex = mNodes[entry.oldIndex][entry.childId];
+				if (isMaterialNode(oldChildIndex))
+				{
+					entry.newNode[entry.childId++] = oldChildIndex;
+				}
+				else if (const uint32 newChildIndex = remapped(oldChildIndex))
+				{
+					entry.newNode[entry.childId++] = newChildIndex;
+				}
+				else
+				{
+					// Descend to merge the child first. We resume this node when we come back up.
+					top++;
+					assert(top < static_cast<int>(stack.size()));
+					stack[top] = { oldChildIndex, 0, {} };
+				}
+				continue;
 			}
-			else
+
+			// All children have been merged, so this node can be too.
+			const auto [newNodeIndex, inserted] = map.insert(entry.newNode, nextSpace);
+			if (inserted)
+			{
+				mNodes.setNode(nextSpace, entry.newNode);
+				nextSpace--;
+			}
+			remapped(entry.oldIndex) = newNodeIndex;
+
+			if (top == 0)
 			{
-				newNode[i] = oldNode[i];
+				return newNodeIndex;
 			}
+
+			top--;
+			stack[top].newNode[stack[top].childId++] = newNodeIndex;
 		}
+	}
 
-		uint32 newNodeIndex = 0;
-		auto iter = map.find(newNode);
-		if (iter == map.end())
+	// A fixed-capacity open-addressing hash set of nodes which many threads can insert into at once. A thread claims
+	// an empty slot with a compare-and-swap, writes the node, and then marks the slot as ready, so no locks are needed.
+	// The slot index serves as an identifier for the node, and it is stable because the table never grows.
+	class ConcurrentNodeTable : private NonCopyable
+	{
+	public:
+		ConcurrentNodeTable(uint32 maxNodeCount)
 		{
-			//newNodeIndex = insertNode(newNode)
-			//newNodeIndex = mDAG.mInitialNodes.insert(newNode);
-
-			mNodes.setNode(nextSpace, newNode);
-			newNodeIndex = nextSpace;
-			nextSpace--;
+			// Keep the load factor below two thirds so that probe sequences stay short.
+			uint64 capacity = 1;
+			while (capacity < uint64(maxNodeCount) + maxNodeCount / 2 + 1) { capacity *= 2; }
+			assert(capacity <= UINT32_MAX - MaterialCount && "Too many nodes for table");
 
-			map.insert({ newNode, newNodeIndex });
+			mSlots.reset(new Slot[capacity]);
+			mMask = capacity - 1;
 		}
-		else
+
+		uint32 capacity() const { return static_cast<uint32>(mMask + 1); }
+
+		const Node& operator[](uint32 slot) const { return mSlots[slot].node; }
+
+		// Returns the slot holding the given node, inserting the node if it is not already present.
+		uint32 insert(const Node& node)
 		{
-			newNodeIndex = iter->second;
+			for (uint64 slot = std::hash<Node>()(node) & mMask; ; slot = (slot + 1) & mMask)
+			{
+				Slot& entry = mSlots[slot];
+				uint32 state = entry.state.load(std::memory_order_acquire);
+				if (state == Empty)
+				{
+					if (entry.state.compare_exchange_strong(state, Writing, std::memory_order_acquire))
+					{
+						entry.node = node;
+						entry.state.store(Ready, std::memory_order_release);
+						return static_cast<uint32>(slot);
+					}
+					// Otherwise another thread claimed the slot first, and 'state' now holds its state.
+				}
+
+				// Writing is very quick, so just spin until the node in the slot is ready to be compared.
+				while (state == Writing) { state = entry.state.load(std::memory_order_acquire); }
+				if (entry.node == node) { return static_cast<uint32>(slot); }
+			}
+		}
+
+	private:
+		enum : uint32 { Empty, Writing, Ready };
+
+		struct Slot
+		{
+			std::atomic<uint32> state = Empty;
+			Node node;
+		};
+
+		std::unique_ptr<Slot[]> mSlots;
+		uint64 mMask = 0;
+	};
+
+	// Gives exactly the same result as merge(), but deduplicates one level of the DAG at a time with all the nodes
+	// in a level being processed in parallel. The only serial part is the final ordering of the unique nodes, which
+	// is cheap as it involves no hashing and visits only the (usually much smaller) deduplicated graph.
+	void NodeDAG::parallelMerge(uint32 index)
+	{
+		if (isMaterialNode(index))
+		{
+			merge(index); // Nothing to do in parallel.
+			return;
+		}
+
+		// The old nodes which might be reachable, identified as they were before merging adds any new ones.
+		const uint32 oldNodeCount = storedNodeCount();
+		const StoredNodeIds oldId = storedNodeIds();
+
+		// Gather the reachable nodes level by level from the root, recording the deepest level at which each was
+		// found. A node can be found at more than one level (the serial merge can merge identical nodes of different
+		// heights) but it has to be merged after all of its children, so we only process it at its deepest level.
+		constexpr uint8 Unvisited = 0xFF;
+		std::vector<uint8> depths(oldNodeCount, Unvisited);
+		std::vector<std::vector<uint32>> levels = { { index } };
+		depths[oldId(index)] = 0;
+		uint64 gatheredCount = 1;
+		while (true)
+		{
+			const std::vector<uint32>& level = levels.back();
+			const uint8 childDepth = static_cast<uint8>(levels.size());
+			assert(childDepth <= 32 && "DAG is too deep");
+
+			std::vector<uint32> children(level.size() * 8);
+			std::atomic<uint32> childCount = 0;
+			std::for_each(std::execution::par, level.begin(), level.end(), [&](uint32 nodeIndex)
+			{
+				for (uint32 childIndex : mNodes[nodeIndex])
+				{
+					if (isMaterialNode(childIndex)) { continue; }
+
+					// Depths only increase as we go, so only the first visitor at this depth will see a different one.
+					std::atomic_ref<uint8> depth(depths[oldId(childIndex)]);
+					if (depth.exchange(childDepth, std::memory_order_relaxed) != childDepth)
+					{
+						children[childCount++] = childIndex;
+					}
+				}
+			});
+
+			if (childCount == 0) { break; }
+			children.resize(childCount);
+			gatheredCount += childCount;
+			levels.push_back(std::move(children));
+		}
+
+		// Now deduplicate from the bottom up. Children are always at a deeper level than their parents
+		// and so have already been assigned a slot in the table, which identifies them by content.
+		ConcurrentNodeTable table(static_cast<uint32>(std::min(gatheredCount, uint64(oldNodeCount))));
+		std::vector<uint32> slots(oldNodeCount);
+		for (uint32 depth = levels.size(); depth-- > 0;)
+		{
+			std::for_each(std::execution::par, levels[depth].begin(), levels[depth].end(), [&](uint32 nodeIndex)
+			{
+				const uint32 id = oldId(nodeIndex);
+				if (depths[id] != depth) { return; } // Processed at a deeper level
+
+				// Children are temporarily referenced by slot (offset to avoid the material range).
+				Node node = mNodes[nodeIndex];
+				for (uint32& childIndex : node)
+				{
+					if (!isMaterialNode(childIndex)) { childIndex = slots[oldId(childIndex)] + MaterialCount; }
+				}
+				slots[id] = table.insert(node);
+			});
+		}
+
+		// The serial merge writes the unique nodes in depth-first post-order before reversing them, so we
+		// order them the same way. Note that 'positions' holds (position + 1), leaving zero for 'unvisited'.
+		std::vector<uint32> order;
+		std::vector<uint32> positions(table.capacity(), 0);
+		struct StackEntry
+		{
+			uint32 slot;
+			uint32 childId;
+		};
+		std::array<StackEntry, 33> stack;
+		int top = 0;
+		stack[top] = { slots[oldId(index)], 0 };
+		while (top >= 0)
+		{
+			StackEntry& entry = stack[top];
+			if (entry.childId < 8)
+			{
+				const uint32 childIndex = table[entry.slot][entry.childId++];
+				if (!isMaterialNode(childIndex) && positions[childIndex - MaterialCount] == 0)
+				{
+					top++;
+					assert(top < static_cast<int>(stack.size()));
+					stack[top] = { childIndex - MaterialCount, 0 };
+				}
+				continue;
+			}
+
+			order.push_back(entry.slot);
+			positions[entry.slot] = static_cast<uint32>(order.size());
+			top--;
+		}
+
+		// Finally overwrite the baked range (the old nodes are no longer needed) with the root first.
+		const uint32 nodeCount = static_cast<uint32>(order.size());
+		auto newIndex = [&](uint32 slot) { return bakedNodesBegin() + nodeCount - positions[slot]; };
+		mNodes.commitBelow(bakedNodesBegin() + nodeCount);
+		std::for_each(std::execution::par, order.begin(), order.end(), [&](uint32 slot)
+		{
+			Node node = table[slot];
+			for (uint32& childIndex : node)
+			{
+				if (!isMaterialNode(childIndex)) { childIndex = newIndex(childIndex - MaterialCount); }
+			}
+			mNodes.setNode(newIndex(slot), node);
+		});
+
+		mBakedNodesEnd = bakedNodesBegin() + nodeCount;
+		resetBakedIndex();
+
+		mEditNodesBegin = mNodes.size();
+		resetEditIndex();
+		mNodes.shrink(bakedNodesEnd(), editNodesBegin());
+	}
+
+	// Merges the edit nodes which are reachable from any of the given roots (updating the roots in-place) without
+	// touching the existing baked nodes. Each edit node is looked up in the index of baked nodes, and is appended to
+	// the baked range if it is not found. Returns false without doing anything if there might not be enough space.
+	bool NodeDAG::mergeEdits(std::vector<uint32>& rootIndices)
+	{
+		// Appended nodes must not overwrite edit nodes which are still to be merged.
+		const uint32 editNodeCount = editNodesEnd() - editNodesBegin();
+		if (editNodesBegin() - bakedNodesEnd() < editNodeCount)
+		{
+			return false;
+		}
+
+		updateBakedIndex();
+
+		// Zero means 'not yet merged', which is unambiguous as nodes are never merged into materials.
+		std::vector<uint32> remap(editNodeCount, 0);
+
+		struct StackEntry
+		{
+			uint32 oldIndex;
+			uint32 childId;
+			Node newNode;
+		};
+		std::array<StackEntry, 33> stack;
+
+		for (uint32& rootIndex : rootIndices)
+		{
+			if (!isEditNode(rootIndex)) { continue; } // Already baked (or a material)
+
+			// Same approach as mergeNode(), except that baked children are left alone.
+			int top = 0;
+			stack[top] = { rootIndex, 0, mNodes[rootIndex] };
+			while (true)
+			{
+				StackEntry& entry = stack[top];
+				if (entry.childId < 8)
+				{
+					uint32& childIndex = entry.newNode[entry.childId];
+					if (!isEditNode(childIndex))
+					{
+						entry.childId++;
+					}
+					else if (const uint32 newChildIndex = remap[childIndex - editNodesBegin()])
+					{
+						childIndex = newChildIndex;
+						entry.childId++;
+					}
+					else
+					{
+						top++;
+						assert(top < static_cast<int>(stack.size()));
+						stack[top] = { childIndex, 0, mNodes[childIndex] };
+					}
+					continue;
+				}
+
+				const auto [newNodeIndex, inserted] = mBakedIndex.insert(entry.newNode, mBakedNodesEnd);
+				if (inserted)
+				{
+					mNodes.setNode(newNodeIndex, entry.newNode);
+					mBakedNodesEnd++;
+				}
+				remap[entry.oldIndex - editNodesBegin()] = newNodeIndex;
+
+				if (top == 0)
+				{
+					rootIndex = newNodeIndex;
+					break;
+				}
+
+				top--;
+				stack[top].newNode[stack[top].childId++] = newNodeIndex;
+			}
+		}
+		mIndexedNodesEnd = bakedNodesEnd();
+
+		mEditNodesBegin = mNodes.size();
+		resetEditIndex();
+		mNodes.shrink(bakedNodesEnd(), editNodesBegin());
+		return true;
+	}
+
+	// Compacts the store so that it only holds nodes which are reachable from the given roots (which are updated to
+	// match). Baked nodes slide down towards the start of the baked range and edit nodes slide up towards the end of
+	// the store. In both cases the order is preserved, which lets us move them in-place. Returns the number of nodes
+	// which were removed. Note that this must not be called part way through an edit.
+	uint32 NodeDAG::collectGarbage(std::vector<uint32>& rootIndices)
+	{
+		const uint32 oldNodeCount = storedNodeCount();
+		const StoredNodeIds id = storedNodeIds();
+
+		// Mark all reachable nodes. Zero means 'unreachable', and reachable nodes get their new index below.
+		std::vector<uint32> newIndices(oldNodeCount, 0);
+		std::vector<uint32> pending;
+		for (uint32 rootIndex : rootIndices)
+		{
+			if (!isMaterialNode(rootIndex) && newIndices[id(rootIndex)] == 0)
+			{
+				newIndices[id(rootIndex)] = 1;
+				pending.push_back(rootIndex);
+			}
+		}
+		while (!pending.empty())
+		{
+			const uint32 nodeIndex = pending.back();
+			pending.pop_back();
+			for (uint32 childIndex : mNodes[nodeIndex])
+			{
+				if (!isMaterialNode(childIndex) && newIndices[id(childIndex)] == 0)
+				{
+					newIndices[id(childIndex)] = 1;
+					pending.push_back(childIndex);
+				}
+			}
+		}
+
+		uint32 newBakedNodesEnd = bakedNodesBegin();
+		for (uint32 nodeIndex = bakedNodesBegin(); nodeIndex < bakedNodesEnd(); nodeIndex++)
+		{
+			if (newIndices[id(nodeIndex)]) { newIndices[id(nodeIndex)] = newBakedNodesEnd++; }
+		}
+		uint32 newEditNodesBegin = editNodesEnd();
+		for (uint32 nodeIndex = editNodesEnd(); nodeIndex-- > editNodesBegin();)
+		{
+			if (newIndices[id(nodeIndex)]) { newIndices[id(nodeIndex)] = --newEditNodesBegin; }
+		}
+
+		auto moveNode = [&](uint32 nodeIndex)
+		{
+			const uint32 newIndex = newIndices[id(nodeIndex)];
+			if (newIndex == 0) { return; }
+
+			Node node = mNodes[nodeIndex];
+			for (uint32& childIndex : node)
+			{
+				if (!isMaterialNode(childIndex)) { childIndex = newIndices[id(childIndex)]; }
+			}
+			mNodes.setNode(newIndex, node);
+		};
+
+		// Each node moves towards the end of the range it starts from, so it can never overwrite a node which is
+		// still to be moved. Sharing flags move with the edit nodes, as nothing which is kept changes its parents.
+		std::vector<bool> sharedEditNodes;
+		for (uint32 nodeIndex = bakedNodesBegin(); nodeIndex < bakedNodesEnd(); nodeIndex++)
+		{
+			moveNode(nodeIndex);
+		}
+		for (uint32 nodeIndex = editNodesEnd(); nodeIndex-- > editNodesBegin();)
+		{
+			moveNode(nodeIndex);
+			if (mHashConsing && newIndices[id(nodeIndex)])
+			{
+				sharedEditNodes.push_back(isShared(nodeIndex));
+			}
+		}
+
+		for (uint32& rootIndex : rootIndices)
+		{
+			if (!isMaterialNode(rootIndex)) { rootIndex = newIndices[id(rootIndex)]; }
+		}
+
+		mBakedNodesEnd = newBakedNodesEnd;
+		mEditNodesBegin = newEditNodesBegin;
+		resetBakedIndex();
+		resetEditIndex();
+		if (mHashConsing)
+		{
+			mSharedEditNodes = std::move(sharedEditNodes);
+			for (uint32 nodeIndex = editNodesBegin(); nodeIndex < editNodesEnd(); nodeIndex++)
+			{
+				mEditIndex.insert({ mNodes[nodeIndex], nodeIndex });
+			}
+		}
+		mNodes.shrink(bakedNodesEnd(), editNodesBegin());
+
+		return oldNodeCount - storedNodeCount();
+	}
+
+	// Add any baked nodes which are not yet in the index.
+	void NodeDAG::updateBakedIndex()
+	{
+		mBakedIndex.reserve(bakedNodesEnd() - bakedNodesBegin());
+		for (; mIndexedNodesEnd < bakedNodesEnd(); mIndexedNodesEnd++)
+		{
+			mBakedIndex.insert(mNodes[mIndexedNodesEnd], mIndexedNodesEnd);
 		}
-		return newNodeIndex;
-		//return nodes.insert(newNode);
+	}
+
+	void NodeDAG::resetBakedIndex()
+	{
+		mBakedIndex.clear();
+		mIndexedNodesEnd = bakedNodesBegin();
 	}
 
 	uint32 NodeDAG::insert(const Node& node)
 	{
+		if (mHashConsing)
+		{
+			// We don't know what else the caller does with the children, so assume they are now shared.
+			for (uint32 childIndex : node) { markShared(childIndex); }
+			return hashConsedInsert(node);
+		}
+
 		if (mEditNodesBegin > bakedNodesEnd())
 		{
 			mEditNodesBegin--;
@@ -206,19 +1240,64 @@ namespace Cubiquity
 		return 0; // Indicates error (we don't use this function to allocate the zeroth node).
 	}
 
+	// Adds a node which may be referenced from several places, such as part of a subtree which is deduplicated as it
+	// is built. In hash-consing mode this is true of any node, so it is just inserted as normal. Otherwise it must not
+	// be modified in-place, so it is appended to the baked range unless an identical baked node already exists (in
+	// which case that is returned instead). Baked nodes must not have edit nodes as children.
+	uint32 NodeDAG::insertShared(const Node& node)
+	{
+		assert(!isPrunable(node));
+
+		if (mHashConsing)
+		{
+			return insert(node);
+		}
+
+		assert(std::none_of(node.begin(), node.end(), [&](uint32 childIndex) { return isEditNode(childIndex); }));
+
+		updateBakedIndex();
+		if (const uint32* index = mBakedIndex.find(node))
+		{
+			return *index;
+		}
+
+		if (bakedNodesEnd() < editNodesBegin())
+		{
+			const uint32 index = mBakedNodesEnd++;
+			mNodes.setNode(index, node);
+			mBakedIndex.insert(node, index);
+			mIndexedNodesEnd = bakedNodesEnd();
+			return index;
+		}
+
+		// As in NodeStore::commit(), running out of space is reported to the caller rather than ending the process.
+		log_warning("Out of space for baked nodes!");
+		throw std::bad_alloc();
+	}
+
 	// Update the child of a node. If a copy needs to be made then this is returned,
 	// otherwise the return value is empty to indicate that the update was done in-place.
 	uint32 NodeDAG::updateNodeChild(uint32 nodeIndex, uint32 childId, uint32 newChildNodeIndex, bool forceCopy)
 	{
-		assert(newChildNodeIndex != mNodes[nodeIndex][childId]); // Watch for self-assignment (wasteful)
-		assert(newChildNodeIndex != nodeIndex); // Don't let child point to parent.
+		// Watch for self-assignment (wasteful). Material nodes have no stored children so can't be checked.
+		assert(isMaterialNode(nodeIndex) || newChildNodeIndex != mNodes[nodeIndex][childId]);
 
 		// Edit nodes can be modified in-place as they are unshared, unless the users
-		// requests they are copied (e.g. for the purpose of maintaining an undo history).
-		const bool modifyInPlace = isEditNode(nodeIndex) && (!forceCopy);
+		// requests they are copied (e.g. for the purpose of maintaining an undo history)
+		// and they existed before the current transaction.
+		const bool modifyInPlace = isEditNode(nodeIndex) && (!forceCopy || isFreshEditNode(nodeIndex)) && (!isShared(nodeIndex));
+
+		// Don't let child point to parent. With hash-consing a modified child can legitimately be identical to its
+		// parent (e.g. in self-similar regions) but then the parent is shared, and so will be copied rather than modified.
+		assert(newChildNodeIndex != nodeIndex || !modifyInPlace);
 
 		if(modifyInPlace)
 		{
+			if (mHashConsing)
+			{
+				return hashConsedUpdate(nodeIndex, childId, newChildNodeIndex);
+			}
+
 			// Modify the existing node in-place by updating only the relevant child.
 			mNodes.setNodeChild(nodeIndex, childId, newChildNodeIndex);
 
@@ -236,11 +1315,151 @@ namespace Cubiquity
 
 			// If the copy becomes prunable as a result of the modification
 			// then we can skip inserting it, which saves time and space.
-			return isPrunable(newNode) ? newChildNodeIndex : insert(newNode);
+			if (isPrunable(newNode))
+			{
+				return newChildNodeIndex;
+			}
+
+			// The other children are now referenced by both the original and the copy.
+			if (mHashConsing)
+			{
+				for (uint32 otherChildId = 0; otherChildId < 8; otherChildId++)
+				{
+					if (otherChildId != childId) { markShared(newNode[otherChildId]); }
+				}
+				return hashConsedInsert(newNode);
+			}
+
+			return insert(newNode);
 		}
 		
 	}
 
+	////////////////////////////////////////////////////////////////////////////////
+	// Hash-consing
+	////////////////////////////////////////////////////////////////////////////////
+
+	// Returns the index of an existing node identical to the given one, or zero if there isn't one.
+	uint32 NodeDAG::findNode(const Node& node)
+	{
+		updateBakedIndex();
+		if (const uint32* index = mBakedIndex.find(node)) { return *index; }
+		if (auto iter = mEditIndex.find(node); iter != mEditIndex.end()) { return iter->second; }
+		return 0;
+	}
+
+	// Returns an existing node which is identical to the given one, or otherwise adds it as a new (unshared) edit
+	// node. The caller is responsible for marking the children as shared if they are now referenced more than once.
+	uint32 NodeDAG::hashConsedInsert(const Node& node)
+	{
+		if (const uint32 existingIndex = findNode(node))
+		{
+			markShared(existingIndex);
+			return existingIndex;
+		}
+
+		uint32 index = 0;
+		if (!mFreeEditNodes.empty())
+		{
+			index = mFreeEditNodes.back();
+			mFreeEditNodes.pop_back();
+			mNodes.setNode(index, node);
+			mSharedEditNodes[editNodesEnd() - 1 - index] = false;
+		}
+		else if (mEditNodesBegin > bakedNodesEnd())
+		{
+			mEditNodesBegin--;
+			index = mEditNodesBegin;
+			mNodes.setNode(index, node);
+			mSharedEditNodes.push_back(false);
+		}
+		else
+		{
+			// As in NodeStore::commit(), running out of space is reported to the caller rather than ending the process.
+			log_warning("Out of space for unshared edits!");
+			throw std::bad_alloc();
+		}
+
+		mEditIndex.insert({ node, index });
+		return index;
+	}
+
+	// Modify an unshared edit node in-place. Its parent is about to be updated to whatever we return, so if the
+	// modified node turns out to be prunable or a duplicate of an existing node then it is no longer needed.
+	uint32 NodeDAG::hashConsedUpdate(uint32 nodeIndex, uint32 childId, uint32 newChildNodeIndex)
+	{
+		assert(isEditNode(nodeIndex) && !isShared(nodeIndex));
+
+		Node node = mNodes[nodeIndex];
+		assert(mEditIndex.at(node) == nodeIndex);
+		mEditIndex.erase(node);
+		node[childId] = newChildNodeIndex;
+
+		if (isPrunable(node))
+		{
+			freeEditNode(nodeIndex);
+			return newChildNodeIndex;
+		}
+
+		if (const uint32 existingIndex = findNode(node))
+		{
+			markShared(existingIndex);
+			freeEditNode(nodeIndex);
+			return existingIndex;
+		}
+
+		mNodes.setNodeChild(nodeIndex, childId, newChildNodeIndex);
+		mEditIndex.insert({ node, nodeIndex });
+		return nodeIndex;
+	}
+
+	// Baked nodes are always treated as shared, whereas edit nodes are only ever shared in hash-consing mode.
+	bool NodeDAG::isShared(uint32 index) const
+	{
+		if (!isEditNode(index)) { return true; }
+		return mHashConsing && mSharedEditNodes[editNodesEnd() - 1 - index];
+	}
+
+	// A node which is reachable via more than one path must not be modified in-place, and neither must
+	// anything beneath it. So we mark the whole subtree, stopping at nodes which are already marked.
+	void NodeDAG::markShared(uint32 index)
+	{
+		if (!mHashConsing) { return; }
+
+		std::vector<uint32> pending = { index };
+		while (!pending.empty())
+		{
+			const uint32 current = pending.back();
+			pending.pop_back();
+			if (isEditNode(current) && !mSharedEditNodes[editNodesEnd() - 1 - current])
+			{
+				mSharedEditNodes[editNodesEnd() - 1 - current] = true;
+				pending.insert(pending.end(), mNodes[current].begin(), mNodes[current].end());
+			}
+		}
+	}
+
+	void NodeDAG::freeEditNode(uint32 index)
+	{
+		assert(isEditNode(index) && !isShared(index));
+		mReleasedEditNodes.push_back(index);
+	}
+
+	// Should be called once an edit is complete and no released node is referenced any more.
+	void NodeDAG::recycleEditNodes()
+	{
+		mFreeEditNodes.insert(mFreeEditNodes.end(), mReleasedEditNodes.begin(), mReleasedEditNodes.end());
+		mReleasedEditNodes.clear();
+	}
+
+	void NodeDAG::resetEditIndex()
+	{
+		mEditIndex.clear();
+		mSharedEditNodes.clear();
+		mReleasedEditNodes.clear();
+		mFreeEditNodes.clear();
+	}
+
 	////////////////////////////////////////////////////////////////////////////////
 	// Public member functions
 	////////////////////////////////////////////////////////////////////////////////
@@ -251,12 +1470,17 @@ namespace Cubiquity
 		mCurrentRoot = 0;
 	}
 
-	Volume::Volume(const std::string& filename)
+	Volume::Volume(const std::string& filename, bool mapFile)
 	{
 		mRootNodeIndices.resize(1);
 		mCurrentRoot = 0;
 
-		load(filename);
+		load(filename, mapFile);
+	}
+
+	Volume::~Volume()
+	{
+		discardSpilledSteps();
 	}
 
 	void Volume::fill(MaterialId matId)
@@ -271,20 +1495,68 @@ namespace Cubiquity
 
 	void Volume::setRootNodeIndex(uint32 newRootNodeIndex)
 	{
-		if (mTrackEdits)
+		// Within a transaction only the first edit adds an undo step, and the rest replace it.
+		if (mTrackEdits && !(mEditDepth > 0 && mEditStepAdded))
 		{
 			// When tracking edits a root node should not be set to itself. However, this
 			// might happen when *not* tracking edits because we are then modifying in-place.
 			assert(newRootNodeIndex != mRootNodeIndices[mCurrentRoot]);
 
+			// Any redo history is lost (see the note on mRootNodeIndices).
 			mCurrentRoot++;
-			if (mCurrentRoot >= mRootNodeIndices.size())
-			{
-				mRootNodeIndices.resize(mCurrentRoot + 1);
-			}
+			mRootNodeIndices.resize(mCurrentRoot + 1);
+			mEditStepAdded = mEditDepth > 0;
 		}
 
 		mRootNodeIndices[mCurrentRoot] = newRootNodeIndex;
+
+		// The edit which gave us the new root is complete, so any nodes it released can now be reused.
+		mDAG.recycleEditNodes();
+
+		// The rest waits until the transaction is committed.
+		if (mEditDepth > 0) { return; }
+
+		publishRootNodeIndex();
+		runDeferredTasks();
+		enforceUndoLimits();
+		collectGarbageIfNeeded();
+	}
+
+	uint32 Volume::collectGarbage()
+	{
+		// Collection moves the surviving nodes, so it must wait until no snapshot can be reading them (and until
+		// any transaction is committed, as it could make existing nodes look like they were created within it).
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		if (mSnapshotCount > 0 || mEditDepth > 0)
+		{
+			mCollectionDeferred = true;
+			return 0;
+		}
+		mCollectionDeferred = false;
+
+		const uint32 removedNodeCount = mDAG.collectGarbage(mRootNodeIndices);
+		mNodesAfterLastCollection = mDAG.storedNodeCount();
+		publishRootNodeIndex();
+		return removedNodeCount;
+	}
+
+	void Volume::setGarbageCollectionTrigger(uint32 maxNodeCount, uint64 maxBytes)
+	{
+		mGarbageNodeThreshold = maxNodeCount;
+		mGarbageByteThreshold = maxBytes;
+	}
+
+	void Volume::collectGarbageIfNeeded()
+	{
+		const uint32 storedNodeCount = mDAG.storedNodeCount();
+		if (storedNodeCount < uint64(mNodesAfterLastCollection) * 2) { return; }
+
+		const bool tooManyNodes = mGarbageNodeThreshold > 0 && storedNodeCount > mGarbageNodeThreshold;
+		const bool tooManyBytes = mGarbageByteThreshold > 0 && mDAG.nodes().committedBytes() > mGarbageByteThreshold;
+		if (tooManyNodes || tooManyBytes)
+		{
+			collectGarbage();
+		}
 	}
 
 	void Volume::setTrackEdits(bool trackEdits)
@@ -295,14 +1567,55 @@ namespace Cubiquity
 			mRootNodeIndices[0] = mRootNodeIndices[mCurrentRoot];
 			mRootNodeIndices.resize(1);
 			mCurrentRoot = 0;
+			discardSpilledSteps();
 		}
 	}
 
+	void Volume::setUndoLimits(uint32 maxSteps, uint64 maxBytes, const std::string& spillDirectory)
+	{
+		mMaxUndoSteps = maxSteps;
+		mMaxUndoBytes = maxBytes;
+		mUndoCheckNodeCount = 0;
+		mUndoSpillDirectory = spillDirectory;
+		enforceUndoLimits();
+	}
+
+	void Volume::beginEdit()
+	{
+		if (mEditDepth++ == 0)
+		{
+			mEditStepAdded = false;
+			mDAG.beginFreshEditNodes();
+		}
+	}
+
+	void Volume::commitEdit()
+	{
+		assert(mEditDepth > 0);
+		if (--mEditDepth > 0) { return; }
+
+		mDAG.endFreshEditNodes();
+		mEditStepAdded = false;
+
+		// Even if no undo step was added (or edits are not tracked) the nodes may have been modified in-place.
+		publishRootNodeIndex();
+		runDeferredTasks();
+		enforceUndoLimits();
+		collectGarbageIfNeeded();
+	}
+
 	bool Volume::undo()
 	{
+		assert(mEditDepth == 0);
+		if (mCurrentRoot == 0 && !mSpilledSteps.empty())
+		{
+			reloadSpilledStep();
+		}
+
 		if (mCurrentRoot > 0)
 		{
 			mCurrentRoot--;
+			publishRootNodeIndex();
 			return true;
 		}
 
@@ -311,19 +1624,73 @@ namespace Cubiquity
 
 	bool Volume::redo()
 	{
+		assert(mEditDepth == 0);
 		if (mCurrentRoot < mRootNodeIndices.size() - 1)
 		{
 			mCurrentRoot++;
+			publishRootNodeIndex();
 			return true;
 		}
 
 		return false; // Nothing to redo
 	}
 
-	void Volume::bake()
+	void Volume::bake(bool parallel)
+	{
+		// Baking overwrites the baked range, so it must wait until no snapshot can be reading it.
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		if (mSnapshotCount > 0)
+		{
+			mBakeDeferred = true;
+			return;
+		}
+		mBakeDeferred = false;
+		mBakeEditsDeferred = false;
+
+		const uint32 oldRootNodeIndex = rootNodeIndex();
+		if (parallel) { mDAG.parallelMerge(oldRootNodeIndex); }
+		else { mDAG.merge(oldRootNodeIndex); }
+
+		// Baking overwrites the baked range and discards all edit nodes, so any other roots in the
+		// undo history are now invalid. Keep only the baked root (which is a material if nothing
+		// was baked, as the baked range is then empty).
+		mRootNodeIndices.resize(1);
+		mCurrentRoot = 0;
+		mRootNodeIndices[mCurrentRoot] = isMaterialNode(oldRootNodeIndex) ? oldRootNodeIndex : mDAG.bakedNodesBegin();
+		discardSpilledSteps();
+		publishRootNodeIndex();
+	}
+
+	void Volume::bakeEdits()
+	{
+		// As for bake(), but the edit nodes are also renumbered when they are merged.
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		if (mSnapshotCount > 0)
+		{
+			mBakeEditsDeferred = true;
+			return;
+		}
+		mBakeEditsDeferred = false;
+
+		// Fall back to a full bake if the store is too full for the edits to be baked in-place.
+		if (!mDAG.mergeEdits(mRootNodeIndices))
+		{
+			log_warning("Not enough space to bake edits incrementally, doing a full bake instead");
+			bake();
+		}
+		publishRootNodeIndex();
+	}
+
+	void Volume::setHashConsing(bool hashConsing)
 	{
-		mDAG.merge(rootNodeIndex());
-		setRootNodeIndex(mDAG.bakedNodesBegin());
+		// The two modes have different rules about which edit nodes can be modified in-place.
+		bakeEdits();
+		if (mBakeEditsDeferred)
+		{
+			log_warning("Cannot change the hash-consing mode while snapshots are held");
+			return;
+		}
+		mDAG.setHashConsing(hashConsing);
 	}
 
 	void Volume::setVoxelRecursive(int32_t x, int32_t y, int32_t z, MaterialId matId)
@@ -367,11 +1734,11 @@ namespace Cubiquity
 			// If the child hasn't changed then we don't need to update the current node.
 			if (newChildNodeIndex == childNodeIndex) { return nodeIndex; }
 
-			return mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, mTrackEdits);
+			return mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, copyOnWrite());
 		}
 		else
 		{
-			return mDAG.updateNodeChild(nodeIndex, childId, matId, mTrackEdits);
+			return mDAG.updateNodeChild(nodeIndex, childId, matId, copyOnWrite());
 		}
 	}
 
@@ -444,12 +1811,12 @@ namespace Cubiquity
 					const NodeState& childNodeState = nodeStateStack[nodeHeight - 1];
 					if (mDAG[nodeState.mIndex][childId] != childNodeState.mIndex)
 					{
-						nodeState.mIndex = mDAG.updateNodeChild(nodeState.mIndex, childId, childNodeState.mIndex, mTrackEdits);
+						nodeState.mIndex = mDAG.updateNodeChild(nodeState.mIndex, childId, childNodeState.mIndex, copyOnWrite());
 					}
 				}
 				else
 				{
-					nodeState.mIndex = mDAG.updateNodeChild(nodeState.mIndex, childId, matId, mTrackEdits);
+					nodeState.mIndex = mDAG.updateNodeChild(nodeState.mIndex, childId, matId, copyOnWrite());
 				}
 
 				// Move up the tree to process parent node next, until we reach the root.
@@ -464,282 +1831,1542 @@ namespace Cubiquity
 		setRootNodeIndex(nodeStateStack[rootHeight].mIndex);
 	}
 
-	void Volume::fillBrush(const Brush& brush, MaterialId matId)
+	struct Volume::VoxelWrite
 	{
-		const int rootHeight = logBase2(VolumeSideLength);
-		int nodeHeight = rootHeight;
-		uint32_t newIndex = matId;
+		// Position mapped to unsigned space (as in setVoxel()) so that it matches the tree structure.
+		uint32 ux, uy, uz;
+		MaterialId matId;
+	};
 
-		constexpr int32 rootLowerBound = std::numeric_limits<int32>::min();
+	void Volume::setVoxels(std::span<const Vector3i> positions, std::span<const MaterialId> materials)
+	{
+		assert(positions.size() == materials.size());
 
-		uint32 newRootNodeIndex = fillBrush(brush, matId, rootNodeIndex(), nodeHeight, rootLowerBound, rootLowerBound, rootLowerBound);
-		setRootNodeIndex(newRootNodeIndex);
+		std::vector<VoxelWrite> writes(positions.size());
+		for (size_t i = 0; i < positions.size(); i++)
+		{
+			writes[i] = { static_cast<uint32>(positions[i].x()) ^ (1u << 31), static_cast<uint32>(positions[i].y()) ^ (1u << 31),
+				static_cast<uint32>(positions[i].z()) ^ (1u << 31), materials[i] };
+		}
+
+		setVoxels(writes);
 	}
 
-	uint32 Volume::fillBrush(const Brush& brush, MaterialId matId, uint32 nodeIndex, int nodeHeight, int32 nodeLowerX, int32 nodeLowerY, int32 nodeLowerZ)
+	void Volume::setVoxels(std::span<const Vector3i> runStarts, std::span<const uint32> runLengths, std::span<const MaterialId> materials)
 	{
-		uint32_t childHeight = nodeHeight - 1;
-		//int tx = (x ^ (1UL << 31)); // Could precalculte these.
-		//int ty = (y ^ (1UL << 31));
-		//int tz = (z ^ (1UL << 31));
+		assert(runStarts.size() == runLengths.size() && runStarts.size() == materials.size());
 
-		for (uint32 childZ = 0; childZ <= 1; childZ++)
+		// Runs are expanded into individual writes. Runs along x are not aligned to nodes, so keeping them
+		// intact would mean splitting them at every level and there would be little left to gain.
+		std::vector<VoxelWrite> writes;
+		writes.reserve(std::accumulate(runLengths.begin(), runLengths.end(), size_t(0)));
+		for (size_t i = 0; i < runStarts.size(); i++)
 		{
-			for (uint32 childY = 0; childY <= 1; childY++)
+			const uint32 ux = static_cast<uint32>(runStarts[i].x()) ^ (1UL << 31);
+			const uint32 uy = static_cast<uint32>(runStarts[i].y()) ^ (1UL << 31);
+			const uint32 uz = static_cast<uint32>(runStarts[i].z()) ^ (1UL << 31);
+			for (uint32 offset = 0; offset < runLengths[i]; offset++)
 			{
-				for (uint32 childX = 0; childX <= 1; childX++)
-				{
-					//uint32_t childX = (tx >> childHeight) & 0x01;
-					//uint32_t childY = (ty >> childHeight) & 0x01;
-					//uint32_t childZ = (tz >> childHeight) & 0x01;
-					uint32_t childId = childZ << 2 | childY << 1 | childX;
+				writes.push_back({ ux + offset, uy, uz, materials[i] });
+			}
+		}
 
-					uint32_t childSideLength = 1 << (childHeight);
-					int32 childLowerX = nodeLowerX + (childSideLength * childX);
-					int32 childLowerY = nodeLowerY + (childSideLength * childY);
-					int32 childLowerZ = nodeLowerZ + (childSideLength * childZ);
+		setVoxels(writes);
+	}
 
-					int32 childUpperX = childLowerX + (childSideLength - 1);
-					int32 childUpperY = childLowerY + (childSideLength - 1);
-					int32 childUpperZ = childLowerZ + (childSideLength - 1);
+	void Volume::setVoxels(std::vector<VoxelWrite>& writes)
+	{
+		if (writes.empty()) { return; }
 
-					Box3f childBounds(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childLowerY), static_cast<float>(childLowerZ) }), Vector3f({ static_cast<float>(childUpperX),static_cast<float>(childUpperY), static_cast<float>(childUpperZ) }));
+		// Sort into Morton order, with z as the most significant axis to match the child numbering. Interleaving
+		// the coordinates would need 96-bit keys, so instead we find the axis with the most significant differing
+		// bit and compare on that. The sort is stable so that repeated writes to a voxel stay in submission order.
+		auto lessMsb = [](uint32 a, uint32 b) { return a < b && a < (a ^ b); };
+		std::stable_sort(writes.begin(), writes.end(), [&](const VoxelWrite& a, const VoxelWrite& b)
+			{
+				uint32 maxDiff = a.uz ^ b.uz;
+				bool result = a.uz < b.uz;
+				if (lessMsb(maxDiff, a.uy ^ b.uy)) { maxDiff = a.uy ^ b.uy; result = a.uy < b.uy; }
+				if (lessMsb(maxDiff, a.ux ^ b.ux)) { result = a.ux < b.ux; }
+				return result;
+			});
+
+		// Keep only the last write to each voxel. This means a leaf is never written twice,
+		// and a run of writes that exactly fills a node is easy to recognise.
+		size_t uniqueCount = 0;
+		for (size_t i = 0; i < writes.size(); i++)
+		{
+			const bool overwritten = i + 1 < writes.size() &&
+				writes[i].ux == writes[i + 1].ux && writes[i].uy == writes[i + 1].uy && writes[i].uz == writes[i + 1].uz;
+			if (!overwritten) { writes[uniqueCount++] = writes[i]; }
+		}
+		writes.resize(uniqueCount);
 
-					if (!overlaps(brush.bounds(), childBounds))
-					{
-						continue;
-					}
+		const int rootHeight = logBase2(VolumeSideLength);
+		uint32 newRootNodeIndex = setVoxels(writes.data(), writes.data() + writes.size(), rootNodeIndex(), rootHeight);
 
-					bool allCornersInsideBrush = true;
-					if (!brush.contains(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childLowerY), static_cast<float>(childLowerZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childLowerY), static_cast<float>(childUpperZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childUpperY), static_cast<float>(childLowerZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childUpperY), static_cast<float>(childUpperZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childUpperX), static_cast<float>(childLowerY), static_cast<float>(childLowerZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childUpperX), static_cast<float>(childLowerY), static_cast<float>(childUpperZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childUpperX), static_cast<float>(childUpperY), static_cast<float>(childLowerZ) }))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f({ static_cast<float>(childUpperX), static_cast<float>(childUpperY), static_cast<float>(childUpperZ) }))) { allCornersInsideBrush = false; }
+		// As with fillBrush() there is no new undo step if nothing changed.
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
+	}
 
-					const bool nodeIsMaterial = isMaterialNode(nodeIndex);
+	uint32 Volume::setVoxels(const VoxelWrite* begin, const VoxelWrite* end, uint32 nodeIndex, int nodeHeight)
+	{
+		assert(nodeHeight > 0 && begin != end);
+		const uint32 childHeight = nodeHeight - 1;
 
-					// If current node is a material then just propergate it. Otherwise get the true child.
-					uint32_t childNodeIndex = nodeIsMaterial ? nodeIndex : mDAG[nodeIndex][childId];
+		auto childIdOf = [childHeight](const VoxelWrite& write)
+		{
+			return ((write.uz >> childHeight) & 0x01) << 2 | ((write.uy >> childHeight) & 0x01) << 1 | ((write.ux >> childHeight) & 0x01);
+		};
 
-					// If the child node is set to the desired material then the voxel is already set.
-					if (childNodeIndex == matId) { continue; }
+		// When tracking edits the first change to a node must copy it, but the copy is then private
+		// to this edit so any other children which change can be updated in-place.
+		const uint32 originalNodeIndex = nodeIndex;
 
-					// Process children
-					uint32 newChildNodeIndex = childNodeIndex;
-					//if (nodeHeight >= 2)
-					if(nodeHeight >= 2 && !allCornersInsideBrush)
-					{
-						newChildNodeIndex = fillBrush(brush, matId, childNodeIndex, nodeHeight - 1, childLowerX, childLowerY, childLowerZ);
-					}
-					else
-					{
-						if (allCornersInsideBrush)
-						{
-							newChildNodeIndex = matId;
-						}
-					}
+		while (begin != end)
+		{
+			// The writes are in Morton order, so those which fall in the same child are contiguous.
+			const uint32 childId = childIdOf(*begin);
+			const VoxelWrite* childEnd = std::partition_point(begin, end,
+				[&](const VoxelWrite& write) { return childIdOf(write) == childId; });
 
-					// If the child has changed then we need to update the current node.
-					if (childNodeIndex != newChildNodeIndex)
-					{
-						nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, mTrackEdits);
-					}
-				}
+			// If current node is a material then just propergate it. Otherwise get the true child.
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+
+			// Duplicates have been removed, so a child is completely covered if it gets one write per voxel.
+			const bool coversChild = childHeight <= 10 && uint64(childEnd - begin) == (UINT64_C(1) << (3 * childHeight)) &&
+				std::all_of(begin, childEnd, [&](const VoxelWrite& write) { return write.matId == begin->matId; });
+
+			uint32 newChildNodeIndex = childNodeIndex;
+			if (coversChild) // Includes the leaf case, where there is exactly one write.
+			{
+				newChildNodeIndex = begin->matId;
+			}
+			else
+			{
+				newChildNodeIndex = setVoxels(begin, childEnd, childNodeIndex, childHeight);
+			}
+
+			// If the child has changed then we need to update the current node.
+			if (newChildNodeIndex != childNodeIndex)
+			{
+				const bool forceCopy = copyOnWrite() && nodeIndex == originalNodeIndex;
+				nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, forceCopy);
 			}
+
+			begin = childEnd;
 		}
 
 		return nodeIndex;
 	}
 
-	void Volume::addVolume(const Volume& rhsVolume)
+	void Volume::setRegion(const Box3i& region, const MaterialId* data, const Vector3i64& strides)
 	{
 		const int rootHeight = logBase2(VolumeSideLength);
-		int nodeHeight = rootHeight;
+		const Vector3i rootLower = Vector3i::filled(std::numeric_limits<int32>::min());
 
-		constexpr int32 rootLowerBound = std::numeric_limits<int32>::min();
+		uint32 newRootNodeIndex = setRegion(region, data, strides, rootNodeIndex(), rootHeight, rootLower);
 
-		uint32 newRootNodeIndex = addVolume(rhsVolume, rhsVolume.rootNodeIndex(), rootNodeIndex(), nodeHeight, rootLowerBound, rootLowerBound, rootLowerBound);
-		setRootNodeIndex(newRootNodeIndex);
+		// As with fillBrush() there is no new undo step if nothing changed.
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
 	}
 
-	// Fixme - This function can prbably be more efficient. Firstly through better early out when whole nodes are full/empty, and also
-	// if seperate volumes shared a common memory space it would be easier to copy node directly across (maybe in compressd space?).
-	uint32 Volume::addVolume(const Volume& rhsVolume, uint32 rhsNodeIndex, uint32 nodeIndex, int nodeHeight, int32 nodeLowerX, int32 nodeLowerY, int32 nodeLowerZ)
+	uint32 Volume::setRegion(const Box3i& region, const MaterialId* data, const Vector3i64& strides, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower)
 	{
-		uint32_t childHeight = nodeHeight - 1;
-		//int tx = (x ^ (1UL << 31)); // Could precalculte these.
-		//int ty = (y ^ (1UL << 31));
-		//int tz = (z ^ (1UL << 31));
-
-		for (uint32 childZ = 0; childZ <= 1; childZ++)
-		{
-			for (uint32 childY = 0; childY <= 1; childY++)
-			{
-				for (uint32 childX = 0; childX <= 1; childX++)
-				{
-					//uint32_t childX = (tx >> childHeight) & 0x01;
-					//uint32_t childY = (ty >> childHeight) & 0x01;
-					//uint32_t childZ = (tz >> childHeight) & 0x01;
-					uint32_t childId = childZ << 2 | childY << 1 | childX;
-
-					uint32_t childSideLength = 1 << (childHeight);
-					int32 childLowerX = nodeLowerX + (childSideLength * childX);
-					int32 childLowerY = nodeLowerY + (childSideLength * childY);
-					int32 childLowerZ = nodeLowerZ + (childSideLength * childZ);
-
-					int32 childUpperX = childLowerX + (childSideLength - 1);
-					int32 childUpperY = childLowerY + (childSideLength - 1);
-					int32 childUpperZ = childLowerZ + (childSideLength - 1);
-
-					Box3f childBounds(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childLowerY), static_cast<float>(childLowerZ) } ), Vector3f({ static_cast<float>(childUpperX), static_cast<float>(childUpperY), static_cast<float>(childUpperZ) }));
-
-					/*if (!overlaps(brush.bounds(), childBounds))
-					{
-						continue;
-					}*/
-
-					/*bool allCornersInsideBrush = true;
-					if (!brush.contains(Vector3f(childLowerX, childLowerY, childLowerZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childLowerX, childLowerY, childUpperZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childLowerX, childUpperY, childLowerZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childLowerX, childUpperY, childUpperZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childUpperX, childLowerY, childLowerZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childUpperX, childLowerY, childUpperZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childUpperX, childUpperY, childLowerZ))) { allCornersInsideBrush = false; }
-					if (!brush.contains(Vector3f(childUpperX, childUpperY, childUpperZ))) { allCornersInsideBrush = false; }*/
+		const uint32 childHeight = nodeHeight - 1;
+		const int64 childSideLength = INT64_C(1) << childHeight;
 
-					const bool nodeIsMaterial = isMaterialNode(nodeIndex);
-					const bool rhsNodeIsMaterial = isMaterialNode(rhsNodeIndex);
+		// See setVoxels() - only the first change to a node needs to copy it.
+		const uint32 originalNodeIndex = nodeIndex;
 
-					// If current node is a material then just propergate it. Otherwise get the true child.
-					uint32_t childNodeIndex = nodeIsMaterial ? nodeIndex : mDAG[nodeIndex][childId];
-					uint32_t rhsChildNodeIndex = rhsNodeIsMaterial ? rhsNodeIndex : rhsVolume.mDAG[rhsNodeIndex][childId];
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const Vector3i64 childLower64 = {
+				nodeLower.x() + childSideLength * (childId & 0x01),
+				nodeLower.y() + childSideLength * ((childId >> 1) & 0x01),
+				nodeLower.z() + childSideLength * ((childId >> 2) & 0x01) };
+			const Vector3i childLower = static_cast<Vector3i>(childLower64);
+			const Vector3i childUpper = static_cast<Vector3i>(childLower64 + Vector3i64::filled(childSideLength - 1));
+			const Box3i childBounds(childLower, childUpper);
 
-					// If the child node is set to the desired material then the voxel is already set.
-					if (isMaterialNode(childNodeIndex) && isMaterialNode(rhsChildNodeIndex) && (childNodeIndex == rhsChildNodeIndex)) { continue; }
+			if (!overlaps(region, childBounds)) { continue; }
 
-					// Process children
-					uint32 newChildNodeIndex = childNodeIndex;
+			// If current node is a material then just propergate it. Otherwise get the true child.
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
 
-					// We have to treat at least one material as empty space, otherwise we are just copying 
-					// every voxel from source to destination, which just result in a copy of the source. 
-					// Hard-code it to zero for now, but should think about how else it might be controlled.
-					MaterialId emptyMaterial = 0;
-					if (rhsChildNodeIndex != emptyMaterial)
-					{
-						if (isMaterialNode(rhsChildNodeIndex))
-						{
-							newChildNodeIndex = rhsChildNodeIndex;
-						}
-						else
-						{
-							newChildNodeIndex = addVolume(rhsVolume, rhsChildNodeIndex, childNodeIndex, nodeHeight - 1, childLowerX, childLowerY, childLowerZ);;
-						}
-					}
+			uint32 newChildNodeIndex = childNodeIndex;
+			if (region.contains(childBounds))
+			{
+				// The child is replaced entirely, so there is no need to look at what is already there.
+				const Vector3i64 offset = childLower64 - static_cast<Vector3i64>(region.lower());
+				const MaterialId* childData = data + offset.x() * strides.x() + offset.y() * strides.y() + offset.z() * strides.z();
+				newChildNodeIndex = childHeight == 0 ? *childData : buildRegionNode(childData, strides, childHeight);
+			}
+			else
+			{
+				newChildNodeIndex = setRegion(region, data, strides, childNodeIndex, childHeight, childLower);
+			}
 
-					// If the child has changed then we need to update the current node.
-					if (childNodeIndex != newChildNodeIndex)
-					{
-						nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, mTrackEdits);
-					}
-				}
+			// If the child has changed then we need to update the current node.
+			if (newChildNodeIndex != childNodeIndex)
+			{
+				const bool forceCopy = copyOnWrite() && nodeIndex == originalNodeIndex;
+				nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, forceCopy);
 			}
 		}
 
 		return nodeIndex;
 	}
 
-	MaterialId Volume::voxel(int32_t x, int32_t y, int32_t z) const
+	// Builds the node whose lowest voxel is at 'data', returning either a material (if the node is uniform) or the
+	// index of a node which is shared with any identical nodes. Nodes are only created once all their children are
+	// known, so no transient copies are made and nothing is left to be deduplicated by a subsequent bake.
+	uint32 Volume::buildRegionNode(const MaterialId* data, const Vector3i64& strides, int nodeHeight)
 	{
-		uint32_t nodeIndex = rootNodeIndex();
-		uint32_t height = logBase2(VolumeSideLength);
-
-		// FIXME - think whether we need the line below - I think we do for empty/solid volumes?
-		//if (mDAG.isMaterialNode(mRootNodeIndex)) { return static_cast<MaterialId>(mRootNodeIndex); }
-
-		while (height >= 1)
-		{			
-			// If we reach a full node then the requested voxel is occupied.
-			if (isMaterialNode(nodeIndex)) { return static_cast<MaterialId>(nodeIndex); }
-
-			// Otherwise find which subtree we are in.
-			// Optimization - Note that the code below requires shifting by a variable amount which can be slow.
-			// Alternatively I think we can simply shift x, y, and z by one bit per iteration, but this requires us
-			// to reverse the order of the bits at the start of this function. It would be a one-time cost for a
-			// faster loop, and testing is needed (on a real, large volume) to determine whether it is beneficial.
-			uint32_t childHeight = height - 1;
-			int tx = (x ^ (1UL << 31)); // Could precalculte these.
-			int ty = (y ^ (1UL << 31));
-			int tz = (z ^ (1UL << 31));
-			uint32_t childX = (tx >> childHeight) & 0x01;
-			uint32_t childY = (ty >> childHeight) & 0x01;
-			uint32_t childZ = (tz >> childHeight) & 0x01;
-			uint32_t childId = childZ << 2 | childY << 1 | childX;
+		const uint32 childHeight = nodeHeight - 1;
+		const int64 childSideLength = INT64_C(1) << childHeight;
 
-			// Prepare for next iteration.
-			nodeIndex = mDAG[nodeIndex][childId];
-			height--;
+		Node node;
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const MaterialId* childData = data +
+				childSideLength * ((childId & 0x01) * strides.x() + ((childId >> 1) & 0x01) * strides.y() + ((childId >> 2) & 0x01) * strides.z());
+			node[childId] = childHeight == 0 ? *childData : buildRegionNode(childData, strides, childHeight);
 		}
 
-		// We have reached a height of zero so the node must be a material node.
-		assert(height == 0 && isMaterialNode(nodeIndex));
-		return static_cast<MaterialId>(nodeIndex);
+		return mDAG.isPrunable(node) ? node[0] : mDAG.insertShared(node);
 	}
 
-	////////////////////////////////////////////////////////////////////////////////
-	// Private member functions
-	////////////////////////////////////////////////////////////////////////////////
+	void Volume::extractRegion(const Box3i& region, MaterialId* data, bool parallel) const
+	{
+		extractRegion(region, data, { 1, region.width(), int64(region.width()) * region.height() }, parallel);
+	}
 
-	bool Volume::load(const std::string& filename)
+	void Volume::extractRegion(const Box3i& region, MaterialId* data, const Vector3i64& strides, bool parallel) const
 	{
-		std::ifstream file(filename, std::ios::binary);
+		// Slabs are aligned to nodes of this height, so that each traversal stays within its own nodes
+		// near the bottom of the tree. They are also big enough for the traversals to be worthwhile.
+		const int slabHeight = 4;
+		const int64 slabDepth = INT64_C(1) << slabHeight;
 
-		// FIXME - What should we do for error handling in this function? Return codes or exceptions?
-		if(!file.is_open())
+		std::vector<Box3i> slabs;
+		for (int64 z = region.lower().z(); z <= region.upper().z(); z = (z & ~(slabDepth - 1)) + slabDepth)
 		{
-			return false;
+			const int64 slabUpperZ = std::min<int64>((z & ~(slabDepth - 1)) + slabDepth - 1, region.upper().z());
+			slabs.push_back(Box3i({ region.lower().x(), region.lower().y(), static_cast<int32>(z) },
+				{ region.upper().x(), region.upper().y(), static_cast<int32>(slabUpperZ) }));
 		}
 
-		uint32 rootNodeIndex;
-		file.read(reinterpret_cast<char*>(&rootNodeIndex), sizeof(rootNodeIndex));
-		//assert(rootNodeIndex == mDAG.arrayBegin());
-		//setRootNodeIndex(RefCountedNodeIndex(rootNodeIndex, &mDAG));
-
-		//mDAG.read(file);
-
-		// This fill is not required but can be useful for debugging
-		//const Node InvalidNode = makeNode(0xffffffff);
-		//std::fill(mDAG.mNodes.begin(), mDAG.mNodes.end(), InvalidNode);
-
-		mDAG.read(file);
-
-		if (rootNodeIndex >= MaterialCount)
+		auto extractSlab = [&](const Box3i& slab)
 		{
-			rootNodeIndex += mDAG.bakedNodesBegin() - MaterialCount;
-		}
-
-		setRootNodeIndex(rootNodeIndex);
+			const int rootHeight = logBase2(VolumeSideLength);
+			const Vector3i rootLower = Vector3i::filled(std::numeric_limits<int32>::min());
+			MaterialId* slabData = data + (int64(slab.lower().z()) - region.lower().z()) * strides.z();
+			extractRegion(slab, slabData, strides, rootNodeIndex(), rootHeight, rootLower);
+		};
 
-		return true;
+		if (parallel) { std::for_each(std::execution::par, slabs.begin(), slabs.end(), extractSlab); }
+		else { std::for_each(slabs.begin(), slabs.end(), extractSlab); }
 	}
 
-	void Volume::save(const std::string& filename)
+	void Volume::extractRegion(const Box3i& region, MaterialId* data, const Vector3i64& strides, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower) const
 	{
-		bake();
-
-		uint32 root = rootNodeIndex();
-		const Node& data = mDAG[mDAG.bakedNodesBegin()];
+		const int64 nodeSideLength = INT64_C(1) << nodeHeight;
 
-		std::ofstream file;
-		file = std::ofstream(filename, std::ios::out | std::ios::binary);
-		file.write(reinterpret_cast<const char*>(&root), sizeof(root));
-		mDAG.write(file);
-		file.close();
-	}
+		if (isMaterialNode(nodeIndex))
+		{
+			// Fill the part of the node which overlaps the region, a row at a time.
+			const Vector3i64 lower = max(static_cast<Vector3i64>(nodeLower), static_cast<Vector3i64>(region.lower()));
+			const Vector3i64 upper = min(static_cast<Vector3i64>(nodeLower) + Vector3i64::filled(nodeSideLength - 1), static_cast<Vector3i64>(region.upper()));
+			const Vector3i64 offset = lower - static_cast<Vector3i64>(region.lower());
+			const int64 rowLength = upper.x() - lower.x() + 1;
+
+			for (int64 z = 0; z <= upper.z() - lower.z(); z++)
+			{
+				for (int64 y = 0; y <= upper.y() - lower.y(); y++)
+				{
+					MaterialId* row = data + offset.x() * strides.x() + (offset.y() + y) * strides.y() + (offset.z() + z) * strides.z();
+					if (strides.x() == 1) { std::fill_n(row, rowLength, static_cast<MaterialId>(nodeIndex)); }
+					else
+					{
+						for (int64 x = 0; x < rowLength; x++) { row[x * strides.x()] = static_cast<MaterialId>(nodeIndex); }
+					}
+				}
+			}
+
+			return;
+		}
+
+		const uint32 childHeight = nodeHeight - 1;
+		const int64 childSideLength = nodeSideLength / 2;
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const Vector3i64 childLower64 = {
+				nodeLower.x() + childSideLength * (childId & 0x01),
+				nodeLower.y() + childSideLength * ((childId >> 1) & 0x01),
+				nodeLower.z() + childSideLength * ((childId >> 2) & 0x01) };
+			const Box3i childBounds(static_cast<Vector3i>(childLower64), static_cast<Vector3i>(childLower64 + Vector3i64::filled(childSideLength - 1)));
+
+			if (overlaps(region, childBounds))
+			{
+				extractRegion(region, data, strides, mDAG[nodeIndex][childId], childHeight, childBounds.lower());
+			}
+		}
+	}
+
+	// Builds part of a generated region without modifying the DAG, so that many parts can be built in parallel. Nodes
+	// are deduplicated locally and stored in post-order, and children which refer to them are flagged to distinguish
+	// them from DAG nodes. Baked nodes of the existing volume can be referenced directly as they are immutable, but
+	// existing edit nodes are copied (see NodeDAG::insertShared()). Other builders may be adding nodes to the DAG
+	// at the same time, so edit nodes are identified by comparing with the start of the edit range beforehand.
+	class SubtreeBuilder
+	{
+	public:
+		SubtreeBuilder(const NodeDAG& dag, uint32 editNodesBegin, const Box3i& region, const Generator& generator)
+			:mDAG(dag), mEditNodesBegin(editNodesBegin), mRegion(region), mGenerator(generator) {}
+
+		uint32 build(uint32 existingIndex, int height, const Vector3i& lower)
+		{
+			const Box3i bounds(lower, static_cast<Vector3i>(static_cast<Vector3i64>(lower) + Vector3i64::filled((INT64_C(1) << height) - 1)));
+			if (!overlaps(mRegion, bounds)) { return copyExisting(existingIndex); }
+			if (height == 0) { return mGenerator.voxel(lower.x(), lower.y(), lower.z()); }
+
+			if (height >= 2 && mRegion.contains(bounds))
+			{
+				if (std::optional<MaterialId> matId = mGenerator.classify(bounds)) { return *matId; }
+			}
+
+			const uint32 childHeight = height - 1;
+			const int32 childSideLength = 1 << childHeight;
+			Node node;
+			for (uint32 childId = 0; childId < 8; childId++)
+			{
+				const uint32 existingChildIndex = isMaterialNode(existingIndex) ? existingIndex : mDAG[existingIndex][childId];
+				const Vector3i childLower = {
+					lower.x() + childSideLength * int32(childId & 0x01),
+					lower.y() + childSideLength * int32((childId >> 1) & 0x01),
+					lower.z() + childSideLength * int32((childId >> 2) & 0x01) };
+				node[childId] = build(existingChildIndex, childHeight, childLower);
+			}
+
+			return add(node);
+		}
+
+		// Adds the built nodes to the DAG (merging them with any identical nodes which are
+		// already there) and returns the new index of the given node.
+		uint32 insertInto(NodeDAG& dag, uint32 index)
+		{
+			std::vector<uint32> newIndices(mNodes.size());
+			for (uint32 i = 0; i < mNodes.size(); i++)
+			{
+				Node node = mNodes[i];
+				for (uint32& childIndex : node)
+				{
+					if (childIndex & LocalNodeFlag) { childIndex = newIndices[childIndex & ~LocalNodeFlag]; }
+				}
+				newIndices[i] = dag.insertShared(node);
+			}
+
+			return index & LocalNodeFlag ? newIndices[index & ~LocalNodeFlag] : index;
+		}
+
+	private:
+		// Node indices never reach this as the node store is (at most) half the size of the address space.
+		static constexpr uint32 LocalNodeFlag = UINT32_C(0x80000000);
+
+		uint32 copyExisting(uint32 index)
+		{
+			assert(index < LocalNodeFlag);
+			if (index < mEditNodesBegin) { return index; }
+
+			Node node;
+			for (uint32 childId = 0; childId < 8; childId++)
+			{
+				node[childId] = copyExisting(mDAG[index][childId]);
+			}
+			return add(node);
+		}
+
+		uint32 add(const Node& node)
+		{
+			if (mDAG.isPrunable(node)) { return node[0]; }
+
+			const auto [index, inserted] = mIndex.insert(node, static_cast<uint32>(mNodes.size()));
+			if (inserted) { mNodes.push_back(node); }
+			return index | LocalNodeFlag;
+		}
+
+		const NodeDAG& mDAG;
+		const uint32 mEditNodesBegin;
+		const Box3i& mRegion;
+		const Generator& mGenerator;
+
+		std::vector<Node> mNodes;
+		NodeMap mIndex;
+	};
+
+	// Nodes of this height are the units of parallel work when generating a region. Each covers 64^3 voxels.
+	constexpr int GenerateJobHeight = 6;
+
+	struct Volume::GenerateJob
+	{
+		uint32 existingIndex;
+		int height;
+		Vector3i lower;
+
+		// Set straight away if the generator classified the node, otherwise once the job is done.
+		uint32 result;
+		bool done;
+	};
+
+	void Volume::generate(const Box3i& region, const Generator& generator)
+	{
+		const int rootHeight = logBase2(VolumeSideLength);
+		const Vector3i rootLower = Vector3i::filled(std::numeric_limits<int32>::min());
+
+		// Divide the region into jobs. Those which overlap existing data may need to copy some of it, so they
+		// can't run while the DAG is being modified. Everything else happens serially, as the number of nodes
+		// above the job height is small compared with the number of voxels which need to be evaluated.
+		std::vector<GenerateJob> jobs;
+		collectGenerateJobs(region, generator, rootNodeIndex(), rootHeight, rootLower, jobs);
+
+		// Build the jobs in parallel. Inserting the results into the DAG is serialised, but is
+		// cheap as each job has already been deduplicated and most of its voxels were pruned.
+		std::mutex dagMutex;
+		const uint32 editNodesBegin = mDAG.editNodesBegin();
+		std::for_each(std::execution::par, jobs.begin(), jobs.end(), [&](GenerateJob& job)
+		{
+			if (job.done) { return; }
+
+			SubtreeBuilder builder(mDAG, editNodesBegin, region, generator);
+			const uint32 localIndex = builder.build(job.existingIndex, job.height, job.lower);
+
+			std::lock_guard<std::mutex> lock(dagMutex);
+			job.result = builder.insertInto(mDAG, localIndex);
+			job.done = true;
+		});
+
+		// Now assemble the jobs into the volume, in the same order as they were collected.
+		const GenerateJob* nextJob = jobs.data();
+		uint32 newRootNodeIndex = assembleGenerated(region, rootNodeIndex(), rootHeight, rootLower, nextJob, jobs.data() + jobs.size());
+		assert(nextJob == jobs.data() + jobs.size());
+
+		// As with fillBrush() there is no new undo step if nothing changed.
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
+	}
+
+	void Volume::collectGenerateJobs(const Box3i& region, const Generator& generator, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower, std::vector<GenerateJob>& jobs) const
+	{
+		const uint32 childHeight = nodeHeight - 1;
+		const int64 childSideLength = INT64_C(1) << childHeight;
+
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const Vector3i64 childLower64 = {
+				nodeLower.x() + childSideLength * (childId & 0x01),
+				nodeLower.y() + childSideLength * ((childId >> 1) & 0x01),
+				nodeLower.z() + childSideLength * ((childId >> 2) & 0x01) };
+			const Vector3i childLower = static_cast<Vector3i>(childLower64);
+			const Box3i childBounds(childLower, static_cast<Vector3i>(childLower64 + Vector3i64::filled(childSideLength - 1)));
+
+			if (!overlaps(region, childBounds)) { continue; }
+
+			// If current node is a material then just propergate it. Otherwise get the true child.
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+
+			std::optional<MaterialId> matId;
+			if (childHeight > GenerateJobHeight && region.contains(childBounds)) { matId = generator.classify(childBounds); }
+
+			if (matId)
+			{
+				jobs.push_back({ childNodeIndex, static_cast<int>(childHeight), childLower, *matId, true });
+			}
+			else if (childHeight <= GenerateJobHeight)
+			{
+				jobs.push_back({ childNodeIndex, static_cast<int>(childHeight), childLower, 0, false });
+			}
+			else
+			{
+				collectGenerateJobs(region, generator, childNodeIndex, childHeight, childLower, jobs);
+			}
+		}
+	}
+
+	uint32 Volume::assembleGenerated(const Box3i& region, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower, const GenerateJob*& nextJob, const GenerateJob* endJob)
+	{
+		const uint32 childHeight = nodeHeight - 1;
+		const int64 childSideLength = INT64_C(1) << childHeight;
+
+		// A node which is entirely inside the region is replaced, so it is built from scratch (like the jobs)
+		// rather than being copied. Otherwise the existing node is updated as in setRegion().
+		const Box3i nodeBounds(nodeLower, static_cast<Vector3i>(static_cast<Vector3i64>(nodeLower) + Vector3i64::filled(childSideLength * 2 - 1)));
+		const bool nodeInsideRegion = region.contains(nodeBounds);
+		Node newNode;
+
+		const uint32 originalNodeIndex = nodeIndex;
+
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const Vector3i64 childLower64 = {
+				nodeLower.x() + childSideLength * (childId & 0x01),
+				nodeLower.y() + childSideLength * ((childId >> 1) & 0x01),
+				nodeLower.z() + childSideLength * ((childId >> 2) & 0x01) };
+			const Vector3i childLower = static_cast<Vector3i>(childLower64);
+			const Box3i childBounds(childLower, static_cast<Vector3i>(childLower64 + Vector3i64::filled(childSideLength - 1)));
+
+			if (!overlaps(region, childBounds)) { continue; }
+
+			// If current node is a material then just propergate it. Otherwise get the true child.
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+
+			// Jobs are in depth-first order, and any job below this child would be smaller.
+			uint32 newChildNodeIndex = childNodeIndex;
+			if (nextJob != endJob && nextJob->height == static_cast<int>(childHeight) && nextJob->lower == childLower)
+			{
+				newChildNodeIndex = (nextJob++)->result;
+			}
+			else
+			{
+				newChildNodeIndex = assembleGenerated(region, childNodeIndex, childHeight, childLower, nextJob, endJob);
+			}
+
+			if (nodeInsideRegion)
+			{
+				newNode[childId] = newChildNodeIndex;
+			}
+			else if (newChildNodeIndex != childNodeIndex)
+			{
+				// See setVoxels() - only the first change to a node needs to copy it.
+				const bool forceCopy = copyOnWrite() && nodeIndex == originalNodeIndex;
+				nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, forceCopy);
+			}
+		}
+
+		if (nodeInsideRegion)
+		{
+			return mDAG.isPrunable(newNode) ? newNode[0] : mDAG.insertShared(newNode);
+		}
+
+		return nodeIndex;
+	}
+
+	void Volume::fillBrush(const Brush& brush, MaterialId matId)
+	{
+		const int rootHeight = logBase2(VolumeSideLength);
+		int nodeHeight = rootHeight;
+		uint32_t newIndex = matId;
+
+		constexpr int32 rootLowerBound = std::numeric_limits<int32>::min();
+
+		uint32 newRootNodeIndex = fillBrush(brush, matId, rootNodeIndex(), nodeHeight, rootLowerBound, rootLowerBound, rootLowerBound);
+
+		// The brush might not have changed anything, in which case there is no new undo step. Without edit tracking
+		// the root may have been modified in-place, so it is set anyway (as in setVoxels()).
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
+	}
+
+	uint32 Volume::fillBrush(const Brush& brush, MaterialId matId, uint32 nodeIndex, int nodeHeight, int32 nodeLowerX, int32 nodeLowerY, int32 nodeLowerZ)
+	{
+		uint32_t childHeight = nodeHeight - 1;
+		const Box3f brushBounds = brush.bounds();
+		//int tx = (x ^ (1UL << 31)); // Could precalculte these.
+		//int ty = (y ^ (1UL << 31));
+		//int tz = (z ^ (1UL << 31));
+
+		for (uint32 childZ = 0; childZ <= 1; childZ++)
+		{
+			for (uint32 childY = 0; childY <= 1; childY++)
+			{
+				for (uint32 childX = 0; childX <= 1; childX++)
+				{
+					//uint32_t childX = (tx >> childHeight) & 0x01;
+					//uint32_t childY = (ty >> childHeight) & 0x01;
+					//uint32_t childZ = (tz >> childHeight) & 0x01;
+					uint32_t childId = childZ << 2 | childY << 1 | childX;
+
+					uint32_t childSideLength = 1 << (childHeight);
+					int32 childLowerX = nodeLowerX + (childSideLength * childX);
+					int32 childLowerY = nodeLowerY + (childSideLength * childY);
+					int32 childLowerZ = nodeLowerZ + (childSideLength * childZ);
+
+					int32 childUpperX = childLowerX + (childSideLength - 1);
+					int32 childUpperY = childLowerY + (childSideLength - 1);
+					int32 childUpperZ = childLowerZ + (childSideLength - 1);
+
+					Box3f childBounds(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childLowerY), static_cast<float>(childLowerZ) }), Vector3f({ static_cast<float>(childUpperX),static_cast<float>(childUpperY), static_cast<float>(childUpperZ) }));
+
+					if (!overlaps(brushBounds, childBounds))
+					{
+						continue;
+					}
+
+					// A single voxel is tested directly, while larger children are only visited if they straddle the surface.
+					Brush::Classification classification = Brush::Classification::Straddling;
+					if (childHeight == 0)
+					{
+						classification = brush.contains(childBounds.lower()) ? Brush::Classification::Inside : Brush::Classification::Outside;
+					}
+					else
+					{
+						classification = brush.classify(childBounds);
+					}
+
+					if (classification == Brush::Classification::Outside) { continue; }
+
+					const bool nodeIsMaterial = isMaterialNode(nodeIndex);
+
+					// If current node is a material then just propergate it. Otherwise get the true child.
+					uint32_t childNodeIndex = nodeIsMaterial ? nodeIndex : mDAG[nodeIndex][childId];
+
+					// If the child node is set to the desired material then the voxel is already set.
+					if (childNodeIndex == matId) { continue; }
+
+					// Process children
+					uint32 newChildNodeIndex = matId;
+					if (classification == Brush::Classification::Straddling)
+					{
+						newChildNodeIndex = fillBrush(brush, matId, childNodeIndex, nodeHeight - 1, childLowerX, childLowerY, childLowerZ);
+					}
+
+					// If the child has changed then we need to update the current node.
+					if (childNodeIndex != newChildNodeIndex)
+					{
+						nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, copyOnWrite());
+					}
+				}
+			}
+		}
+
+		return nodeIndex;
+	}
+
+	struct Volume::BrushBatch
+	{
+		std::span<const Brush* const> brushes;
+		std::span<const MaterialId> materials;
+		std::vector<Box3f> bounds;
+
+		// The brushes which straddle the child being visited at each height. Children at the same height are visited
+		// one after another, so a single list per height is enough.
+		std::array<std::vector<uint32>, 33> activeBrushes;
+	};
+
+	void Volume::fillBrushes(std::span<const Brush* const> brushes, std::span<const MaterialId> materials)
+	{
+		assert(brushes.size() == materials.size());
+
+		BrushBatch batch;
+		batch.brushes = brushes;
+		batch.materials = materials;
+		for (const Brush* brush : brushes) { batch.bounds.push_back(brush->bounds()); }
+
+		std::vector<uint32> allBrushes(brushes.size());
+		std::iota(allBrushes.begin(), allBrushes.end(), 0);
+
+		const int rootHeight = logBase2(VolumeSideLength);
+		const Vector3i64 rootLower = Vector3i64::filled(std::numeric_limits<int32>::min());
+		const uint32 newRootNodeIndex = fillBrushes(batch, rootNodeIndex(), rootHeight, rootLower, allBrushes);
+
+		// As with fillBrush() there is no new undo step if nothing changed.
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
+	}
+
+	uint32 Volume::fillBrushes(BrushBatch& batch, uint32 nodeIndex, int nodeHeight, const Vector3i64& nodeLower, std::span<const uint32> activeBrushes)
+	{
+		const int childHeight = nodeHeight - 1;
+		const int64 childSideLength = INT64_C(1) << childHeight;
+		std::vector<uint32>& childBrushes = batch.activeBrushes[childHeight];
+
+		// See setVoxels() - only the first change to a node needs to copy it.
+		const uint32 originalNodeIndex = nodeIndex;
+
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const Vector3i64 childLower = {
+				nodeLower.x() + childSideLength * (childId & 0x01),
+				nodeLower.y() + childSideLength * ((childId >> 1) & 0x01),
+				nodeLower.z() + childSideLength * ((childId >> 2) & 0x01) };
+			const Box3f childBounds(static_cast<Vector3f>(childLower), static_cast<Vector3f>(childLower + Vector3i64::filled(childSideLength - 1)));
+
+			// A brush which contains the whole child overwrites everything before it, so the child can start out as
+			// that brush's material and only the brushes after it which straddle the child need to be applied.
+			int32 fillMaterial = -1;
+			childBrushes.clear();
+			for (uint32 brushId : activeBrushes)
+			{
+				if (!overlaps(batch.bounds[brushId], childBounds)) { continue; }
+
+				const Brush& brush = *batch.brushes[brushId];
+				Brush::Classification classification = Brush::Classification::Straddling;
+				if (childHeight == 0)
+				{
+					classification = brush.contains(childBounds.lower()) ? Brush::Classification::Inside : Brush::Classification::Outside;
+				}
+				else
+				{
+					classification = brush.classify(childBounds);
+				}
+
+				if (classification == Brush::Classification::Inside)
+				{
+					fillMaterial = batch.materials[brushId];
+					childBrushes.clear();
+				}
+				else if (classification == Brush::Classification::Straddling)
+				{
+					childBrushes.push_back(brushId);
+				}
+			}
+
+			if (fillMaterial < 0 && childBrushes.empty()) { continue; }
+
+			// If current node is a material then just propergate it. Otherwise get the true child.
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+
+			uint32 newChildNodeIndex = fillMaterial < 0 ? childNodeIndex : static_cast<uint32>(fillMaterial);
+
+			// Brushes which would only write the material which is already there can be skipped.
+			const bool unchanged = isMaterialNode(newChildNodeIndex) && std::all_of(childBrushes.begin(), childBrushes.end(),
+				[&](uint32 brushId) { return batch.materials[brushId] == newChildNodeIndex; });
+			if (!childBrushes.empty() && !unchanged)
+			{
+				newChildNodeIndex = fillBrushes(batch, newChildNodeIndex, childHeight, childLower, childBrushes);
+			}
+
+			// If the child has changed then we need to update the current node.
+			if (newChildNodeIndex != childNodeIndex)
+			{
+				const bool forceCopy = copyOnWrite() && nodeIndex == originalNodeIndex;
+				nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, forceCopy);
+			}
+		}
+
+		return nodeIndex;
+	}
+
+	void Volume::addVolume(const Volume& rhsVolume)
+	{
+		const int rootHeight = logBase2(VolumeSideLength);
+		int nodeHeight = rootHeight;
+
+		constexpr int32 rootLowerBound = std::numeric_limits<int32>::min();
+
+		uint32 newRootNodeIndex = addVolume(rhsVolume, rhsVolume.rootNodeIndex(), rootNodeIndex(), nodeHeight, rootLowerBound, rootLowerBound, rootLowerBound);
+		setRootNodeIndex(newRootNodeIndex);
+	}
+
+	// Fixme - This function can prbably be more efficient. Firstly through better early out when whole nodes are full/empty, and also
+	// if seperate volumes shared a common memory space it would be easier to copy node directly across (maybe in compressd space?).
+	uint32 Volume::addVolume(const Volume& rhsVolume, uint32 rhsNodeIndex, uint32 nodeIndex, int nodeHeight, int32 nodeLowerX, int32 nodeLowerY, int32 nodeLowerZ)
+	{
+		uint32_t childHeight = nodeHeight - 1;
+		//int tx = (x ^ (1UL << 31)); // Could precalculte these.
+		//int ty = (y ^ (1UL << 31));
+		//int tz = (z ^ (1UL << 31));
+
+		for (uint32 childZ = 0; childZ <= 1; childZ++)
+		{
+			for (uint32 childY = 0; childY <= 1; childY++)
+			{
+				for (uint32 childX = 0; childX <= 1; childX++)
+				{
+					//uint32_t childX = (tx >> childHeight) & 0x01;
+					//uint32_t childY = (ty >> childHeight) & 0x01;
+					//uint32_t childZ = (tz >> childHeight) & 0x01;
+					uint32_t childId = childZ << 2 | childY << 1 | childX;
+
+					uint32_t childSideLength = 1 << (childHeight);
+					int32 childLowerX = nodeLowerX + (childSideLength * childX);
+					int32 childLowerY = nodeLowerY + (childSideLength * childY);
+					int32 childLowerZ = nodeLowerZ + (childSideLength * childZ);
+
+					int32 childUpperX = childLowerX + (childSideLength - 1);
+					int32 childUpperY = childLowerY + (childSideLength - 1);
+					int32 childUpperZ = childLowerZ + (childSideLength - 1);
+
+					Box3f childBounds(Vector3f({ static_cast<float>(childLowerX), static_cast<float>(childLowerY), static_cast<float>(childLowerZ) } ), Vector3f({ static_cast<float>(childUpperX), static_cast<float>(childUpperY), static_cast<float>(childUpperZ) }));
+
+					/*if (!overlaps(brush.bounds(), childBounds))
+					{
+						continue;
+					}*/
+
+					/*bool allCornersInsideBrush = true;
+					if (!brush.contains(Vector3f(childLowerX, childLowerY, childLowerZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childLowerX, childLowerY, childUpperZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childLowerX, childUpperY, childLowerZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childLowerX, childUpperY, childUpperZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childUpperX, childLowerY, childLowerZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childUpperX, childLowerY, childUpperZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childUpperX, childUpperY, childLowerZ))) { allCornersInsideBrush = false; }
+					if (!brush.contains(Vector3f(childUpperX, childUpperY, childUpperZ))) { allCornersInsideBrush = false; }*/
+
+					const bool nodeIsMaterial = isMaterialNode(nodeIndex);
+					const bool rhsNodeIsMaterial = isMaterialNode(rhsNodeIndex);
+
+					// If current node is a material then just propergate it. Otherwise get the true child.
+					uint32_t childNodeIndex = nodeIsMaterial ? nodeIndex : mDAG[nodeIndex][childId];
+					uint32_t rhsChildNodeIndex = rhsNodeIsMaterial ? rhsNodeIndex : rhsVolume.mDAG[rhsNodeIndex][childId];
+
+					// If the child node is set to the desired material then the voxel is already set.
+					if (isMaterialNode(childNodeIndex) && isMaterialNode(rhsChildNodeIndex) && (childNodeIndex == rhsChildNodeIndex)) { continue; }
+
+					// Process children
+					uint32 newChildNodeIndex = childNodeIndex;
+
+					// We have to treat at least one material as empty space, otherwise we are just copying 
+					// every voxel from source to destination, which just result in a copy of the source. 
+					// Hard-code it to zero for now, but should think about how else it might be controlled.
+					MaterialId emptyMaterial = 0;
+					if (rhsChildNodeIndex != emptyMaterial)
+					{
+						if (isMaterialNode(rhsChildNodeIndex))
+						{
+							newChildNodeIndex = rhsChildNodeIndex;
+						}
+						else
+						{
+							newChildNodeIndex = addVolume(rhsVolume, rhsChildNodeIndex, childNodeIndex, nodeHeight - 1, childLowerX, childLowerY, childLowerZ);;
+						}
+					}
+
+					// If the child has changed then we need to update the current node.
+					if (childNodeIndex != newChildNodeIndex)
+					{
+						nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, copyOnWrite());
+					}
+				}
+			}
+		}
+
+		return nodeIndex;
+	}
+
+	// The combiner is tabulated, along with the cases where the result for a whole pair of nodes is already known.
+	struct Volume::CombineContext
+	{
+		static constexpr int16 Unknown = -1;
+
+		CombineContext(const std::function<MaterialId(MaterialId, MaterialId)>& combiner)
+		{
+			for (uint32 lhs = 0; lhs < MaterialCount; lhs++)
+			{
+				for (uint32 rhs = 0; rhs < MaterialCount; rhs++)
+				{
+					table[lhs * MaterialCount + rhs] = combiner(static_cast<MaterialId>(lhs), static_cast<MaterialId>(rhs));
+				}
+			}
+
+			sameConstant = combine(0, 0);
+			for (uint32 matId = 0; matId < MaterialCount; matId++)
+			{
+				rowConstant[matId] = combine(matId, 0);
+				columnConstant[matId] = combine(0, matId);
+				rowIsRhs[matId] = columnIsLhs[matId] = true;
+				for (uint32 other = 0; other < MaterialCount; other++)
+				{
+					if (int32(combine(matId, other)) != rowConstant[matId]) { rowConstant[matId] = Unknown; }
+					if (int32(combine(other, matId)) != columnConstant[matId]) { columnConstant[matId] = Unknown; }
+					if (combine(matId, other) != other) { rowIsRhs[matId] = false; }
+					if (combine(other, matId) != other) { columnIsLhs[matId] = false; }
+				}
+
+				if (combine(matId, matId) != matId) { sameIsUnchanged = false; }
+				if (combine(matId, matId) != combine(0, 0)) { sameConstant = Unknown; }
+			}
+		}
+
+		uint32 combine(uint32 lhs, uint32 rhs) const { return table[lhs * MaterialCount + rhs]; }
+
+		std::vector<MaterialId> table = std::vector<MaterialId>(MaterialCount * MaterialCount);
+
+		// For a material on the left (row) or right (column), whether the result is always the same material, or is
+		// always the material on the other side. Then the other side doesn't need to be visited (or copied).
+		std::array<int16, MaterialCount> rowConstant;
+		std::array<int16, MaterialCount> columnConstant;
+		std::array<bool, MaterialCount> rowIsRhs;
+		std::array<bool, MaterialCount> columnIsLhs;
+
+		// Whether combining a node with itself leaves it unchanged, or always gives the same material.
+		bool sameIsUnchanged = true;
+		int16 sameConstant = Unknown;
+
+		// Results for pairs of nodes, keyed by (lhs << 32 | rhs).
+		std::unordered_map<uint64, uint32> results;
+	};
+
+	// The copies made by importNode(), recorded by the stored nodes' identifiers with zero meaning 'not yet copied'.
+	// The identifiers are captured up front because importing a volume's nodes into itself (for pasteVolume())
+	// appends to its baked range, but the new nodes are never themselves imported.
+	struct Volume::ImportedNodes
+	{
+		ImportedNodes(const NodeDAG& nodes) : ids(nodes.storedNodeIds()), copies(nodes.storedNodeCount(), 0) {}
+
+		uint32& operator[](uint32 nodeIndex) { return copies[ids(nodeIndex)]; }
+
+		StoredNodeIds ids;
+		std::vector<uint32> copies;
+	};
+
+	void Volume::combineVolume(const Volume& rhsVolume, const std::function<MaterialId(MaterialId, MaterialId)>& combiner)
+	{
+		CombineContext context(combiner);
+
+		uint32 rhsRootNodeIndex = rhsVolume.rootNodeIndex();
+		if (&rhsVolume != this)
+		{
+			ImportedNodes importedNodes(rhsVolume.mDAG);
+			rhsRootNodeIndex = importNode(rhsVolume.mDAG, rhsRootNodeIndex, importedNodes);
+		}
+
+		const uint32 newRootNodeIndex = combineVolume(rootNodeIndex(), rhsRootNodeIndex, context);
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
+	}
+
+	void Volume::subtractVolume(const Volume& rhsVolume, MaterialId emptyMaterial)
+	{
+		combineVolume(rhsVolume, [=](MaterialId lhs, MaterialId rhs) { return rhs == emptyMaterial ? lhs : emptyMaterial; });
+	}
+
+	void Volume::intersectVolume(const Volume& rhsVolume, MaterialId emptyMaterial)
+	{
+		combineVolume(rhsVolume, [=](MaterialId lhs, MaterialId rhs) { return rhs == emptyMaterial ? emptyMaterial : lhs; });
+	}
+
+	// Copies a node of another volume (and everything beneath it) into this one. As in setRegion() the copies are
+	// inserted as shared nodes, so any which are identical to existing baked nodes are replaced by them. When the
+	// nodes are our own then baked nodes are already shared, and only edit nodes need copying.
+	uint32 Volume::importNode(const NodeDAG& rhsNodes, uint32 rhsNodeIndex, ImportedNodes& importedNodes)
+	{
+		if (isMaterialNode(rhsNodeIndex)) { return rhsNodeIndex; }
+		if (&rhsNodes == &mDAG && rhsNodeIndex < importedNodes.ids.bakedEnd) { return rhsNodeIndex; }
+
+		uint32& importedNode = importedNodes[rhsNodeIndex];
+		if (importedNode != 0) { return importedNode; }
+
+		Node node;
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			node[childId] = importNode(rhsNodes, rhsNodes[rhsNodeIndex][childId], importedNodes);
+		}
+
+		importedNode = mDAG.isPrunable(node) ? node[0] : mDAG.insertShared(node);
+		return importedNode;
+	}
+
+	uint32 Volume::combineVolume(uint32 nodeIndex, uint32 rhsNodeIndex, CombineContext& context)
+	{
+		if (isMaterialNode(nodeIndex))
+		{
+			if (isMaterialNode(rhsNodeIndex)) { return context.combine(nodeIndex, rhsNodeIndex); }
+			if (context.rowConstant[nodeIndex] != CombineContext::Unknown) { return context.rowConstant[nodeIndex]; }
+			if (context.rowIsRhs[nodeIndex]) { return rhsNodeIndex; }
+		}
+		else if (isMaterialNode(rhsNodeIndex))
+		{
+			if (context.columnConstant[rhsNodeIndex] != CombineContext::Unknown) { return context.columnConstant[rhsNodeIndex]; }
+			if (context.columnIsLhs[rhsNodeIndex]) { return nodeIndex; }
+		}
+		else if (nodeIndex == rhsNodeIndex)
+		{
+			if (context.sameIsUnchanged) { return nodeIndex; }
+			if (context.sameConstant != CombineContext::Unknown) { return context.sameConstant; }
+		}
+
+		// The other node is copied first in case it is also the node being updated (when combining with ourself).
+		const Node rhsNode = isMaterialNode(rhsNodeIndex) ? makeNode(rhsNodeIndex) : mDAG[rhsNodeIndex];
+
+		const uint64 key = uint64(nodeIndex) << 32 | rhsNodeIndex;
+
+		// Edit nodes are updated in the same way as for other edits. Unshared ones can only be reached via one path,
+		// so there is no point remembering the result, but with hash-consing they may be shared and then (as for baked
+		// nodes below) each pair is only combined once. A remembered result gains another parent, so is shared too.
+		if (mDAG.isEditNode(nodeIndex))
+		{
+			const bool shared = mDAG.isShared(nodeIndex);
+			if (shared)
+			{
+				if (auto iter = context.results.find(key); iter != context.results.end())
+				{
+					mDAG.markShared(iter->second);
+					return iter->second;
+				}
+			}
+
+			const uint32 originalNodeIndex = nodeIndex;
+			for (uint32 childId = 0; childId < 8; childId++)
+			{
+				const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+				const uint32 newChildNodeIndex = combineVolume(childNodeIndex, rhsNode[childId], context);
+				if (newChildNodeIndex != childNodeIndex)
+				{
+					// See setVoxels() - only the first change to a node needs to copy it.
+					const bool forceCopy = copyOnWrite() && nodeIndex == originalNodeIndex;
+					nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, forceCopy);
+				}
+			}
+
+			if (shared) { context.results.insert({ key, nodeIndex }); }
+			return nodeIndex;
+		}
+
+		// Otherwise the node is baked (or a material) and so might be reached via many paths. Everything beneath
+		// it is also baked, as are the copied nodes of the other volume, so the result can be a shared node too.
+		if (auto iter = context.results.find(key); iter != context.results.end()) { return iter->second; }
+
+		Node newNode;
+		bool changed = isMaterialNode(nodeIndex);
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+			newNode[childId] = combineVolume(childNodeIndex, rhsNode[childId], context);
+			changed = changed || newNode[childId] != childNodeIndex;
+		}
+
+		uint32 newNodeIndex = nodeIndex;
+		if (changed)
+		{
+			newNodeIndex = mDAG.isPrunable(newNode) ? newNode[0] : mDAG.insertShared(newNode);
+		}
+
+		context.results.insert({ key, newNodeIndex });
+		return newNodeIndex;
+	}
+
+	struct Volume::PasteContext
+	{
+		PasteContext(const Volume& sourceVolume, const Vector3i& offset, MaterialId transparentMaterial)
+			: sourceDAG(sourceVolume.mDAG), sourceRootNodeIndex(sourceVolume.rootNodeIndex())
+			, offset(static_cast<Vector3i64>(offset)), transparentMaterial(transparentMaterial)
+			, importedNodes(sourceVolume.mDAG)
+			, combineContext([=](MaterialId lhs, MaterialId rhs) { return rhs == transparentMaterial ? lhs : rhs; }) {}
+
+		const NodeDAG& sourceDAG;
+		uint32 sourceRootNodeIndex;
+		Vector3i64 offset;
+		MaterialId transparentMaterial;
+		ImportedNodes importedNodes;
+		CombineContext combineContext;
+	};
+
+	void Volume::pasteVolume(const Volume& sourceVolume, const Vector3i& offset, MaterialId transparentMaterial)
+	{
+		// When pasting from ourself the source nodes must survive until the paste is complete. This includes any
+		// created earlier in the current transaction.
+		mPreserveNodes = (&sourceVolume == this);
+		if (mPreserveNodes && mEditDepth > 0) { mDAG.beginFreshEditNodes(); }
+
+		PasteContext context(sourceVolume, offset, transparentMaterial);
+		const int rootHeight = logBase2(VolumeSideLength);
+		const Vector3i64 rootLower = Vector3i64::filled(std::numeric_limits<int32>::min());
+
+		// The root of the source lines up with our root only if the offset is zero. Otherwise we straddle it and
+		// space outside the source, which is transparent.
+		std::array<uint32, 8> sourceNodes;
+		for (uint32 cornerId = 0; cornerId < 8; cornerId++)
+		{
+			const bool inside = (offset.x() == 0 || (cornerId & 0x01) == (offset.x() > 0 ? 1 : 0)) &&
+				(offset.y() == 0 || ((cornerId >> 1) & 0x01) == (offset.y() > 0 ? 1 : 0)) &&
+				(offset.z() == 0 || ((cornerId >> 2) & 0x01) == (offset.z() > 0 ? 1 : 0));
+			sourceNodes[cornerId] = inside ? context.sourceRootNodeIndex : transparentMaterial;
+		}
+
+		const uint32 newRootNodeIndex = pasteVolume(rootNodeIndex(), rootHeight, rootLower, sourceNodes, context);
+
+		mPreserveNodes = false;
+
+		if (newRootNodeIndex != rootNodeIndex() || !mTrackEdits)
+		{
+			setRootNodeIndex(newRootNodeIndex);
+		}
+	}
+
+	// The node straddles up to eight nodes of the source which are the same size, and these are passed in with
+	// 'sourceNodes' indexed in the same way as children (duplicated along any axis on which the node is aligned).
+	uint32 Volume::pasteVolume(uint32 nodeIndex, int nodeHeight, const Vector3i64& nodeLower,
+		const std::array<uint32, 8>& sourceNodes, PasteContext& context)
+	{
+		if (std::all_of(sourceNodes.begin(), sourceNodes.end(), [&](uint32 index) { return index == context.transparentMaterial; }))
+		{
+			return nodeIndex;
+		}
+
+		if (isMaterialNode(sourceNodes[0]) &&
+			std::all_of(sourceNodes.begin(), sourceNodes.end(), [&](uint32 index) { return index == sourceNodes[0]; }))
+		{
+			return sourceNodes[0];
+		}
+
+		// Position relative to the lower corner of the source volume, which is where its nodes are aligned.
+		const Vector3i64 sourceRelative = nodeLower - context.offset - Vector3i64::filled(std::numeric_limits<int32>::min());
+		const int64 sideLength = INT64_C(1) << nodeHeight;
+		const Vector3i64 misalignment = {
+			sourceRelative.x() & (sideLength - 1), sourceRelative.y() & (sideLength - 1), sourceRelative.z() & (sideLength - 1) };
+
+		if (misalignment == Vector3i64::filled(0))
+		{
+			// The node lines up with a node of the source, so the two can be combined directly.
+			const uint32 importedNodeIndex = importNode(context.sourceDAG, sourceNodes[0], context.importedNodes);
+			return combineVolume(nodeIndex, importedNodeIndex, context.combineContext);
+		}
+
+		const int childHeight = nodeHeight - 1;
+		const int64 childSideLength = INT64_C(1) << childHeight;
+		const Vector3i64 alignedRelative = sourceRelative - misalignment;
+
+		// See setVoxels() - only the first change to a node needs to copy it.
+		const uint32 originalNodeIndex = nodeIndex;
+
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			const Vector3i64 childOffset = {
+				childSideLength * (childId & 0x01), childSideLength * ((childId >> 1) & 0x01), childSideLength * ((childId >> 2) & 0x01) };
+
+			// The source nodes straddled by the child are found among the children of those we straddle, which form
+			// a 4x4x4 grid. 'first' is the position in this grid of the lowest of them.
+			const Vector3i64 childRelative = sourceRelative + childOffset;
+			const Vector3i64 childMisalignment = {
+				childRelative.x() & (childSideLength - 1), childRelative.y() & (childSideLength - 1), childRelative.z() & (childSideLength - 1) };
+			const Vector3i64 first = (childRelative - childMisalignment - alignedRelative) / childSideLength;
+
+			std::array<uint32, 8> childSourceNodes;
+			for (uint32 cornerId = 0; cornerId < 8; cornerId++)
+			{
+				const uint32 gx = static_cast<uint32>(first.x()) + ((cornerId & 0x01) && childMisalignment.x() ? 1 : 0);
+				const uint32 gy = static_cast<uint32>(first.y()) + (((cornerId >> 1) & 0x01) && childMisalignment.y() ? 1 : 0);
+				const uint32 gz = static_cast<uint32>(first.z()) + (((cornerId >> 2) & 0x01) && childMisalignment.z() ? 1 : 0);
+				const uint32 sourceNodeIndex = sourceNodes[(gx >> 1) | ((gy >> 1) << 1) | ((gz >> 1) << 2)];
+				childSourceNodes[cornerId] = isMaterialNode(sourceNodeIndex) ? sourceNodeIndex :
+					context.sourceDAG[sourceNodeIndex][(gx & 0x01) | ((gy & 0x01) << 1) | ((gz & 0x01) << 2)];
+			}
+
+			const uint32 childNodeIndex = isMaterialNode(nodeIndex) ? nodeIndex : mDAG[nodeIndex][childId];
+			const uint32 newChildNodeIndex = pasteVolume(childNodeIndex, childHeight, nodeLower + childOffset, childSourceNodes, context);
+			if (newChildNodeIndex != childNodeIndex)
+			{
+				const bool forceCopy = copyOnWrite() && nodeIndex == originalNodeIndex;
+				nodeIndex = mDAG.updateNodeChild(nodeIndex, childId, newChildNodeIndex, forceCopy);
+			}
+		}
+
+		return nodeIndex;
+	}
+
+	MaterialId Volume::voxel(int32_t x, int32_t y, int32_t z) const
+	{
+		uint32_t nodeIndex = rootNodeIndex();
+		uint32_t height = logBase2(VolumeSideLength);
+
+		// FIXME - think whether we need the line below - I think we do for empty/solid volumes?
+		//if (mDAG.isMaterialNode(mRootNodeIndex)) { return static_cast<MaterialId>(mRootNodeIndex); }
+
+		while (height >= 1)
+		{			
+			// If we reach a full node then the requested voxel is occupied.
+			if (isMaterialNode(nodeIndex)) { return static_cast<MaterialId>(nodeIndex); }
+
+			// Otherwise find which subtree we are in.
+			// Optimization - Note that the code below requires shifting by a variable amount which can be slow.
+			// Alternatively I think we can simply shift x, y, and z by one bit per iteration, but this requires us
+			// to reverse the order of the bits at the start of this function. It would be a one-time cost for a
+			// faster loop, and testing is needed (on a real, large volume) to determine whether it is beneficial.
+			uint32_t childHeight = height - 1;
+			int tx = (x ^ (1UL << 31)); // Could precalculte these.
+			int ty = (y ^ (1UL << 31));
+			int tz = (z ^ (1UL << 31));
+			uint32_t childX = (tx >> childHeight) & 0x01;
+			uint32_t childY = (ty >> childHeight) & 0x01;
+			uint32_t childZ = (tz >> childHeight) & 0x01;
+			uint32_t childId = childZ << 2 | childY << 1 | childX;
+
+			// Prepare for next iteration.
+			nodeIndex = mDAG[nodeIndex][childId];
+			height--;
+		}
+
+		// We have reached a height of zero so the node must be a material node.
+		assert(height == 0 && isMaterialNode(nodeIndex));
+		return static_cast<MaterialId>(nodeIndex);
+	}
+
+	void Volume::setSnapshotsEnabled(bool snapshotsEnabled)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		if (!snapshotsEnabled && mSnapshotCount > 0)
+		{
+			log_warning("Cannot disable snapshots while any are held");
+			return;
+		}
+
+		mSnapshotsEnabled = snapshotsEnabled;
+		publishRootNodeIndex();
+	}
+
+	VolumeSnapshot Volume::snapshot() const
+	{
+		VolumeSnapshot result;
+
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		if (!mSnapshotsEnabled)
+		{
+			log_warning("Snapshots must be enabled before they can be taken");
+			return result;
+		}
+
+		mSnapshotCount++;
+		result.mVolume = this;
+		result.mRootNodeIndex = mPublishedRootNodeIndex;
+		result.mEpoch = mPublishedEpoch;
+		return result;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Private member functions
+	////////////////////////////////////////////////////////////////////////////////
+
+	// Since version 2 a volume file is an image of the node store, with node 'i' stored at byte offset 'i * sizeof(Node)'.
+	// The space which would hold the (never stored) material nodes holds the header instead, and the file is padded to a
+	// whole commit block so that the baked nodes can be mapped straight into the node store. Version 1 files had no
+	// header, just the root node index followed by the node count and the nodes. Compact files (version 3) start with
+	// the same header but it is not padded, and it is followed by the compressed nodes (see NodeDAG::writeCompact()).
+	struct FileHeader
+	{
+		char magic[8];
+		uint32 version;
+		uint32 nodeSize;
+		uint32 rootNodeIndex;
+		uint32 bakedNodeCount;
+	};
+
+	constexpr char FileMagic[8] = { 'C', 'U', 'B', 'I', 'Q', 'D', 'A', 'G' };
+	constexpr uint32 FileVersion = 2;
+	constexpr uint32 CompactFileVersion = 3;
+	constexpr uint64 FileHeaderSize = uint64(MaterialCount) * sizeof(Node);
+	static_assert(sizeof(FileHeader) <= FileHeaderSize);
+
+	bool Volume::load(const std::string& filename, bool mapFile)
+	{
+		// Loading replaces all of the nodes.
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		if (mSnapshotCount > 0)
+		{
+			log_warning("Cannot load a volume while snapshots of it are held");
+			return false;
+		}
+
+		std::ifstream file(filename, std::ios::binary);
+
+		// FIXME - What should we do for error handling in this function? Return codes or exceptions?
+		if(!file.is_open())
+		{
+			return false;
+		}
+
+		uint32 rootNodeIndex;
+		FileHeader header;
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (file && std::memcmp(header.magic, FileMagic, sizeof(FileMagic)) == 0)
+		{
+			if ((header.version != FileVersion && header.version != CompactFileVersion) || header.nodeSize != sizeof(Node))
+			{
+				log_warning("Unsupported volume file version");
+				return false;
+			}
+
+			if (header.version == CompactFileVersion)
+			{
+				// Compact files have to be decoded, so they can't be mapped. The root is always the first node written.
+				const bool validRoot = header.bakedNodeCount > 0 ?
+					header.rootNodeIndex == mDAG.bakedNodesBegin() : isMaterialNode(header.rootNodeIndex);
+				if (!validRoot || !mDAG.readCompact(file, header.bakedNodeCount))
+				{
+					log_warning("Volume file '" + filename + "' is corrupt");
+					return false;
+				}
+			}
+			else if (!(mapFile && mDAG.map(filename, header.bakedNodeCount)))
+			{
+				file.seekg(FileHeaderSize);
+				if (!mDAG.read(file, header.bakedNodeCount))
+				{
+					log_warning("Volume file '" + filename + "' is corrupt");
+					return false;
+				}
+			}
+
+			rootNodeIndex = header.rootNodeIndex;
+		}
+		else
+		{
+			// Version 1 file (the first four bytes were the root node index).
+			file.clear();
+			file.seekg(0);
+			file.read(reinterpret_cast<char*>(&rootNodeIndex), sizeof(rootNodeIndex));
+			if (!mDAG.read(file))
+			{
+				log_warning("Volume file '" + filename + "' is corrupt");
+				return false;
+			}
+
+			if (rootNodeIndex >= MaterialCount)
+			{
+				rootNodeIndex += mDAG.bakedNodesBegin() - MaterialCount;
+			}
+		}
+
+		setRootNodeIndex(rootNodeIndex);
+
+		return true;
+	}
+
+	void Volume::save(const std::string& filename, bool compact)
+	{
+		// The reachable nodes are copied into a separate store, where they are deduplicated as they are inserted
+		// (as by a bake). The live nodes are only read, so the undo history, snapshots and any node indices held
+		// elsewhere (e.g. by a renderer) are unaffected.
+		Volume copy;
+		ImportedNodes importedNodes(mDAG);
+		const uint32 copyRootNodeIndex = copy.importNode(mDAG, rootNodeIndex(), importedNodes);
+		NodeDAG& nodes = copy.mDAG;
+
+		// We write to a temporary file and then replace the destination, because the destination
+		// might be the file which this volume (or another) has mapped its nodes from. The mapping
+		// keeps the old file alive until it is no longer needed.
+		const std::string tempFilename = filename + ".tmp";
+		if (compact)
+		{
+			copy.writeCompactFile(tempFilename, copyRootNodeIndex);
+		}
+		else
+		{
+			FileHeader header;
+			std::memcpy(header.magic, FileMagic, sizeof(FileMagic));
+			header.version = FileVersion;
+			header.nodeSize = sizeof(Node);
+			header.rootNodeIndex = copyRootNodeIndex;
+			header.bakedNodeCount = nodes.bakedNodesEnd() - nodes.bakedNodesBegin();
+
+			std::ofstream file(tempFilename, std::ios::out | std::ios::binary);
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+			std::vector<char> padding(FileHeaderSize - sizeof(header), 0);
+			file.write(padding.data(), padding.size());
+
+			nodes.write(file);
+
+			const uint64 fileSize = roundUpToCommitBlock(nodes.bakedNodesEnd()) * sizeof(Node);
+			padding.resize(fileSize - nodes.bakedNodesEnd() * sizeof(Node));
+			file.write(padding.data(), padding.size());
+		}
+
+		std::error_code errorCode;
+		std::filesystem::rename(tempFilename, filename, errorCode);
+		if (errorCode)
+		{
+			log_warning("Failed to replace '" + filename + "' (" + errorCode.message() + ")");
+		}
+	}
+
+	// Each volume spills its undo steps into a directory of its own, so that volumes sharing a spill directory (in this
+	// process or another) can't overwrite each other's files. Returns an empty string if the directory can't be created.
+	std::string createSpillSubdirectory(const std::string& spillDirectory)
+	{
+#if defined(_WIN32)
+		const uint32 processId = GetCurrentProcessId();
+#else
+		const uint32 processId = getpid();
+#endif // _WIN32
+
+		std::random_device randomDevice;
+		for (int attempt = 0; attempt < 100; attempt++)
+		{
+			const std::filesystem::path path = std::filesystem::path(spillDirectory) /
+				("cubiquity_undo_" + std::to_string(processId) + "_" + std::to_string(randomDevice()));
+			std::error_code errorCode;
+			if (std::filesystem::create_directory(path, errorCode)) { return path.string(); }
+			if (errorCode) { break; } // Rather than the name being taken.
+		}
+		return std::string();
+	}
+
+	void Volume::enforceUndoLimits()
+	{
+		if (!mTrackEdits || mEditDepth > 0) { return; }
+
+		uint32 evictedStepCount = 0;
+		if (mMaxUndoSteps > 0 && mCurrentRoot > mMaxUndoSteps)
+		{
+			evictedStepCount = mCurrentRoot - mMaxUndoSteps;
+		}
+
+		const uint64 maxNodeCount = mMaxUndoBytes / sizeof(Node);
+		const bool checkBytes = mMaxUndoBytes > 0 && mDAG.storedNodeCount() > std::max<uint64>(maxNodeCount, mUndoCheckNodeCount);
+		if (checkBytes)
+		{
+			// Count the nodes needed by the current root and any redo steps, and then by each older step in turn
+			// (only counting nodes which are not needed by a newer one). Steps from the first one which takes us
+			// past the target are evicted, along with everything older.
+			std::vector<bool> marked(mDAG.storedNodeCount(), false);
+			uint64 nodeCount = 0;
+			for (uint32 index = mCurrentRoot; index < mRootNodeIndices.size(); index++)
+			{
+				nodeCount += mDAG.markReachableNodes(mRootNodeIndices[index], marked);
+			}
+
+			const uint64 targetNodeCount = maxNodeCount * 3 / 4;
+			uint32 keptStepCount = 0;
+			while (keptStepCount < mCurrentRoot)
+			{
+				nodeCount += mDAG.markReachableNodes(mRootNodeIndices[mCurrentRoot - 1 - keptStepCount], marked);
+				if (nodeCount > targetNodeCount) { break; }
+				keptStepCount++;
+			}
+
+			evictedStepCount = std::max(evictedStepCount, mCurrentRoot - keptStepCount);
+		}
+
+		if (evictedStepCount > 0 && !mUndoSpillDirectory.empty() && mSpillSubdirectory.empty())
+		{
+			mSpillSubdirectory = createSpillSubdirectory(mUndoSpillDirectory);
+			if (mSpillSubdirectory.empty())
+			{
+				log_warning("Failed to create a directory for undo steps in '" + mUndoSpillDirectory + "'");
+			}
+		}
+
+		for (uint32 index = 0; index < evictedStepCount && !mSpillSubdirectory.empty(); index++)
+		{
+			const std::string filename =
+				(std::filesystem::path(mSpillSubdirectory) / ("undo_" + std::to_string(mSpilledStepCounter++) + ".dag")).string();
+			if (writeCompactFile(filename, mRootNodeIndices[index]))
+			{
+				mSpilledSteps.push_back(filename);
+			}
+			else
+			{
+				// Older spilled steps would be cut off from the rest of the history, so they are dropped too.
+				log_warning("Failed to write undo step to '" + filename + "'");
+				discardSpilledSteps();
+			}
+		}
+
+		mRootNodeIndices.erase(mRootNodeIndices.begin(), mRootNodeIndices.begin() + evictedStepCount);
+		mCurrentRoot -= evictedStepCount;
+
+		// The evicted nodes are only reclaimed by a collection (and the check is repeated once the store has grown).
+		if (checkBytes)
+		{
+			collectGarbage();
+			mUndoCheckNodeCount = mDAG.storedNodeCount() + mDAG.storedNodeCount() / 4;
+		}
+	}
+
+	void Volume::reloadSpilledStep()
+	{
+		const std::string filename = mSpilledSteps.back();
+		mSpilledSteps.pop_back();
+
+		Volume spilledVolume;
+		if (spilledVolume.load(filename))
+		{
+			// As in combineVolume(), the nodes are shared with any identical ones which we already have.
+			ImportedNodes importedNodes(spilledVolume.mDAG);
+			const uint32 rootNodeIndex = importNode(spilledVolume.mDAG, spilledVolume.rootNodeIndex(), importedNodes);
+			mRootNodeIndices.insert(mRootNodeIndices.begin(), rootNodeIndex);
+			mCurrentRoot++;
+		}
+		else
+		{
+			log_warning("Failed to reload undo step from '" + filename + "'");
+			discardSpilledSteps();
+		}
+
+		std::error_code errorCode;
+		std::filesystem::remove(filename, errorCode);
+		if (mSpilledSteps.empty()) { discardSpilledSteps(); } // Also removes the directory.
+	}
+
+	void Volume::discardSpilledSteps()
+	{
+		for (const std::string& filename : mSpilledSteps)
+		{
+			std::error_code errorCode;
+			std::filesystem::remove(filename, errorCode);
+		}
+		mSpilledSteps.clear();
+
+		if (!mSpillSubdirectory.empty())
+		{
+			std::error_code errorCode;
+			std::filesystem::remove_all(mSpillSubdirectory, errorCode);
+			mSpillSubdirectory.clear();
+		}
+	}
+
+	// Writes the nodes reachable from the root as a compact file (see save()), which can be loaded as a volume.
+	bool Volume::writeCompactFile(const std::string& filename, uint32 rootNodeIndex)
+	{
+		std::ofstream file(filename, std::ios::out | std::ios::binary);
+		if (!file.is_open()) { return false; }
+
+		// The root is always the first node written, and the header is filled in once the node count is known.
+		FileHeader header;
+		std::memcpy(header.magic, FileMagic, sizeof(FileMagic));
+		header.version = CompactFileVersion;
+		header.nodeSize = sizeof(Node);
+		header.rootNodeIndex = isMaterialNode(rootNodeIndex) ? rootNodeIndex : mDAG.bakedNodesBegin();
+		header.bakedNodeCount = 0;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		header.bakedNodeCount = mDAG.writeCompact(file, rootNodeIndex);
+		file.seekp(0);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		return static_cast<bool>(file);
+	}
+
+	void Volume::runDeferredTasks()
+	{
+		// A full bake also does the work of an incremental one.
+		if (mBakeDeferred) { bake(); }
+		else if (mBakeEditsDeferred) { bakeEdits(); }
+
+		if (mCollectionDeferred) { collectGarbage(); }
+	}
+
+	void Volume::publishRootNodeIndex()
+	{
+		if (mSnapshotsEnabled && mEditDepth == 0)
+		{
+			std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+			mPublishedRootNodeIndex = rootNodeIndex();
+			mPublishedEpoch++;
+		}
+	}
+
+	void Volume::releaseSnapshot() const
+	{
+		std::lock_guard<std::recursive_mutex> lock(mSnapshotMutex);
+		assert(mSnapshotCount > 0);
+		mSnapshotCount--;
+	}
 
 	namespace Internals
 	{
@@ -760,4 +3387,257 @@ namespace Cubiquity
 			return volume.rootNodeIndex();
 		}
 	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Volume sampler
+	////////////////////////////////////////////////////////////////////////////////
+
+	void VolumeSampler::reset(const Volume& volume)
+	{
+		mDAG = &getNodes(volume);
+
+		const int rootHeight = logBase2(VolumeSideLength);
+		mNodeStack[rootHeight] = getRootNodeIndex(volume);
+		descend(rootHeight);
+	}
+
+	void VolumeSampler::descend(int height)
+	{
+		assert(mDAG != nullptr && "Sampler has not been given a volume");
+
+		uint32 nodeIndex = mNodeStack[height];
+		while (!isMaterialNode(nodeIndex))
+		{
+			assert(height > 0);
+			const int childHeight = height - 1;
+			const uint32 childX = (mUx >> childHeight) & 0x01;
+			const uint32 childY = (mUy >> childHeight) & 0x01;
+			const uint32 childZ = (mUz >> childHeight) & 0x01;
+			const uint32 childId = childZ << 2 | childY << 1 | childX;
+
+			nodeIndex = (*mDAG)[nodeIndex][childId];
+			mNodeStack[childHeight] = nodeIndex;
+			height = childHeight;
+		}
+
+		mHeight = height;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Sparse node store
+	////////////////////////////////////////////////////////////////////////////////
+
+	struct SparseNodeStore::BuildContext
+	{
+		BuildContext(const NodeDAG& dag, bool mergeMirroredNodes) : dag(dag), mergeMirroredNodes(mergeMirroredNodes) {}
+
+		const NodeDAG& dag;
+		bool mergeMirroredNodes;
+		std::unordered_map<uint32, uint32> newIndices;
+
+		// When merging mirrored nodes, this maps the chosen reflection of each node to where it is stored, and
+		// records which reflections leave each stored node unchanged (as a bit per reflection). A symmetric node
+		// can be referenced with more than one reflection, and 'normalize()' picks one so that equal subtrees
+		// always get equal indices (otherwise their parents would not be found to be equal).
+		std::unordered_map<Node, uint32> storedNodes;
+		std::unordered_map<uint32, uint8> symmetries;
+
+		uint32 normalize(uint32 nodeIndex) const
+		{
+			if (isMaterialNode(nodeIndex)) { return nodeIndex; }
+
+			const uint32 offset = nodeIndex & OffsetMask;
+			const uint32 mirror = nodeIndex >> MirrorShift;
+			const uint8 symmetry = symmetries.at(offset);
+			uint32 bestMirror = mirror;
+			for (uint32 reflection = 1; reflection < 8; reflection++)
+			{
+				if (symmetry & (1 << reflection)) { bestMirror = std::min(bestMirror, mirror ^ reflection); }
+			}
+			return offset | (bestMirror << MirrorShift);
+		}
+	};
+
+	uint32 SparseNodeStore::build(const NodeDAG& dag, uint32 rootNodeIndex, bool mergeMirroredNodes)
+	{
+		mData.assign(MaterialCount, 0);
+		if (isMaterialNode(rootNodeIndex)) { return rootNodeIndex; }
+
+		BuildContext context(dag, mergeMirroredNodes);
+		const uint32 newRootNodeIndex = append(rootNodeIndex, context);
+		mData.shrink_to_fit();
+		return newRootNodeIndex;
+	}
+
+	// Appends the node after its children (so the root ends up last), and returns its index.
+	uint32 SparseNodeStore::append(uint32 nodeIndex, BuildContext& context)
+	{
+		if (isMaterialNode(nodeIndex)) { return nodeIndex; }
+
+		auto iter = context.newIndices.find(nodeIndex);
+		if (iter != context.newIndices.end()) { return iter->second; }
+
+		Node node = context.dag[nodeIndex];
+		for (uint32& child : node)
+		{
+			child = append(child, context);
+		}
+
+		uint32 newIndex;
+		if (context.mergeMirroredNodes)
+		{
+			// Only one of the eight reflections of a node is stored, which is the smallest when compared
+			// as arrays of indices. Mirrored copies of a subtree pick the same one, because they have the
+			// same set of reflections. The node is then the stored one reflected back again.
+			std::array<Node, 8> reflectedNodes;
+			for (uint32 mirror = 0; mirror < 8; mirror++)
+			{
+				for (uint32 childId = 0; childId < 8; childId++)
+				{
+					const uint32 child = node[childId ^ mirror];
+					reflectedNodes[mirror][childId] = isMaterialNode(child) ? child : context.normalize(child ^ (mirror << MirrorShift));
+				}
+			}
+			const uint32 canonicalMirror = std::min_element(reflectedNodes.begin(), reflectedNodes.end()) - reflectedNodes.begin();
+			const Node& canonicalNode = reflectedNodes[canonicalMirror];
+
+			auto [storedNode, inserted] = context.storedNodes.try_emplace(canonicalNode, 0);
+			if (inserted)
+			{
+				storedNode->second = appendNode(canonicalNode);
+
+				uint8 symmetry = 0;
+				for (uint32 mirror = 0; mirror < 8; mirror++)
+				{
+					if (reflectedNodes[mirror] == canonicalNode) { symmetry |= 1 << (mirror ^ canonicalMirror); }
+				}
+				context.symmetries.emplace(storedNode->second, symmetry);
+			}
+			newIndex = context.normalize(storedNode->second | (canonicalMirror << MirrorShift));
+		}
+		else
+		{
+			newIndex = appendNode(node);
+		}
+
+		context.newIndices.emplace(nodeIndex, newIndex);
+		return newIndex;
+	}
+
+	uint32 SparseNodeStore::appendNode(const Node& node)
+	{
+		uint32 header = 0;
+		std::array<uint32, 8> children;
+		std::array<uint8, 8> materials;
+		uint32 childCount = 0;
+		uint32 materialCount = 0;
+		for (uint32 childId = 0; childId < 8; childId++)
+		{
+			if (!isMaterialNode(node[childId]))
+			{
+				header |= 1 << childId;
+				children[childCount++] = node[childId];
+			}
+			else if (node[childId] != 0)
+			{
+				header |= 1 << (childId + 8);
+				materials[materialCount++] = static_cast<uint8>(node[childId]);
+			}
+		}
+
+		if (materialCount > 0 && std::all_of(materials.begin(), materials.begin() + materialCount, [&](uint8 m) { return m == materials[0]; }))
+		{
+			header |= UniformMaterialFlag | (uint32(materials[0]) << 24);
+			materialCount = 0;
+		}
+
+		// Offsets share their index with the mirror bits, so a bigger store could not be addressed. This is
+		// checked in release builds too, as the indices would otherwise silently wrap round.
+		if (mData.size() > OffsetMask)
+		{
+			log_warning("Too many nodes for a sparse node store!");
+			throw std::length_error("Too many nodes for a sparse node store");
+		}
+
+		const uint32 newIndex = static_cast<uint32>(mData.size());
+		mData.push_back(header);
+		mData.insert(mData.end(), children.begin(), children.begin() + childCount);
+		const size_t materialsBegin = mData.size();
+		mData.resize(materialsBegin + (materialCount + 3) / 4, 0);
+		std::memcpy(mData.data() + materialsBegin, materials.data(), materialCount);
+
+		return newIndex;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Sparse volume
+	////////////////////////////////////////////////////////////////////////////////
+
+	SparseVolume::SparseVolume(const Volume& volume, bool mergeMirroredNodes)
+	{
+		mRootNodeIndex = mNodes.build(getNodes(volume), getRootNodeIndex(volume), mergeMirroredNodes);
+	}
+
+	MaterialId SparseVolume::voxel(int32 x, int32 y, int32 z) const
+	{
+		const uint32 ux = static_cast<uint32>(x) ^ (1UL << 31);
+		const uint32 uy = static_cast<uint32>(y) ^ (1UL << 31);
+		const uint32 uz = static_cast<uint32>(z) ^ (1UL << 31);
+
+		uint32 nodeIndex = mRootNodeIndex;
+		for (int childHeight = logBase2(VolumeSideLength) - 1; !isMaterialNode(nodeIndex); childHeight--)
+		{
+			const uint32 childX = (ux >> childHeight) & 0x01;
+			const uint32 childY = (uy >> childHeight) & 0x01;
+			const uint32 childZ = (uz >> childHeight) & 0x01;
+			nodeIndex = mNodes[nodeIndex][childZ << 2 | childY << 1 | childX];
+		}
+
+		return static_cast<MaterialId>(nodeIndex);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Volume snapshot
+	////////////////////////////////////////////////////////////////////////////////
+
+	VolumeSnapshot& VolumeSnapshot::operator=(VolumeSnapshot&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			mVolume = other.mVolume;
+			mRootNodeIndex = other.mRootNodeIndex;
+			mEpoch = other.mEpoch;
+			other.mVolume = nullptr;
+		}
+		return *this;
+	}
+
+	void VolumeSnapshot::release()
+	{
+		if (mVolume)
+		{
+			mVolume->releaseSnapshot();
+			mVolume = nullptr;
+		}
+	}
+
+	MaterialId VolumeSnapshot::voxel(int32 x, int32 y, int32 z) const
+	{
+		const uint32 ux = static_cast<uint32>(x) ^ (1u << 31);
+		const uint32 uy = static_cast<uint32>(y) ^ (1u << 31);
+		const uint32 uz = static_cast<uint32>(z) ^ (1u << 31);
+
+		const NodeDAG& nodes = mVolume->mDAG;
+		uint32 nodeIndex = mRootNodeIndex;
+		for (int childHeight = logBase2(VolumeSideLength) - 1; !isMaterialNode(nodeIndex); childHeight--)
+		{
+			const uint32 childX = (ux >> childHeight) & 0x01;
+			const uint32 childY = (uy >> childHeight) & 0x01;
+			const uint32 childZ = (uz >> childHeight) & 0x01;
+			nodeIndex = nodes[nodeIndex][childZ << 2 | childY << 1 | childX];
+		}
+
+		return static_cast<MaterialId>(nodeIndex);
+	}
 }
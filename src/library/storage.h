@@ -16,7 +16,14 @@
 #include "base.h"
 #include "geometry.h"
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -35,21 +42,176 @@ namespace Cubiquity
 
 		typedef std::array<uint32_t, 8> Node;
 
-		class NodeStore
+		// Hashes a node a pair of children at a time, in two independent lanes so that the multiplies can overlap.
+		// This is several times faster than MurmurHash3 on the whole node, and all bits of the result are well mixed.
+		inline uint64 hashNode(const Node& node)
+		{
+			constexpr uint64 Multiplier = UINT64_C(0x9E3779B97F4A7C15);
+			uint64 lanes[2] = { UINT64_C(0xBF58476D1CE4E5B9), UINT64_C(0x94D049BB133111EB) };
+			for (int i = 0; i < 8; i += 2)
+			{
+				uint64& lane = lanes[(i >> 1) & 1];
+				lane = (lane ^ (node[i] | uint64(node[i + 1]) << 32)) * Multiplier;
+				lane ^= lane >> 29;
+			}
+
+			uint64 hash = (lanes[0] ^ (lanes[1] >> 32 | lanes[1] << 32)) * Multiplier;
+			return hash ^ (hash >> 32);
+		}
+	}
+}
+
+// Nodes are used as keys in hash maps (including as members below), so the hash must be declared up-front.
+namespace std
+{
+	template<>
+	struct hash<Cubiquity::Internals::Node>
+	{
+		std::size_t operator()(const Cubiquity::Internals::Node& node) const noexcept
+		{
+			return static_cast<std::size_t>(Cubiquity::Internals::hashNode(node));
+		}
+	};
+}
+
+namespace Cubiquity
+{
+	namespace Internals
+	{
+		// The node store is a flat array of nodes which is addressed by index. The full capacity is reserved as
+		// address space up-front (so that indices and pointers into it remain stable) but physical memory is only
+		// committed as nodes are written. Nodes are written from both ends (baked nodes grow upwards from the
+		// bottom and edit nodes grow downwards from the top) so we track a committed range at each end, and the
+		// uncommitted gap between them can be returned to the OS via shrink() (e.g. after baking).
+		class NodeStore : private NonCopyable
 		{
 		public:
-			NodeStore() { mData = new Node[size()]; }
-			~NodeStore() { delete[] mData; }
+			// Default is 2^31 nodes (64 GiB of address space, but none of it is committed until used).
+			static constexpr uint32 DefaultCapacity = UINT32_C(0x80000000);
+
+			NodeStore(uint32 capacity = DefaultCapacity);
+			~NodeStore();
 
 			const Node& operator[](uint32_t index) const { return mData[index]; }
 
 			void setNode(uint32 index, const Internals::Node& node);
 			void setNodeChild(uint32 nodeIndex, uint32 childId, uint32 newChildIndex);
 			Node* data() const { return mData; }
-			uint32 size() const { return 0x3FFFFFF; }
-			
+			uint32 size() const { return mCapacity; }
+
+			void commitBelow(uint32 index);
+			void shrink(uint32 lowerEnd, uint32 upperBegin);
+			uint64 committedBytes() const;
+
+			bool map(const std::string& filename, uint32 beginIndex, uint32 endIndex);
+
 		private:
+			void commit(uint32 index);
+
 			Node* mData = nullptr;
+			uint32 mCapacity = 0;
+			uint32 mLowerCommitEnd = 0; // Nodes in [0, mLowerCommitEnd) are committed
+			uint32 mUpperCommitBegin = 0; // Nodes in [mUpperCommitBegin, mCapacity) are committed
+		};
+
+		// Statistics about the nodes which are reachable from a root, as gathered by NodeDAG::computeStatistics().
+		struct DAGStatistics
+		{
+			uint32 uniqueNodeCount = 0; // Distinct node indices (identical nodes at different indices count twice).
+			uint32 bakedNodeCount = 0;
+			uint32 editNodeCount = 0;
+
+			// Unique nodes by height above the voxels (the root is at 32). A node which is shared between levels is
+			// counted at the first level it is found at.
+			std::array<uint32, 33> nodesPerLevel = {};
+
+			// Each child which is a material, counted once per unique node.
+			std::array<uint64, MaterialCount> materialLeafCounts = {};
+
+			// References to nodes (including from the root index), so 'nodeReferenceCount / uniqueNodeCount' is the
+			// average number of parents per node. This is one for a tree and grows as more subtrees are shared.
+			uint64 nodeReferenceCount = 0;
+			float sharingRatio() const { return uniqueNodeCount > 0 ? float(nodeReferenceCount) / uniqueNodeCount : 0.0f; }
+
+			uint64 reachableBytes = 0; // Size of the reachable nodes.
+			uint32 storedNodeCount = 0; // Nodes in the store, whether or not they are reachable.
+			uint64 committedBytes = 0;
+		};
+
+		// An open-addressing hash map from nodes to indices, used to deduplicate nodes when baking. Unlike a
+		// std::unordered_map it makes no allocation per entry, and each slot also keeps (part of) the node's hash so
+		// that most non-matching slots are skipped without comparing the nodes. Entries can't be removed.
+		class NodeMap
+		{
+		public:
+			NodeMap(uint32 expectedCount = 0) { if (expectedCount > 0) { reserve(expectedCount); } }
+
+			// Makes room for 'count' entries in total without rehashing.
+			void reserve(uint32 count);
+			void clear();
+			uint32 size() const { return mSize; }
+
+			// Returns the value for the node, or nullptr if it is not present.
+			const uint32* find(const Node& node) const
+			{
+				if (mSize == 0) { return nullptr; }
+
+				const uint64 hash = hashNode(node);
+				for (uint64 slot = hash & mMask; ; slot = (slot + 1) & mMask)
+				{
+					const Entry& entry = mEntries[slot];
+					if (entry.tag == EmptyTag) { return nullptr; }
+					if (entry.tag == tag(hash) && entry.node == node) { return &entry.value; }
+				}
+			}
+
+			// Returns the value for the node, first inserting it with the given value if it is not already present.
+			// The second member of the result is true if it was inserted.
+			std::pair<uint32, bool> insert(const Node& node, uint32 value)
+			{
+				if (uint64(mSize + 1) * 3 > mEntries.size() * 2) { reserve(mSize + 1); }
+
+				const uint64 hash = hashNode(node);
+				for (uint64 slot = hash & mMask; ; slot = (slot + 1) & mMask)
+				{
+					Entry& entry = mEntries[slot];
+					if (entry.tag == EmptyTag)
+					{
+						entry = { node, tag(hash), value };
+						mSize++;
+						return { value, true };
+					}
+					if (entry.tag == tag(hash) && entry.node == node) { return { entry.value, false }; }
+				}
+			}
+
+		private:
+			static constexpr uint32 EmptyTag = 0;
+
+			// The top half of the hash, as the bottom half already chose the slot. It is never empty.
+			static uint32 tag(uint64 hash) { return static_cast<uint32>(hash >> 32) | 1; }
+
+			struct Entry
+			{
+				Node node;
+				uint32 tag;
+				uint32 value;
+			};
+
+			std::vector<Entry> mEntries;
+			uint64 mMask = 0;
+			uint32 mSize = 0;
+		};
+
+		// Gives the stored nodes contiguous identifiers (baked then edit), for indexing per-node arrays such as the marks
+		// of a traversal. The ranges are captured when it is created, as adding nodes would change the identifiers.
+		struct StoredNodeIds
+		{
+			uint32 operator()(uint32 index) const { return index < bakedEnd ? index - bakedBegin : (bakedEnd - bakedBegin) + (index - editBegin); }
+
+			uint32 bakedBegin;
+			uint32 bakedEnd;
+			uint32 editBegin;
 		};
 
 		class NodeDAG
@@ -70,34 +232,185 @@ namespace Cubiquity
 			NodeStore& nodes() { return mNodes; }
 			const NodeStore& nodes() const { return mNodes; }
 
-			uint32 countNodes(uint32 startNodeIndex) const;
-			void countNodes(uint32 startNodeIndex, std::unordered_set<uint32>& usedIndices) const;
+			uint32 countNodes(uint32 startNodeIndex) const { return computeStatistics(startNodeIndex).uniqueNodeCount; }
+
+			// Visits each reachable node once, marking them in a bitmap of the stored nodes, so the cost is linear in
+			// the number of reachable nodes. It is cheap enough to use for telemetry.
+			DAGStatistics computeStatistics(uint32 rootNodeIndex) const;
+
+			// Marks the nodes reachable from the root which were not already marked, in a bitmap of the stored nodes
+			// (as for computeStatistics()), and returns how many there were. Used to measure what each root adds.
+			uint32 markReachableNodes(uint32 rootNodeIndex, std::vector<bool>& marked) const;
 
-			void read(std::ifstream& file);
+			bool read(std::ifstream& file);
+			bool read(std::ifstream& file, uint32 nodeCount);
 			void write(std::ofstream& file);
+			bool readCompact(std::ifstream& file, uint32 nodeCount);
+			uint32 writeCompact(std::ofstream& file, uint32 rootNodeIndex);
+			bool map(const std::string& filename, uint32 nodeCount);
 
 
 			bool isPrunable(const Node& node) const;
 
+			void setHashConsing(bool hashConsing) { mHashConsing = hashConsing; }
+			bool hashConsing() const { return mHashConsing; }
+			bool isShared(uint32 index) const;
+			void markShared(uint32 index);
+
 			uint32 insert(const Node& node);
+			uint32 insertShared(const Node& node);
+			void recycleEditNodes();
 			uint32 updateNodeChild(uint32 nodeIndex, uint32 childId, uint32 newChildNodeIndex, bool forceCopy);
 
+			// Edit nodes created after beginFreshEditNodes() are 'fresh', and updateNodeChild() modifies them in-place
+			// even if a copy is requested. The caller must ensure they can't be referenced from anywhere which relies
+			// on the copy (e.g. the undo history). Calling it again makes the existing edit nodes stale.
+			void beginFreshEditNodes() { mFreshEditNodesEnd = mEditNodesBegin; }
+			void endFreshEditNodes() { mFreshEditNodesEnd = 0; }
+			bool isFreshEditNode(uint32 index) const { return isEditNode(index) && index < mFreshEditNodesEnd; }
+
 			void merge(uint32 index);
-			uint32 mergeNode(uint32 nodeIndex, std::unordered_map<Internals::Node, uint32>& map, uint32& nextSpace);
+			void parallelMerge(uint32 index);
+			uint32 mergeNode(uint32 nodeIndex, NodeMap& map, uint32& nextSpace);
+
+			bool mergeEdits(std::vector<uint32>& rootIndices);
+
+			uint32 storedNodeCount() const { return (bakedNodesEnd() - bakedNodesBegin()) + (editNodesEnd() - editNodesBegin()); }
+			StoredNodeIds storedNodeIds() const { return { bakedNodesBegin(), bakedNodesEnd(), editNodesBegin() }; }
+			uint32 collectGarbage(std::vector<uint32>& rootIndices);
 
 		private:
+			void updateBakedIndex();
+			void resetBakedIndex();
+
+			uint32 findNode(const Node& node);
+			uint32 hashConsedInsert(const Node& node);
+			uint32 hashConsedUpdate(uint32 nodeIndex, uint32 childId, uint32 newChildNodeIndex);
+			void freeEditNode(uint32 index);
+			void resetEditIndex();
+
 			NodeStore mNodes;
 			uint32 mBakedNodesEnd = MaterialCount;
 			uint32 mEditNodesBegin = 0;
+
+			// Edit nodes grow downwards, so those below this were created since beginFreshEditNodes(). Bakes and merges
+			// only ever move the start of the edit nodes upwards, so existing nodes can't become fresh (though fresh
+			// nodes can become stale, which is harmless).
+			uint32 mFreshEditNodesEnd = 0;
+
+			// Maps the content of each baked node in [bakedNodesBegin(), mIndexedNodesEnd) to its index, so that
+			// incremental merges can find existing baked nodes. It is built lazily and kept up-to-date as nodes are
+			// appended, but is reset whenever the baked range is rewritten (as baked nodes are never modified).
+			NodeMap mBakedIndex;
+			uint32 mIndexedNodesEnd = MaterialCount;
+
+			// In hash-consing mode every edit node is also indexed by content (so the edit nodes are all unique), and
+			// an edit node can only be modified in-place if it is not shared, i.e. it is reachable via only one path.
+			// Sharing is tracked conservatively (a node is never 'unshared') and is stored per edit node, starting
+			// from the top. Edit nodes which become redundant are released, but their parents still point at them
+			// until the current operation completes, so they are only moved to the free list by recycleEditNodes().
+			bool mHashConsing = false;
+			std::unordered_map<Node, uint32> mEditIndex;
+			std::vector<bool> mSharedEditNodes;
+			std::vector<uint32> mReleasedEditNodes;
+			std::vector<uint32> mFreeEditNodes;
+		};
+
+		// A read-only alternative to the NodeStore in which each node stores only its non-trivial children, as in
+		// the original sparse voxel DAG paper. A node starts with a header word, which has a bit for each child which
+		// is a node (bits 0-7) and for each child which is a non-empty material (bits 8-15). This is followed by a word
+		// for each child node and then by the materials packed four per word. Empty children take no space, and if the
+		// material children all have the same material then it is kept in the top byte of the header (with bit 16 set).
+		// A node index is the offset of the node's header, and the first MaterialCount words are unused so that node
+		// indices never look like materials. It provides the same 'nodes[nodeIndex][childId]' syntax as a NodeStore.
+		//
+		// The store can optionally also merge subtrees which are mirror images of each other (as in the symmetry-aware
+		// SSVDAG). The top three bits of a node index then say along which axes (x, y, z for bits 29, 30, 31) the stored
+		// node has to be reflected to give the subtree, and the same bits in a stored child index are combined with those
+		// of the parent. Reflecting a node along an axis just swaps its children along that axis (and reflects each of
+		// them), so all of this is handled when looking up a child and traversal code needs no special handling.
+		class SparseNodeStore
+		{
+		public:
+			static constexpr uint32 UniformMaterialFlag = 1 << 16;
+			static constexpr uint32 MirrorShift = 29;
+			static constexpr uint32 OffsetMask = (1u << MirrorShift) - 1;
+
+			// A table is faster than std::popcount() when the target doesn't have a popcount instruction.
+			static constexpr std::array<uint8, 256> BitCounts = []()
+			{
+				std::array<uint8, 256> bitCounts = {};
+				for (uint32 i = 0; i < 256; i++) { bitCounts[i] = static_cast<uint8>(std::popcount(i)); }
+				return bitCounts;
+			}();
+
+			class NodeRef
+			{
+			public:
+				uint32 operator[](uint32 childId) const
+				{
+					childId ^= mMirror;
+					const uint32 header = *mNode;
+					const uint32 childBit = 1u << childId;
+					const uint32 lowerChildren = childBit - 1;
+					if (header & childBit)
+					{
+						return mNode[1 + BitCounts[header & lowerChildren]] ^ (mMirror << MirrorShift);
+					}
+					if (header & (childBit << 8))
+					{
+						if (header & UniformMaterialFlag) { return header >> 24; }
+						const uint8* materials = reinterpret_cast<const uint8*>(mNode + 1 + BitCounts[header & 0xff]);
+						return materials[BitCounts[(header >> 8) & lowerChildren]];
+					}
+					return 0;
+				}
+
+				const uint32* mNode;
+				uint32 mMirror;
+			};
+
+			NodeRef operator[](uint32 index) const { return { &mData[index & OffsetMask], index >> MirrorShift }; }
+
+			// Replaces the contents with the nodes reachable from 'rootNodeIndex', and returns the new root.
+			uint32 build(const NodeDAG& dag, uint32 rootNodeIndex, bool mergeMirroredNodes = false);
+
+			uint64 byteCount() const { return mData.size() * sizeof(uint32); }
+
+		private:
+			struct BuildContext;
+			uint32 append(uint32 nodeIndex, BuildContext& context);
+			uint32 appendNode(const Node& node);
+
+			std::vector<uint32> mData;
 		};
 	}
 
+	// Brushes describe a shape by a signed distance (negative inside), which only needs to be a lower bound on the
+	// true distance to the surface. This lets a whole box be classified from its centre, so that edits only need to
+	// descend along the surface of the brush. Brushes with a cheaper or tighter test can override classify().
 	class Brush
 	{
 	public:
-		virtual bool contains(const Vector3f& point) const = 0;
+		enum class Classification { Outside, Straddling, Inside };
+
+		virtual ~Brush() = default;
+
+		virtual float distance(const Vector3f& point) const = 0;
 		virtual Box3f bounds() const = 0;
 
+		// Away from the surface this must agree with distance(), but points exactly on it can go either way.
+		virtual bool contains(const Vector3f& point) const { return distance(point) < 0.0f; }
+
+		virtual Classification classify(const Box3f& box) const
+		{
+			const float radius = length(box.upper() - box.lower()) * 0.5f;
+			const float centreDistance = distance(box.centre());
+			if (centreDistance > radius) { return Classification::Outside; }
+			if (centreDistance < -radius) { return Classification::Inside; }
+			return Classification::Straddling;
+		}
+
 		Vector3f mCentre;
 	};
 
@@ -105,13 +418,18 @@ namespace Cubiquity
 	{
 	public:
 		SphereBrush(const Vector3f& centre, float radius)
-			:mRadiusSquared(radius * radius)
+			:mRadius(radius), mRadiusSquared(radius * radius)
 		{
 			mCentre = centre;
 			Vector3f radiusAsVec = Vector3f::filled(radius);
 			mBounds = Box3f(centre - radiusAsVec, centre + radiusAsVec);
 		}
 
+		float distance(const Vector3f& point) const
+		{
+			return length(point - mCentre) - mRadius;
+		}
+
 		bool contains(const Vector3f& point) const
 		{
 			// WARNING - Dubious precision here - these values can be huge!
@@ -119,11 +437,31 @@ namespace Cubiquity
 			float distY = point.y() - mCentre.y();
 			float distZ = point.z() - mCentre.z();
 
-			int64 distSq = (distX * distX + distY * distY + distZ * distZ);
+			float distSq = (distX * distX + distY * distY + distZ * distZ);
 
 			return distSq < mRadiusSquared;
 		}
 
+		// Exact, using the nearest and furthest points of the box.
+		Classification classify(const Box3f& box) const
+		{
+			float nearestSq = 0.0f;
+			float furthestSq = 0.0f;
+			for (int i = 0; i < 3; i++)
+			{
+				const float toLower = box.lower()[i] - mCentre[i];
+				const float toUpper = box.upper()[i] - mCentre[i];
+				const float nearest = toLower > 0.0f ? toLower : (toUpper < 0.0f ? toUpper : 0.0f);
+				const float furthest = std::max(std::abs(toLower), std::abs(toUpper));
+				nearestSq += nearest * nearest;
+				furthestSq += furthest * furthest;
+			}
+
+			if (nearestSq >= mRadiusSquared) { return Classification::Outside; }
+			if (furthestSq < mRadiusSquared) { return Classification::Inside; }
+			return Classification::Straddling;
+		}
+
 		Box3f bounds() const
 		{
 			return mBounds;
@@ -131,10 +469,102 @@ namespace Cubiquity
 
 	public:
 		
+		float mRadius;
 		float mRadiusSquared;
 		Box3f mBounds;
 	};
 
+	// Fills the (closed) box, which is axis-aligned.
+	class BoxBrush : public Brush
+	{
+	public:
+		BoxBrush(const Box3f& box)
+			:mBox(box)
+		{
+			mCentre = box.centre();
+		}
+
+		float distance(const Vector3f& point) const
+		{
+			const Vector3f halfExtents = (mBox.upper() - mBox.lower()) * 0.5f;
+			const Vector3f q = abs3(point - mCentre) - halfExtents;
+			const float outside = length(max(q, Vector3f::filled(0.0f)));
+			const float inside = std::min(std::max(q.x(), std::max(q.y(), q.z())), 0.0f);
+			return outside + inside;
+		}
+
+		bool contains(const Vector3f& point) const { return mBox.contains(point); }
+
+		Classification classify(const Box3f& box) const
+		{
+			if (!overlaps(mBox, box)) { return Classification::Outside; }
+			if (mBox.contains(box)) { return Classification::Inside; }
+			return Classification::Straddling;
+		}
+
+		Box3f bounds() const { return mBox; }
+
+		Box3f mBox;
+	};
+
+	// Fills everything within 'radius' of the line segment from 'start' to 'end'.
+	class CapsuleBrush : public Brush
+	{
+	public:
+		CapsuleBrush(const Vector3f& start, const Vector3f& end, float radius)
+			:mStart(start), mEnd(end), mRadius(radius)
+		{
+			mCentre = (start + end) * 0.5f;
+			mBounds = Box3f(min(start, end), max(start, end));
+			mBounds.dilate(radius);
+		}
+
+		float distance(const Vector3f& point) const
+		{
+			const Vector3f axis = mEnd - mStart;
+			const float axisLengthSq = dot(axis, axis);
+			const float t = axisLengthSq > 0.0f ? std::clamp(dot(point - mStart, axis) / axisLengthSq, 0.0f, 1.0f) : 0.0f;
+			return length(point - (mStart + axis * t)) - mRadius;
+		}
+
+		Box3f bounds() const { return mBounds; }
+
+		Vector3f mStart;
+		Vector3f mEnd;
+		float mRadius;
+		Box3f mBounds;
+	};
+
+	// A brush defined by an arbitrary function, which must return a signed distance bound (i.e. it must not change
+	// faster than the distance from the point does). The bounds must enclose every point with a negative distance.
+	class SdfBrush : public Brush
+	{
+	public:
+		SdfBrush(const std::function<float(const Vector3f&)>& sdf, const Box3f& bounds)
+			:mSdf(sdf), mBounds(bounds)
+		{
+			mCentre = bounds.centre();
+		}
+
+		float distance(const Vector3f& point) const { return mSdf(point); }
+		Box3f bounds() const { return mBounds; }
+
+		std::function<float(const Vector3f&)> mSdf;
+		Box3f mBounds;
+	};
+
+	// Supplies the voxels for Volume::generate(). Both functions are called from multiple threads at once.
+	class Generator
+	{
+	public:
+		virtual MaterialId voxel(int32 x, int32 y, int32 z) const = 0;
+
+		// Optionally reports that every voxel in 'bounds' has the same material, so that they do not need to be evaluated
+		// individually (e.g. by using an interval or bounds test). It must never guess, but it can give up on any node
+		// which it finds hard to classify.
+		virtual std::optional<MaterialId> classify(const Box3i& /*bounds*/) const { return std::nullopt; }
+	};
+
 	class Volume;
 	namespace Internals
 	{
@@ -150,12 +580,15 @@ namespace Cubiquity
 		const uint32 getRootNodeIndex(const Volume& volume);
 	}
 
+	class VolumeSnapshot;
+
 	class Volume
 	{
 	public:
 
 		Volume();
-		Volume(const std::string& filename);
+		Volume(const std::string& filename, bool mapFile = false);
+		~Volume();
 
 		void fill(MaterialId matId);
 
@@ -166,6 +599,14 @@ namespace Cubiquity
 		bool undo();
 		bool redo();
 
+		// Groups the edits made until the matching commitEdit() into a single transaction. Nodes created within the
+		// transaction can't be referenced by the undo history or a snapshot, so further edits modify them in-place
+		// rather than copying them again. The result is a single undo step, which is only published to snapshots on
+		// commit. Transactions can be nested, and only the outermost commit takes effect. Don't undo() or redo() within
+		// a transaction.
+		void beginEdit();
+		void commitEdit();
+
 		void setVoxelRecursive(int32_t x, int32_t y, int32_t z, MaterialId matId);
 		uint32 setVoxelRecursive(uint32 ux, uint32 uy, uint32 uz, MaterialId matId, uint32 nodeIndex, int nodeHeight);
 
@@ -173,25 +614,158 @@ namespace Cubiquity
 		void setVoxel(const ArrayType& position, MaterialId matId);
 		void setVoxel(int32_t x, int32_t y, int32_t z, MaterialId matId);
 
+		// Sets many voxels as a single edit (and hence a single undo step). The writes are sorted into Morton order so
+		// that consecutive ones share most of their path through the tree, and that path is then only traversed once.
+		// If a position is written more than once then the last write wins, as with repeated calls to setVoxel().
+		void setVoxels(std::span<const Vector3i> positions, std::span<const MaterialId> materials);
+
+		// As above, but write 'i' sets a run of 'runLengths[i]' voxels starting at 'runStarts[i]' and extending along x.
+		void setVoxels(std::span<const Vector3i> runStarts, std::span<const uint32> runLengths, std::span<const MaterialId> materials);
+
+		// Copies a dense array of materials into the given region. The material for voxel (x,y,z) is read from 'data' at
+		// offset (x - lower.x) * strides.x + (y - lower.y) * strides.y + (z - lower.z) * strides.z. Each node which lies
+		// entirely inside the region is built bottom-up, with uniform nodes pruned and the rest deduplicated as they are
+		// created, and is then spliced into the volume. Aligning the region to large power-of-two nodes is fastest.
+		void setRegion(const Box3i& region, const MaterialId* data, const Vector3i64& strides);
+
+		// Copies the materials in the region into a dense array with the same layout as for setRegion() (or by default
+		// with x varying fastest, then y, then z). Only nodes which overlap the region are visited, and each uniform
+		// node is written a row at a time. If 'parallel' is set then slabs of the region are extracted concurrently.
+		void extractRegion(const Box3i& region, MaterialId* data, const Vector3i64& strides, bool parallel = true) const;
+		void extractRegion(const Box3i& region, MaterialId* data, bool parallel = true) const;
+
+		// Fills the region with voxels from the generator. Nodes of the region are built bottom-up in parallel (with
+		// uniform nodes skipped if the generator can classify them) and then deduplicated and spliced into the volume.
+		void generate(const Box3i& region, const Generator& generator);
+
 		void fillBrush(const Brush& brush, MaterialId matId);
 		uint32 fillBrush(const Brush& brush, MaterialId matId, uint32 nodeIndex, int nodeHeight, int32 nodeLowerX, int32 nodeLowerY, int32 nodeLowerZ);
 
+		// Applies many brushes as a single edit (and hence a single undo step), with later brushes overwriting earlier
+		// ones as if fillBrush() had been called for each in turn. The tree is traversed once, and each node is only
+		// visited by the brushes which straddle it, so the cost is roughly that of the union of the touched paths.
+		void fillBrushes(std::span<const Brush* const> brushes, std::span<const MaterialId> materials);
+
 		void addVolume(const Volume& rhsVolume);
 		uint32 addVolume(const Volume& rhsVolume, uint32 rhsNodeIndex, uint32 nodeIndex, int nodeHeight, int32 nodeLowerX, int32 nodeLowerY, int32 nodeLowerZ);
 
+		// Sets each voxel to 'combiner(voxel, rhsVoxel)', where 'rhsVoxel' is the voxel at the same position in the
+		// other volume, as a single edit. The other volume's nodes are first copied in (deduplicated against this
+		// volume's baked nodes), so identical subtrees in the two volumes end up with the same index. Each pair of
+		// nodes is then combined only once, and whole subtrees are skipped when the combiner makes the result
+		// obvious (e.g. the nodes are the same and 'combiner(m, m) == m' for every material). It is fastest when both
+		// volumes are baked, and then takes time proportional to their differences. The combiner is called up-front
+		// for every pair of materials, so it can be slow but must not depend on anything else.
+		void combineVolume(const Volume& rhsVolume, const std::function<MaterialId(MaterialId, MaterialId)>& combiner);
+
+		// Voxels which are not 'emptyMaterial' in the other volume are made empty.
+		void subtractVolume(const Volume& rhsVolume, MaterialId emptyMaterial = 0);
+
+		// Voxels which are 'emptyMaterial' in the other volume are made empty.
+		void intersectVolume(const Volume& rhsVolume, MaterialId emptyMaterial = 0);
+
+		// Copies each voxel of the other volume which is not 'transparentMaterial' to its position plus 'offset', as
+		// a single edit. Nodes below the height of the lowest set bit of the offset line up with nodes of the other
+		// volume, so they are combined as in combineVolume() (with whole subtrees copied by index). Only larger nodes
+		// need to be rebuilt with the content shifted, so aligning the offset to a large power of two is fastest.
+		void pasteVolume(const Volume& sourceVolume, const Vector3i& offset, MaterialId transparentMaterial = 0);
+
 		template <typename ArrayType>
 		MaterialId voxel(const ArrayType& position) const;
 		MaterialId voxel(int32_t x, int32_t y, int32_t z) const;
 
-		void bake();
+		// Baking deduplicates all nodes which are reachable from the current root and discards everything else,
+		// including the undo history. The parallel version gives exactly the same result as the serial one.
+		void bake(bool parallel = true);
+
+		// Bakes only the edit nodes, reusing existing baked nodes wherever possible and appending any new ones to the
+		// baked range. The cost is proportional to the size of the edits rather than the volume, and the undo history
+		// is preserved. Unlike bake() it does not discard baked nodes which have become unreachable.
+		void bakeEdits();
+
+		// In hash-consing mode each new or modified node is first looked up among the existing nodes, and if an
+		// identical one is found then that is used instead. Edits are then always fully deduplicated and never need
+		// baking, at the cost of a few hash map operations per node. Changing the mode bakes any outstanding edits.
+		void setHashConsing(bool hashConsing);
+
+		// Removes all nodes which are not reachable from the current root or the undo history, and returns how many
+		// were removed. A collection is also triggered automatically at the end of an edit once the number of stored
+		// nodes exceeds 'maxNodeCount', or the committed memory exceeds 'maxBytes' (zero disables either trigger).
+		// To avoid collecting after every edit once the live data alone exceeds the budget, an automatic collection
+		// is only done once the store has also doubled in size since the previous one.
+		uint32 collectGarbage();
+		void setGarbageCollectionTrigger(uint32 maxNodeCount, uint64 maxBytes = 0);
+
+		// Limits the undo history to 'maxSteps' steps, and/or to 'maxBytes' of nodes reachable from the current root
+		// and history (zero disables either limit). Once a limit is exceeded at the end of an edit the oldest steps are
+		// evicted, and for the byte limit enough are evicted to get under three quarters of it, followed by a garbage
+		// collection to reclaim the nodes. If 'spillDirectory' is given then each evicted step is written there as a
+		// compact file, and undo() loads it back in (sharing the nodes it has in common) when the history runs out.
+		void setUndoLimits(uint32 maxSteps, uint64 maxBytes = 0, const std::string& spillDirectory = "");
 
 		uint32 countNodes() const { return mDAG.countNodes(rootNodeIndex()); };
-
-		bool load(const std::string& filename);
-		void save(const std::string& filename);
+		Internals::DAGStatistics statistics() const { return mDAG.computeStatistics(rootNodeIndex()); }
+
+		// If 'mapFile' is set then the baked nodes are mapped directly from the file rather than being read
+		// into memory, so loading is near-instant and pages are only read from disk when they are accessed.
+		// The file must not be modified by other processes while the volume exists, but it is safe to save
+		// over it as saving writes a new file and then replaces the old one.
+		bool load(const std::string& filename, bool mapFile = false);
+
+		// If 'compact' is set then the nodes are written with compressed child indices, which gives much
+		// smaller files (typically a third of the size or less) at the cost of them being decoded on load rather
+		// than mapped. Either kind of file (and those from older versions) can be passed to load(). The nodes are
+		// deduplicated into a separate copy for writing, so the volume itself is not baked or otherwise modified.
+		void save(const std::string& filename, bool compact = false);
+
+		// Snapshots let other threads read the volume while it is being edited. Once they are enabled, edits copy any
+		// node they change rather than modifying it in-place (as when tracking edits), and the root is published when
+		// each edit completes. A snapshot sees the volume as of the last completed edit, and remains valid however the
+		// volume is edited until the snapshot is destroyed. Baking and garbage collection rewrite existing nodes, so
+		// while any snapshot is held they are deferred until the end of the first edit after it has been released.
+		// Only snapshot() may be called from other threads, and snapshots must be destroyed before the volume.
+		void setSnapshotsEnabled(bool snapshotsEnabled);
+		VolumeSnapshot snapshot() const;
 
 	private:
 
+		friend class VolumeSnapshot;
+
+		// Edits must not modify existing nodes if these might be referenced from the undo history or a snapshot.
+		bool copyOnWrite() const { return mTrackEdits || mSnapshotsEnabled || mPreserveNodes; }
+
+		void collectGarbageIfNeeded();
+		void enforceUndoLimits();
+		void reloadSpilledStep();
+		void discardSpilledSteps();
+		bool writeCompactFile(const std::string& filename, uint32 rootNodeIndex);
+		void runDeferredTasks();
+		void publishRootNodeIndex();
+		void releaseSnapshot() const;
+
+		struct VoxelWrite;
+		void setVoxels(std::vector<VoxelWrite>& writes);
+		uint32 setVoxels(const VoxelWrite* begin, const VoxelWrite* end, uint32 nodeIndex, int nodeHeight);
+
+		uint32 setRegion(const Box3i& region, const MaterialId* data, const Vector3i64& strides, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower);
+		uint32 buildRegionNode(const MaterialId* data, const Vector3i64& strides, int nodeHeight);
+		void extractRegion(const Box3i& region, MaterialId* data, const Vector3i64& strides, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower) const;
+
+		struct BrushBatch;
+		uint32 fillBrushes(BrushBatch& batch, uint32 nodeIndex, int nodeHeight, const Vector3i64& nodeLower, std::span<const uint32> activeBrushes);
+
+		struct CombineContext;
+		struct ImportedNodes;
+		uint32 importNode(const Internals::NodeDAG& rhsNodes, uint32 rhsNodeIndex, ImportedNodes& importedNodes);
+		uint32 combineVolume(uint32 nodeIndex, uint32 rhsNodeIndex, CombineContext& context);
+
+		struct PasteContext;
+		uint32 pasteVolume(uint32 nodeIndex, int nodeHeight, const Vector3i64& nodeLower, const std::array<uint32, 8>& sourceNodes, PasteContext& context);
+
+		struct GenerateJob;
+		void collectGenerateJobs(const Box3i& region, const Generator& generator, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower, std::vector<GenerateJob>& jobs) const;
+		uint32 assembleGenerated(const Box3i& region, uint32 nodeIndex, int nodeHeight, const Vector3i& nodeLower, const GenerateJob*& nextJob, const GenerateJob* endJob);
+
 		friend Internals::NodeDAG& Internals::getNodes(Volume& volume);
 		friend const Internals::NodeDAG& Internals::getNodes(const Volume& volume);
 		//friend uint32& Internals::getRootNodeIndex(Volume& volume);
@@ -206,6 +780,40 @@ namespace Cubiquity
 		bool mTrackEdits = false;
 		std::vector<uint32> mRootNodeIndices;
 		uint32 mCurrentRoot = 0;
+
+		// Set during an edit which reads from the volume's own nodes, so that they are not modified in-place.
+		bool mPreserveNodes = false;
+
+		// The depth of nested transactions, and whether the current one has added an undo step yet.
+		uint32 mEditDepth = 0;
+		bool mEditStepAdded = false;
+
+		uint32 mGarbageNodeThreshold = 0;
+		uint64 mGarbageByteThreshold = 0;
+		uint32 mNodesAfterLastCollection = 0;
+
+		// Undo limits (see setUndoLimits()). The byte limit is only checked again once the store has grown by a quarter
+		// since the last check, and spilled steps are held in files (oldest first) which are deleted once reloaded. The
+		// files are in a subdirectory of the spill directory, which only exists while there are spilled steps.
+		uint32 mMaxUndoSteps = 0;
+		uint64 mMaxUndoBytes = 0;
+		uint32 mUndoCheckNodeCount = 0;
+		std::string mUndoSpillDirectory;
+		std::string mSpillSubdirectory;
+		std::vector<std::string> mSpilledSteps;
+		uint32 mSpilledStepCounter = 0;
+
+		// Snapshots are taken and released under the mutex, which is also held while publishing a root and while
+		// baking, collecting garbage or loading (so that no snapshot can be taken part way through). It is recursive
+		// as these can call each other.
+		bool mSnapshotsEnabled = false;
+		mutable std::recursive_mutex mSnapshotMutex;
+		mutable uint32 mSnapshotCount = 0;
+		uint32 mPublishedRootNodeIndex = 0;
+		uint64 mPublishedEpoch = 0;
+		bool mBakeDeferred = false;
+		bool mBakeEditsDeferred = false;
+		bool mCollectionDeferred = false;
 	};
 
 	// Implementation of templatised accessors
@@ -218,19 +826,138 @@ namespace Cubiquity
 	{
 		setVoxel(position[0], position[1], position[2], matId);
 	}
-}
 
-namespace std
-{
-	template<>
-	struct hash<Cubiquity::Internals::Node>
+	// Fills the region with 'functor(x, y, z)', which must be safe to call from multiple threads. If the functor also
+	// has a 'classify(const Box3i&)' member then it is used as in Generator::classify(), to skip uniform nodes.
+	template <typename Functor>
+	void generate(Volume& volume, const Box3i& region, Functor&& functor)
 	{
-		Cubiquity::uint32 seed = 0;
+		class FunctorGenerator : public Generator
+		{
+		public:
+			FunctorGenerator(Functor& functor) : mFunctor(functor) {}
 
-		std::size_t operator()(const Cubiquity::Internals::Node& node) const noexcept
+			MaterialId voxel(int32 x, int32 y, int32 z) const override { return mFunctor(x, y, z); }
+
+			std::optional<MaterialId> classify(const Box3i& bounds) const override
+			{
+				if constexpr (requires { mFunctor.classify(bounds); }) { return mFunctor.classify(bounds); }
+				else { return std::nullopt; }
+			}
+
+		private:
+			Functor& mFunctor;
+		};
+
+		volume.generate(region, FunctorGenerator(functor));
+	}
+
+	// Gives fast access to voxels which are close to each other, such as when iterating over a region or sampling a
+	// neighbourhood. The sampler keeps the path from the root to the current voxel, and on moving only re-descends
+	// from the smallest node which contains both the old and the new positions. Moving to an adjacent voxel usually
+	// only needs one or two steps. A sampler sees the volume as it was when reset(), and must be reset after an edit.
+	class VolumeSampler
+	{
+	public:
+		VolumeSampler() = default;
+		VolumeSampler(const Volume& volume) { reset(volume); }
+
+		void reset(const Volume& volume);
+
+		void setPosition(int32 x, int32 y, int32 z)
 		{
-			return Cubiquity::Internals::murmurHash3(&(node[0]), sizeof(uint32_t) * 8, seed);
+			// Map to unsigned space to match the tree structure (as in Volume::voxel()).
+			const uint32 ux = static_cast<uint32>(x) ^ (1UL << 31);
+			const uint32 uy = static_cast<uint32>(y) ^ (1UL << 31);
+			const uint32 uz = static_cast<uint32>(z) ^ (1UL << 31);
+
+			// The lowest common ancestor is just above the highest bit at which the positions differ. If
+			// that is not above the material node we reached last time then we are still inside it.
+			const int commonHeight = std::bit_width((ux ^ mUx) | (uy ^ mUy) | (uz ^ mUz));
+			mUx = ux;
+			mUy = uy;
+			mUz = uz;
+			if (commonHeight > mHeight) { descend(commonHeight); }
 		}
+
+		template <typename ArrayType>
+		void setPosition(const ArrayType& position) { setPosition(position[0], position[1], position[2]); }
+
+		void moveX(int32 offset = 1) { setPosition(x() + offset, y(), z()); }
+		void moveY(int32 offset = 1) { setPosition(x(), y() + offset, z()); }
+		void moveZ(int32 offset = 1) { setPosition(x(), y(), z() + offset); }
+
+		int32 x() const { return static_cast<int32>(mUx ^ (1UL << 31)); }
+		int32 y() const { return static_cast<int32>(mUy ^ (1UL << 31)); }
+		int32 z() const { return static_cast<int32>(mUz ^ (1UL << 31)); }
+
+		MaterialId voxel() const { return static_cast<MaterialId>(mNodeStack[mHeight]); }
+
+	private:
+		void descend(int height);
+
+		const Internals::NodeDAG* mDAG = nullptr;
+
+		// The current position, mapped to unsigned space.
+		uint32 mUx = 0;
+		uint32 mUy = 0;
+		uint32 mUz = 0;
+
+		// The path from the root (at the top) down to the material node which contains the current
+		// position. That is at 'mHeight', and the entries below it are not used.
+		std::array<uint32, 33> mNodeStack = {};
+		int mHeight = 0;
+	};
+
+	// A read-only copy of a volume which uses the SparseNodeStore layout, typically needing less than half the memory
+	// of the original. It supports queries and rendering (see intersectVolume() and VisibilityCalculator) but not edits,
+	// so it suits volumes which are loaded once and then only viewed. It is not updated if the source volume changes.
+	// Merging mirrored nodes makes the copy slower to build, but can save a lot more memory for symmetric content.
+	// Node offsets are limited to 29 bits, so a volume which would need more than 2 GiB throws std::length_error.
+	class SparseVolume
+	{
+	public:
+		SparseVolume(const Volume& volume, bool mergeMirroredNodes = false);
+
+		MaterialId voxel(int32 x, int32 y, int32 z) const;
+
+		uint32 rootNodeIndex() const { return mRootNodeIndex; }
+		const Internals::SparseNodeStore& nodes() const { return mNodes; }
+
+	private:
+		Internals::SparseNodeStore mNodes;
+		uint32 mRootNodeIndex;
+	};
+
+	// An immutable view of a volume as of the last edit which had completed when Volume::snapshot() was called. It can
+	// be read from any thread (see also intersectVolume()) while the volume continues to be edited on another.
+	class VolumeSnapshot
+	{
+	public:
+		VolumeSnapshot() = default;
+		VolumeSnapshot(VolumeSnapshot&& other) noexcept { *this = std::move(other); }
+		VolumeSnapshot& operator=(VolumeSnapshot&& other) noexcept;
+		VolumeSnapshot(const VolumeSnapshot&) = delete;
+		VolumeSnapshot& operator=(const VolumeSnapshot&) = delete;
+		~VolumeSnapshot() { release(); }
+
+		// Releases the snapshot early, after which it must not be read.
+		void release();
+
+		MaterialId voxel(int32 x, int32 y, int32 z) const;
+
+		uint32 rootNodeIndex() const { return mRootNodeIndex; }
+		const Internals::NodeDAG& nodes() const { return mVolume->mDAG; }
+
+		// Incremented by every published change to the volume, so equal epochs mean equal content.
+		uint64 epoch() const { return mEpoch; }
+
+	private:
+		friend class Volume;
+
+		const Volume* mVolume = nullptr;
+		uint32 mRootNodeIndex = 0;
+		uint64 mEpoch = 0;
 	};
 }
 
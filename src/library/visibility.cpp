@@ -20,6 +20,7 @@
 #include <cmath>
 #include <cstring>
 #include <stack>
+#include <type_traits>
 #include <vector>
 
 namespace Cubiquity
@@ -703,12 +704,18 @@ namespace Cubiquity
 		mVisMask = nullptr;
 	}
 
+	// The functions below work with both normal and sparse volumes, and access the nodes of either through these.
+	const NodeStore& getNodeStore(const Volume& volume) { return getNodes(volume).nodes(); }
+	const SparseNodeStore& getNodeStore(const SparseVolume& volume) { return volume.nodes(); }
+	uint32 getRootNodeIndex(const SparseVolume& volume) { return volume.rootNodeIndex(); }
+
 	// This function finds the material to use for a node. Only leaf nodes have a valid material, so for a given node it 
 	// descends the tree to find the (approx) nearest non-zero leaf node to the camera, and then takes the material from that.
 	// Note: This functions requres a camera position. How might a 'generic' version work without this? Just take the centre
 	// leaf? Or the first non-zero one we find for a fixed traversal order? Or look at all the leaves and find the most common
 	// (could be slow)? Might need a solution to this if we ever want to do it in a view-independant way.
-	uint32_t getMaterialForNode(float centreX, float centreY, float centreZ, uint32_t nodeIndex, const Volume* volume, const Vector3d& cameraPos)
+	template <typename VolumeType>
+	uint32_t getMaterialForNode(float centreX, float centreY, float centreZ, uint32_t nodeIndex, const VolumeType* volume, const Vector3d& cameraPos)
 	{
 		// When descending the tree I believe it would be more correct to compute the nearest child for every iteration.
 		// If the camera is close to a node and near to the centre of one of it's faces then I think the nearest corner
@@ -720,7 +727,7 @@ namespace Cubiquity
 		if (cameraPos.y() > centreY) nearestChild |= 0x02;
 		if (cameraPos.z() > centreZ) nearestChild |= 0x04;
 
-		const NodeStore& nodeData = getNodes(*volume).nodes();
+		const auto& nodeData = getNodeStore(*volume);
 
 		while (!isMaterialNode(nodeIndex))
 		{
@@ -745,7 +752,8 @@ namespace Cubiquity
 	}
 
 	// Note: We should probably make this operate on integers instead of floats.
-	Vector3f computeNodeNormalRecursive(uint32 nodeIndex, const NodeStore& nodeData, int depth)
+	template <typename NodeStoreType>
+	Vector3f computeNodeNormalRecursive(uint32 nodeIndex, const NodeStoreType& nodeData, int depth)
 	{
 		// Material nodes have no children, so we can't compute a normal for them.
 		if (isMaterialNode(nodeIndex))
@@ -753,7 +761,7 @@ namespace Cubiquity
 			return { 0.0f, 0.0f, 0.0f };
 		}
 
-		Node node = nodeData[nodeIndex];
+		const auto node = nodeData[nodeIndex];
 
 		Vector3f normal = { 0.0f, 0.0f, 0.0f };
 		for (uint32_t z = 0; z < 2; z++)
@@ -801,7 +809,8 @@ namespace Cubiquity
 		return normal;
 	}
 
-	Vector3f estimateNormalFromNeighbours(float x, float y, float z, uint32_t size, const Volume* volume)
+	template <typename VolumeType>
+	Vector3f estimateNormalFromNeighbours(float x, float y, float z, uint32_t size, const VolumeType* volume)
 	{
 		Vector3f centre = { x, y, z };
 
@@ -811,6 +820,8 @@ namespace Cubiquity
 		fSize *= fudgeFactor; // results in a smoother normal.
 
 		Vector3f normal = {};
+		[[maybe_unused]] VolumeSampler sampler;
+		if constexpr (std::is_same_v<VolumeType, Volume>) { sampler.reset(*volume); }
 
 		for (int zOffset = -1; zOffset <= 1; zOffset += 1)
 		{
@@ -823,7 +834,17 @@ namespace Cubiquity
 
 					Vector3f pos = centre + offset;
 
-					bool occupied = volume->voxel(pos.x() + 0.5f, pos.y() + 0.5f, pos.z() + 0.5f);
+					bool occupied;
+					if constexpr (std::is_same_v<VolumeType, Volume>)
+					{
+						sampler.setPosition(pos.x() + 0.5f, pos.y() + 0.5f, pos.z() + 0.5f);
+						occupied = sampler.voxel();
+					}
+					else
+					{
+						// There is no sampler for sparse volumes, but there are only a few voxels to look up.
+						occupied = volume->voxel(pos.x() + 0.5f, pos.y() + 0.5f, pos.z() + 0.5f);
+					}
 
 					if (!occupied)
 					{
@@ -837,6 +858,17 @@ namespace Cubiquity
 	}
 
 	uint32_t VisibilityCalculator::findVisibleOctreeNodes(const Volume* volume, CameraData* cameraData, NormalEstimation normalEstimation, bool subdivideMaterialNodes, Glyph* glyphs, uint32_t maxGlyphCount)
+	{
+		return findVisibleNodes(volume, cameraData, normalEstimation, subdivideMaterialNodes, glyphs, maxGlyphCount);
+	}
+
+	uint32_t VisibilityCalculator::findVisibleOctreeNodes(const SparseVolume* volume, CameraData* cameraData, NormalEstimation normalEstimation, bool subdivideMaterialNodes, Glyph* glyphs, uint32_t maxGlyphCount)
+	{
+		return findVisibleNodes(volume, cameraData, normalEstimation, subdivideMaterialNodes, glyphs, maxGlyphCount);
+	}
+
+	template <typename VolumeType>
+	uint32_t VisibilityCalculator::findVisibleNodes(const VolumeType* volume, CameraData* cameraData, NormalEstimation normalEstimation, bool subdivideMaterialNodes, Glyph* glyphs, uint32_t maxGlyphCount)
 	{
 		mNormalEstimation = normalEstimation;
 		mSubdivideMaterialNodes = subdivideMaterialNodes;
@@ -885,11 +917,12 @@ namespace Cubiquity
 		return glyphCount;
 	}
 
+	template <typename VolumeType>
 	void VisibilityCalculator::processNode(uint32 nodeIndex, const Vector3d& nodeCentre, const Vector3d& nodeCentreViewSpace, uint32 nodeHeight, const Vector3f& nodeNormal,
-										   const Volume* volume, CameraData* cameraData, Glyph* glyphs, uint32_t maxGlyphCount, uint32_t& glyphCount)
+										   const VolumeType* volume, CameraData* cameraData, Glyph* glyphs, uint32_t maxGlyphCount, uint32_t& glyphCount)
 	{
-		const NodeStore& nodeData = getNodes(*volume).nodes();
-		const Node& node = nodeData[nodeIndex];
+		const auto& nodeData = getNodeStore(*volume);
+		const auto& node = nodeData[nodeIndex];
 
 		const uint32 childHeight = nodeHeight - 1;
 		const double childSize = static_cast<double>(uint32(1) << childHeight);
@@ -226,8 +226,11 @@ namespace Cubiquity
 
 		uint32_t findVisibleOctreeNodes(const Volume* volume, CameraData* cameraData, NormalEstimation normalEstimation,
 			                            bool subdivideMaterialNodes, Glyph* glyphs, uint32_t maxGlyphCount);
+		uint32_t findVisibleOctreeNodes(const SparseVolume* volume, CameraData* cameraData, NormalEstimation normalEstimation,
+			                            bool subdivideMaterialNodes, Glyph* glyphs, uint32_t maxGlyphCount);
+		template <typename VolumeType>
 		void processNode(uint32 nodeIndex, const Vector3d& nodeCentre, const Vector3d& nodeCentreViewSpace, uint32 nodeHeight, const Vector3f& nodeNormal,
-						 const Volume* volume, CameraData* cameraData, Glyph* glyphs, uint32_t maxGlyphCount, uint32_t& glyphCount);
+						 const VolumeType* volume, CameraData* cameraData, Glyph* glyphs, uint32_t maxGlyphCount, uint32_t& glyphCount);
 
 		float mMaxFootprintSize;
 
@@ -238,6 +241,10 @@ namespace Cubiquity
 		std::array<std::array<Vector3d, 8>, 32> mCubeVerticesViewSpace;
 
 	private:
+		template <typename VolumeType>
+		uint32_t findVisibleNodes(const VolumeType* volume, CameraData* cameraData, NormalEstimation normalEstimation,
+			                      bool subdivideMaterialNodes, Glyph* glyphs, uint32_t maxGlyphCount);
+
 		NormalEstimation mNormalEstimation;
 
 		// It's not yet clear how useful this setting is. Subdividing material nodes greatly increases the number of
@@ -707,6 +707,44 @@ void doPerVoxelVoxelisation(Volume& volume, Mesh& mesh, MaterialId fill, Materia
 	}
 }
 
+// Gathers voxel writes and applies them with Volume::setVoxels() in chunks of a bounded size, so that memory use does
+// not grow with the surface area of the mesh. Writes are applied in the order they were made (later ones take priority)
+// and repeats of the previous voxel (common where adjacent triangles overlap) are merged before they are stored.
+class VoxelWriteBatch
+{
+public:
+	VoxelWriteBatch(Volume& volume) : mVolume(volume) {}
+
+	void setVoxel(int32 x, int32 y, int32 z, MaterialId matId)
+	{
+		const Vector3i position({ x, y, z });
+		if (!mPositions.empty() && mPositions.back() == position)
+		{
+			mMaterials.back() = matId;
+			return;
+		}
+
+		if (mPositions.size() == MaxSize) { flush(); }
+		mPositions.push_back(position);
+		mMaterials.push_back(matId);
+	}
+
+	void flush()
+	{
+		if (mPositions.empty()) { return; }
+		mVolume.setVoxels(mPositions, mMaterials);
+		mPositions.clear();
+		mMaterials.clear();
+	}
+
+private:
+	static constexpr size_t MaxSize = 64 * 1024;
+
+	Volume& mVolume;
+	std::vector<Vector3i> mPositions;
+	std::vector<MaterialId> mMaterials;
+};
+
 void voxelize(Volume& volume, Mesh& mesh, MaterialId fill, MaterialId background)
 {
 	// TODO - Need to think how triangle colours and fill colour should be used if one, 
@@ -727,11 +765,13 @@ void voxelize(Volume& volume, Mesh& mesh, MaterialId fill, MaterialId background
 			// surface is high-frequency anyway, but if e.g. two surfaces come close together then a set of
 			// eight voxels can all be set which would then be pruned. The checkerboard does not prevent DAG
 			// deduplication, but that does not happen automatically anyway.
+			VoxelWriteBatch batch(volume);
 			drawTriangles(mesh.triangles, mesh.materials, -1.0,
 				[&](int32 x, int32 y, int32 z, MaterialId matId) {
 					MaterialId checkerboard = ((x & 0x1) ^ (y & 0x1) ^ (z & 0x1));
-					volume.setVoxel(x, y, z, background + checkerboard + 1);
+					batch.setVoxel(x, y, z, background + checkerboard + 1);
 				});
+			batch.flush();
 
 			doPerNodeVoxelisation(volume, mesh, fill, background);
 		} else {
@@ -745,6 +785,7 @@ void voxelize(Volume& volume, Mesh& mesh, MaterialId fill, MaterialId background
 		// 
 		// Note that the triangle order can matter when multiple triangles pass close to a voxel,
 		// and by drawing them in the user-supplied order we let the user control the result.
+		// The writes here are not batched because each one depends on the current voxel value.
 		drawTriangles(mesh.triangles, mesh.materials, 1.0,
 			[&](int32 x, int32 y, int32 z, MaterialId matId) {
 				if (volume.voxel(x, y, z) != background || mesh.isThin) {
@@ -752,10 +793,11 @@ void voxelize(Volume& volume, Mesh& mesh, MaterialId fill, MaterialId background
 				}
 			});
 	} else { // Fall back to just drawing the shell of the object (in user-supplied order, as above)
-		auto draw = [&](int32 x, int32 y, int32 z, MaterialId matId) {
-			volume.setVoxel(x, y, z, matId);
-			};
-		drawTriangles(mesh.triangles, mesh.materials, -1.0, draw);
+		// Batched writes are applied in submission order, so later triangles still take priority.
+		VoxelWriteBatch batch(volume);
+		drawTriangles(mesh.triangles, mesh.materials, -1.0,
+			[&](int32 x, int32 y, int32 z, MaterialId matId) { batch.setVoxel(x, y, z, matId); });
+		batch.flush();
 	}
 }
 